@@ -13,32 +13,86 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <math.h>
 
 #if !defined(_WIN32) || defined(__CYGWIN__)
     #include <sys/types.h>
     #include <pwd.h>
+    #include <time.h>
+    #include <unistd.h>
+    /* shared memory geolinking */
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    /* --render worker processes */
+    #include <sys/wait.h>
+    #include <errno.h>
 #else
     /* GetCurrentProcessId() */
     #include <windows.h>
 #endif
 
+/* vector versions of the stretch. The scalar code is always there as well */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+    #define HAVE_SSE2_KERNEL
+    #include <emmintrin.h>
+    #if defined(__GNUC__) || defined(_MSC_VER)
+        /* built for AVX2 whatever the flags, and only used if the CPU has it */
+        #define HAVE_AVX2_KERNEL
+        #include <immintrin.h>
+        #ifdef _MSC_VER
+            #include <intrin.h>
+            #define TARGET_AVX2
+        #else
+            #define TARGET_AVX2 __attribute__((target("avx2")))
+        #endif
+    #endif
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+    #define HAVE_NEON_KERNEL
+    #include <arm_neon.h>
+#endif
+
 #include "caca.h"
 #include "gdal.h"
 #include "cpl_string.h"
+#include "cpl_multiproc.h"
+#include "cpl_virtualmem.h"
+#include "cpl_minixml.h"
+
+#if GDAL_VERSION_NUM < GDAL_COMPUTE_VERSION(2, 2, 0)
+    #error "GDAL 2.2 or later is needed for GDALGetDataCoverageStatus() and GDALRasterIOEx()"
+#endif
 
 /* Local macros */
 #define STATUS_DITHERING 1
 #define STATUS_ANTIALIASING 2
 #define STATUS_BACKGROUND 3
 
+/* Layers of the display, each only redone by the main loop when dirty */
+#define LAYER_SOURCE 1 /* pixels read and stretched by the loader for the extent */
+#define LAYER_DITHER 2 /* libcaca dither of the pixels and its settings */
+#define LAYER_CANVAS 4 /* pixels dithered onto the canvas with the status and help */
+
 #define ZOOM_IN_FACTOR 0.9
 #define ZOOM_OUT_FACTOR 1.1
 #define PAN_STEP 0.2
+#define SHIFT_TOLERANCE 1e-3 /* of a pixel, for a pan to count as a shift */
+#define PREVIEW_MIN_PIX_PER_CELL 0.25 /* coarsest overview a preview is read from */
+#define BLOCK_READ_COST 4096 /* overhead of fetching a block, in pixels decoded */
 #define GAMMA_FACTOR 1.04f
 #define GAMMA_MAX 100
 #define GAMMA(g) (((g) < 0) ? 1.0 / gammatab[-(g)] : gammatab[(g)])
-#define PIX_PER_CELL 10
+#define PIX_PER_CELL 10 /* maximum we read */
+#define PIPELINE_BLOCK_BYTES (256 * 1024) /* raw data read at a time */
+#define INT16_LUT_OFFSET 32768 /* so the lookup table starts at the smallest Int16 */
+#define DEFAULT_QUALITY 4 /* pixels per cell when antialiasing */
 #define GEOLINK_TIMEOUT 1000000
+#define GEOLINK_SHARED_TIMEOUT 20000 /* nothing is read from disk to check the segment */
+#define GEOLINK_SHARED_PREFIX "shm:"
+#define GEOLINK_WRITE_TRIES 100 /* milliseconds before taking over from a writer that died */
+#define LOADER_POLL_TIMEOUT 20000
+#define KEY_REPEAT_TIMEOUT 30000 /* wait for the next key of a burst before loading */
+#define MAX_KEY_REPEAT_WAITS 10 /* so holding a key down still shows something */
 
 /* tell libcaca how we have encoded the bytes */
 /* red, then green, then blue */
@@ -59,6 +113,27 @@
 /* For estimatic stats if they aren't available */
 #define MIN_OVERVIEW_STATS 100
 #define MAX_OVERVIEW_STATS 400
+#define HIST_SAMPLE_SIZE 512 /* sample read across for the histogram stretch */
+#define HIST_BUCKETS 1024
+#define MAX_STATS_CACHE_LINES 4096 /* compacted when it has more than this */
+
+/* Stages of getting a frame up that are timed for --benchmark, */
+/* the performance readout and --perf-log */
+#define STAGE_OPEN 0
+#define STAGE_STATISTICS 1
+#define STAGE_OVERVIEW 2 /* choosing the overview to read */
+#define STAGE_RASTERIO 3
+#define STAGE_STRETCH 4 /* and colour table lookups */
+#define STAGE_INTERLEAVE 5 /* putting the bands together into the image */
+#define STAGE_DITHER 6
+#define STAGE_REFRESH 7 /* caca_refresh_display */
+#define NUM_STAGES 8
+#define BENCHMARK_LINE_SIZE 1024
+#define BENCHMARK_KEYS 1 /* line types of the script */
+#define BENCHMARK_EXTENT 2
+#define BENCHMARK_END 3
+#define RENDER_DEFAULT_WIDTH 80 /* cells of a --render snapshot */
+#define RENDER_DEFAULT_HEIGHT 40
 
 /* libcaca/libcaca contexts */
 caca_canvas_t *cv;
@@ -67,6 +142,8 @@ caca_display_t *dp;
 /* Area for printing GDAL error messages */
 #define GDAL_ERROR_SIZE 1024
 char szGDALMessages[GDAL_ERROR_SIZE];
+CPLMutex *hGDALMessagesMutex = NULL; /* for the loader and read threads, see set_read_error */
+CPLMutex *hStatsSampleMutex = NULL; /* the read threads add to the samples together */
 
 /* Default stretch rules */
 char *pszDefaultStretchRules[] = {"equal,1,1:colortable,none,,1",
@@ -77,15 +154,39 @@ char *pszDefaultStretchRules[] = {"equal,1,1:colortable,none,,1",
                                   "greater,5,-1:rgb,stddev,2.0,5|4|2", NULL
                                  };
 
+/* GDAL settings for object storage, used unless already set in the environment */
+char *pszCloudConfigOptions[] = {"GDAL_HTTP_MULTIRANGE", "YES",
+                                 "VSI_CACHE", "TRUE",
+                                 "CPL_VSIL_CURL_CACHE_SIZE", "134217728", NULL
+                                };
+
+/* and only for files that really are remote, as it hides the .ovr */
+/* and .aux.xml next to a local file */
+char *pszRemoteConfigOptions[] = {"GDAL_DISABLE_READDIR_ON_OPEN", "EMPTY_DIR", NULL};
+
+/* names GDAL reads over the network */
+char *pszRemotePrefixes[] = {"/vsicurl", "/vsis3", "/vsigs", "/vsiaz", "/vsiadls",
+                             "/vsioss", "/vsiswift", "/vsiwebhdfs", "http://", "https://", NULL
+                            };
+
+#define CLOUD_ACCESS_OFF 0
+#define CLOUD_ACCESS_ON 1
+#define CLOUD_ACCESS_AUTO 2 /* only for remote files */
+
+/* Sections of the config file. Lines before any are the viewer's own settings */
+#define CONFIG_SECTION_VIEWER 0
+#define CONFIG_SECTION_PERFORMANCE 1 /* GDAL config options */
+#define CONFIG_SECTION_OTHER 2 /* not known, so ignored */
+
+/* Several files are shown as one through a VRT written here, with one */
+/* for each of its overview levels made from the files' own overviews. */
+/* The files are described fully in them so GDAL only opens one when a */
+/* read touches it, keeping at most MOSAIC_MAX_OPEN_FILES open at once */
+#define MOSAIC_FILENAME "/vsimem/gdalcacaview_mosaic.vrt"
+#define MOSAIC_OVERVIEW_FILENAME "/vsimem/gdalcacaview_mosaic_%d.vrt"
+#define MOSAIC_MAX_OPEN_FILES 64
+#define MOSAIC_SOURCE_BAND 0 /* in the statistics cache, for what the mosaic needs of a file */
 
-/* stolen from common-image.h */
-struct image
-{
-    char *pixels;
-    unsigned int w, h;
-    struct caca_dither *dither;
-    void *priv;
-};
 
 /* constants from TuiView */
 #define VIEWER_COMP_LT 0
@@ -102,6 +203,11 @@ struct image
 #define VIEWER_STRETCHMODE_NONE 1 /* color table, or pre stretched data */
 #define VIEWER_STRETCHMODE_LINEAR 2
 #define VIEWER_STRETCHMODE_STDDEV 3
+#define VIEWER_STRETCHMODE_HIST 4 /* stretchparam is the fraction to clip off each end */
+
+/* TuiView's defaults for the histogram stretch */
+#define VIEWER_DEFAULT_HISTMIN 0.025
+#define VIEWER_DEFAULT_HISTMAX 0.01
 
 struct stretch
 {
@@ -128,12 +234,67 @@ struct extent
     double dCentreX, dCentreY, dMetersPerCell;
 };
 
+/* stolen from common-image.h */
+struct image
+{
+    char *pixels;
+    unsigned int w, h;
+    struct caca_dither *dither;
+    void *priv;
+    /* what the pixels cover */
+    struct extent extent;
+    int nCellsX, nCellsY;
+    int nPixPerCell;
+};
+
 struct statisticsForBand
 {
     double dMin;
     double dMax;
     double dMean;
     double dStdDev;
+    unsigned char *pLUT; /* stretched value for each integer value, if any */
+    int bEstimated; /* provisional or from the samples - the loader will compute the real ones */
+    int bProvisional; /* not from the file at all, see stats_provisional */
+    /* what was stretched with the provisional statistics, see stats_sample */
+    GIntBig nSamples;
+    double dSampleMin, dSampleMax, dSampleSum, dSampleSumSq;
+    double dHistMin, dHistMax; /* where the histogram stretch clips */
+    /* read from the band when the file is opened */
+    int bHasNoData;
+    double dNoData; /* always stretched to 0 */
+    int nMaskFlags; /* if there is a mask band other than nodata, so it is read with the data */
+};
+
+/* what do_stretch works from for floating point data */
+struct stretchParams
+{
+    float fMin, fMax; /* at or below fMin is 0, at or above fMax is 255 */
+    float fOffset, fScale; /* otherwise (value - fOffset) * fScale */
+    int bNoData; /* fNoData is always 0 */
+    float fNoData;
+};
+
+/* Colours of a thematic layer, read from the RAT when the file is opened */
+struct colourTable
+{
+    unsigned char *pRGB; /* IMG_DEPTH bytes for each row and black at the end */
+    int nEntries; /* rows of the RAT. Values outside 0 to nEntries-1 are black */
+};
+
+/* A level of a band's pyramid, captured when the file is opened so */
+/* choosing one doesn't go back to GDAL for every frame */
+struct pyramidLevel
+{
+    int width, height;
+    double dXFactor, dYFactor; /* full resolution pixels per pixel of the level */
+    int nBlockXSize, nBlockYSize;
+};
+
+struct bandPyramid
+{
+    int nLevels; /* level 0 is full resolution, then overviewIndex+1 */
+    struct pyramidLevel *pasLevels;
 };
 
 struct gdalFile
@@ -143,21 +304,400 @@ struct gdalFile
     struct stretch *stretch;
     double adfTransform[6];
     struct statisticsForBand statsForStretchBands[3];
+    struct colourTable colours; /* VIEWER_MODE_COLORTABLE only */
+    char *pszFilename; /* so the read threads can open their own handles */
+    char *pszStatsKey; /* identifies the file in the statistics cache. NULL if not cacheable */
+    GDALDatasetH hRulesDS; /* the stretch rules are matched against, ds or a mosaic's first file */
+    int bStatsEstimated; /* some of statsForStretchBands are estimates */
+
+    /* a colour table stretch is shown as greyscale until the loader has */
+    /* looked at the RAT in the background, and re-evaluated pStretchRules */
+    /* unless the stretch was given on the command line */
+    struct stretch interimStretch;
+    struct stretch *pPendingStretch; /* NULL once it has */
+    struct stretchlist *pStretchRules;
+
+    struct bandPyramid *pasPyramids; /* for each band of the file */
+    int nPyramidBands;
+};
+
+/* Tile cache. Tiles hold already stretched 8 bit data for one band */
+/* (or RGB for a colour table) at a given overview level and decimation */
+#define TILE_SIZE 256
+#define TILE_HASH_SIZE 4099
+#define DEFAULT_CACHE_SIZE 128 /* MB */
+#define PREFETCH_ZOOM_STEPS 8 /* how far to look for the next level */
+
+struct tileKey
+{
+    GDALDatasetH ds;
+    int band;
+    int level; /* 0 is full res, otherwise overview+1 */
+    int decimation; /* subsampling on top of the level, a power of 2 */
+    int tx, ty;
+};
+
+struct tile
+{
+    struct tileKey key;
+    unsigned char *data; /* TILE_SIZE * TILE_SIZE * nChannels */
+    int nChannels;
+    int nPinned; /* in use by the current load - don't evict */
+    struct tile *hashNext;
+    struct tile *lruPrev, *lruNext;
+};
+
+struct tileCache
+{
+    struct tile *hash[TILE_HASH_SIZE];
+    struct tile *lruHead, *lruTail; /* head is most recently used */
+    size_t nBytes, nMaxBytes;
+};
+
+/* where an extent falls in pixels of a level */
+struct levelWindow
+{
+    int overviewIndex, width, height;
+    int decimation;
+    double x1, y1, x2, y2;
+    double dXRatio, dYRatio; /* pixels of the level per buffer pixel */
+};
+
+/* Background loading */
+struct loader
+{
+    CPLMutex *hMutex;
+    CPLCond *hCond;
+    CPLJoinableThread *hThread;
+    struct gdalFile *file;
+    int bRunning, bQuit;
+
+    /* latest request from the main loop */
+    struct extent extent;
+    int nCellsX, nCellsY;
+    int nPixPerCell;
+    int nRequest;
+
+    /* request the worker is currently on */
+    int nStarted;
+
+    /* last request we read the surrounding tiles for */
+    int nPrefetched;
+
+    /* copy of the last image read so a pan can shift it along */
+    struct image *last;
+
+    /* full statistics still to be computed for estimated bands */
+    int bStatsPending;
+    /* they have been and the main loop needs to redraw */
+    int bStatsUpdated;
+
+    /* finished image (NULL on failure) waiting for the main loop */
+    int bResultReady;
+    int nResult; /* which request it was for */
+    int bPreview; /* just a coarse one - the full one is still coming */
+    struct image *result;
+};
+
+/* Threads that share out the reads for the loader. GDAL handles can't */
+/* be shared between threads so each opens its own dataset, on the thread */
+/* so the first frame doesn't wait for them all to be opened */
+#define MAX_READ_THREADS 16
+#define MIN_STRIPE_ROWS 32 /* don't split an image up more finely than this */
+
+struct readPool
+{
+    CPLMutex *hMutex;
+    CPLCond *hWorkCond, *hDoneCond;
+    int nThreads; /* including the loader thread which uses the main handle */
+    CPLJoinableThread *ahThread[MAX_READ_THREADS];
+    char *pszFilename;
+    int bQuit;
+
+    /* current batch */
+    void (*pfnJob)(GDALDatasetH, int, void *);
+    void *pJobData;
+    int nJobs, nNextJob, nJobsDone;
+};
+
+/* Overviews built in the background for a file without any. They go */
+/* next to the file or, if that can't be written, to pszOverviewCacheDir */
+/* which GDAL is told about through GDAL_PAM_PROXY_DIR */
+#define OVERVIEW_MIN_SIZE 256 /* the coarsest level built is at least this big */
+#define OVERVIEW_RESAMPLING "NEAREST" /* the fastest, and keeps thematic values */
+#define MAX_OVERVIEW_LEVELS 24
+#define OVERVIEW_POLL_TIMEOUT 250000
+#define OVERVIEW_BUILD_NONE 0
+#define OVERVIEW_BUILD_RUNNING 1
+#define OVERVIEW_BUILD_DONE 2
+#define OVERVIEW_BUILD_FAILED 3
+
+struct overviewBuild
+{
+    CPLMutex *hMutex;
+    CPLJoinableThread *hThread;
+    char *pszFilename;
+    double dProgress;
+    int nState;
+    int bCancel;
+};
+
+/* Datasets opened on an overview level of the file so the bands of the */
+/* level can be read together. There is one for each level, used by one */
+/* thread at a time, and the others read band by band meanwhile */
+#define MAX_LEVEL_DATASETS 32 /* by overview index, coarser ones aren't opened */
+
+struct levelDataset
+{
+    int bOpened;
+    int bInUse;
+    GDALDatasetH hLevelDS; /* NULL if the driver couldn't open it */
+};
+
+struct levelDatasets
+{
+    CPLMutex *hMutex;
+    struct levelDataset aEntries[MAX_LEVEL_DATASETS];
+};
+
+/* Bands of uncompressed local files mapped into memory with */
+/* GDALGetVirtualMemAuto, so their samples are stretched straight from */
+/* the mapping rather than copied out through the block cache by RasterIO. */
+/* Only used by the thread that owns the handle */
+#define MAX_BAND_MAPPINGS 256
+
+struct bandMapping
+{
+    GDALRasterBandH hBand;
+    CPLVirtualMem *pVMem; /* NULL if the band can't be mapped */
+    const GByte *pData;
+    int nPixelSpace;
+    GIntBig nLineSpace;
+};
+
+struct bandMappings
+{
+    CPLMutex *hMutex;
+    int nCount;
+    struct bandMapping aEntries[MAX_BAND_MAPPINGS];
+};
+
+/* Pixel buffers of images kept for the next image rather than freed. */
+/* The images alive at once are the one shown, the loader's result and */
+/* preview, its copy of the last and the one being read */
+#define FRAME_POOL_SIZE 6
+
+struct frameBuffer
+{
+    char *pixels;
+    size_t nBytes; /* allocated */
+    int bInUse;
+};
+
+struct framePool
+{
+    CPLMutex *hMutex;
+    struct frameBuffer aBuffers[FRAME_POOL_SIZE];
+};
+
+/* Time spent in each stage, summed over all the threads so it can be */
+/* more than the wall time, and what was read */
+struct perfCounters
+{
+    double adSeconds[NUM_STAGES];
+    GIntBig nSampleBytes; /* of the buffers RasterIO filled, in the types read, not what came off disk */
+    int nTileHits, nTileMisses;
+};
+
+/* The counters since they were last taken */
+struct stageTimes
+{
+    CPLMutex *hMutex;
+    int bEnabled; /* nothing is counted unless something is looking */
+    struct perfCounters counters;
+};
+
+/* Script of keys and extents replayed by --benchmark, one frame a line */
+struct benchmark
+{
+    FILE *fp;
+    char szLine[BENCHMARK_LINE_SIZE];
+    int nPos; /* next of the keys on the line */
+    int bInFrame;
+    double dFrameStart;
+    int nFrames, nMaxFrames;
+    double *padTimes; /* each stage then the wall time, for each frame */
+    double adBudgets[NUM_STAGES + 1]; /* ms the p90 of each must stay under, 0 if any is fine */
+    GIntBig nSampleBytes;
+    int nTileHits, nTileMisses;
+};
+
+/* For what is shared with other processes. Increment and decrement return */
+/* the new value, compare and swap is TRUE if *p was old and is now new */
+#if defined(_MSC_VER)
+    #define ATOMIC_INCREMENT(p) InterlockedIncrement((volatile LONG*)(p))
+    #define ATOMIC_DECREMENT(p) InterlockedDecrement((volatile LONG*)(p))
+    #define ATOMIC_COMPARE_SWAP(p, old, new) \
+        (InterlockedCompareExchange((volatile LONG*)(p), (LONG)(new), (LONG)(old)) == (LONG)(old))
+    #define MEMORY_BARRIER() MemoryBarrier()
+#else
+    #define ATOMIC_INCREMENT(p) __sync_add_and_fetch((p), 1)
+    #define ATOMIC_DECREMENT(p) __sync_sub_and_fetch((p), 1)
+    #define ATOMIC_COMPARE_SWAP(p, old, new) __sync_bool_compare_and_swap((p), (old), (new))
+    #define MEMORY_BARRIER() __sync_synchronize()
+#endif
+
+/* What --render does to each file */
+struct render
+{
+    const char *pszFormat; /* as caca_export_canvas_to_memory takes it */
+    const char *pszExtension;
+    const char *pszOutDir;
+    char **papszFileNames;
+    char **papszOutputNames; /* for each file, see render_output_names */
+    struct stretchlist *pStretchList;
+    struct stretch *pCmdStretch;
+    const char *pszDitherAlgorithm;
+    int bAntialias, nPixPerCell;
+    int nJobs; /* worker processes, 0 is one per CPU */
+};
+
+/* Shared by the --render workers so each takes the next file left */
+struct renderProgress
+{
+    volatile int nNextFile;
+    volatile int nRendered;
+};
+
+/* Geolinking with the other instances, either through a file they all */
+/* read and write or a shared memory segment. In the segment the sequence */
+/* number goes up by one before the extent is written and again after, */
+/* so a reader can see one is being written and that it has changed. */
+/* Writers only make it odd from even, so one writes at a time */
+struct geolinkRecord
+{
+    volatile unsigned int nSequence; /* odd while being written, 0 if never */
+    volatile unsigned int nUsers; /* instances with it open, the last unlinks it */
+    unsigned long long pid;
+    double dCentreX, dCentreY, dMetersPerCell;
+};
+
+struct geolink
+{
+    char *pszFile; /* NULL if not geolinking through a file */
+    struct geolinkRecord *pRecord; /* NULL if not geolinking through shared memory */
+    char *pszSegment; /* as given to shm_open */
+    unsigned int nLastSequence;
+    unsigned long long pid;
+    int bFollowed;
+    struct extent followed; /* from the others, so not told back to them */
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    HANDLE hMapping;
+#endif
+};
+
+/* What the mosaic needs of each of its files. Kept in the statistics */
+/* cache as MOSAIC_SOURCE_BAND so they don't all have to be opened again */
+struct mosaicSource
+{
+    const char *pszFilename;
+    int nXSize, nYSize, nBands, nBlockXSize, nBlockYSize;
+    int *panTypes; /* of each band */
+    int *pabHasNoData; /* of each band, and its value in padfNoData */
+    double *padfNoData;
+    double adfTransform[6];
+    int nOverviews;
+    int *panOverviewSizes; /* width then height of each */
 };
 
 /* Local functions */
-static void print_status(void);
+static int print_status(void);
+static void print_perf_hud(int);
 static void print_help(int, int);
 static void set_gamma(int);
 static void draw_checkers(int, int, int, int);
+static void draw_image(struct image *, struct extent *);
+static int image_covers(struct image *, struct extent *);
+static void pan_extent(struct extent *, int, int);
 
 int gdal_open_file(char const *, struct gdalFile*, struct stretchlist *, struct stretch*);
 void gdal_close_file(struct gdalFile*);
-extern struct image * gdal_load_image(struct gdalFile*, struct extent *);
+void gdal_release_level_dataset(int);
+void gdal_close_level_datasets(void);
+void gdal_close_band_mappings(GDALDatasetH);
+int gdal_get_stretch_statistics(struct gdalFile *, int);
+char *get_stretch_as_string(struct stretch *);
+char *stats_cache_key(const char *);
+char **stats_cache_find(const char *, int);
+void stats_cache_append(const char *);
+void stats_cache_tidy(void);
+extern struct image * gdal_load_image(struct gdalFile*, struct extent *, int, int, int, int, struct image *);
 extern void gdal_unload_image(struct image *);
+void tile_cache_set_size(size_t);
+void tile_cache_purge(GDALDatasetH);
+void loader_start(struct gdalFile*);
+void loader_stop(void);
+void loader_request(struct extent *, int, int, int);
+int get_pix_per_cell(int, int);
+int gdal_get_best_overview(struct gdalFile *, struct extent *, int, int, int);
+const char *select_stretch_kernel(int);
+int loader_get_result(struct image **, int *);
+int loader_stats_updated(int *);
+int loader_cancelled(void);
+int loader_progress(double, const char *, void *);
+void read_pool_start(const char *, int);
+void read_pool_stop(void);
+void read_pool_run(int, void (*)(GDALDatasetH, int, void *), void *, GDALDatasetH);
+int overview_build_start(struct gdalFile *);
+int overview_build_poll(double *);
+void overview_build_stop(void);
+void set_read_error(const char *);
+void get_read_error(char *);
+double stage_start(void);
+void stage_end(int, double);
+void stage_count(GIntBig, int, int);
+char *frame_pool_get(size_t);
+void frame_pool_release(char *);
+void frame_pool_trim(void);
+struct caca_dither *dither_get(unsigned int, unsigned int);
 
 /* Local variables */
 struct image *im = NULL;
+struct tileCache tileCache;
+struct loader loader;
+struct readPool readPool;
+struct overviewBuild overviewBuild;
+struct levelDatasets levelDatasets;
+struct bandMappings bandMappings;
+int bMapFiles = TRUE;
+struct stageTimes stageTimes;
+struct framePool framePool;
+struct caca_dither *pSpareDither = NULL; /* of the last image shown, for the next */
+unsigned int nSpareDitherW = 0, nSpareDitherH = 0;
+struct benchmark benchmark;
+struct geolink geolink;
+const char *pszStageNames[] = {"open", "statistics", "overview", "rasterio", "stretch", 
+                               "interleave", "dither", "refresh"};
+int bPerfHUD = FALSE; /* show the counters of the last frame on the status line */
+FILE *fpPerfLog = NULL; /* a CSV line for each frame */
+struct perfCounters perfFrame; /* of the last frame */
+double dPerfFrameStart = 0, dPerfFrameSeconds = 0;
+int nPerfFrames = 0;
+int bPrefetch = TRUE;
+int nReadThreads = 0; /* 0 is one per CPU */
+char *pszStatsCacheFile = NULL; /* NULL if statistics aren't to be cached */
+char **papszStatsCache = NULL; /* its lines, loaded once */
+int bStatsCacheLoaded = FALSE;
+int bStatsCacheAppendOnly = FALSE; /* the --render workers leave compacting to the parent */
+char *pszMosaicStatsKey = NULL; /* from its files, as the VRT is new every time */
+char *pszMosaicRulesFile = NULL; /* its first file */
+int nMosaicOverviews = 0;
+int bLazyStats = TRUE;
+int bBuildOverviews = FALSE;
+char *pszOverviewCacheDir = NULL; /* for files in directories that can't be written */
+char **papszGDALConfigOptions = NULL; /* KEY=VALUE from [performance] in the config and --config */
+int nOverviewPercent = -1; /* of the overviews being built, for the status line */
+int bOverviewsFailed = FALSE;
 
 float gammatab[GAMMA_MAX + 1];
 int g = 0, mode, ww, wh;
@@ -263,6 +803,8 @@ int stretchpart_from_string(struct stretch *newStretch, const char *pszString)
         newStretch->stretchmode = VIEWER_STRETCHMODE_LINEAR;
     else if( strcmp(pszTmp, "stddev") == 0)
         newStretch->stretchmode = VIEWER_STRETCHMODE_STDDEV;
+    else if( strcmp(pszTmp, "histogram") == 0)
+        newStretch->stretchmode = VIEWER_STRETCHMODE_HIST;
     else
     {
         fprintf(stderr, "Unable to understand stretch mode %s\n", pszTmp);
@@ -289,6 +831,11 @@ int stretchpart_from_string(struct stretch *newStretch, const char *pszString)
         i++;
     }
     CSLDestroy(pszExtraTokens);
+    if( (newStretch->stretchmode == VIEWER_STRETCHMODE_HIST) && (i == 0) )
+    {
+        newStretch->stretchparam[0] = VIEWER_DEFAULT_HISTMIN;
+        newStretch->stretchparam[1] = VIEWER_DEFAULT_HISTMAX;
+    }
 
     n++;
     pszTmp = pszTokens[n];
@@ -359,7 +906,9 @@ int stretch_from_string(struct stretch *newStretch, const char *pszString)
 
 /* Returns stretch for given dataset worked out using the rules */
 /* returns NULL on failure */
-struct stretch *get_stretch_for_gdal(struct stretchlist *stretchList, GDALDatasetH ds)
+/* If !bCheckRAT rules for thematic layers are taken to match without */
+/* looking for the colour columns, which can be slow to get to */
+struct stretch *get_stretch_for_gdal(struct stretchlist *stretchList, GDALDatasetH ds, int bCheckRAT)
 {
     int match, i, hasRed, hasGreen, hasBlue, hasAlpha, ncols, c;
     int rasterCount = GDALGetRasterCount(ds);
@@ -389,7 +938,7 @@ struct stretch *get_stretch_for_gdal(struct stretchlist *stretchList, GDALDatase
         {
             bandh = GDALGetRasterBand(ds, pStretch->ctband);
             psz = GDALGetMetadataItem(bandh, "LAYER_TYPE", NULL);
-            if( (psz != NULL) && (strcmp(psz, "thematic") == 0))
+            if( (psz != NULL) && (strcmp(psz, "thematic") == 0) && bCheckRAT )
             {
                 hasRed = 0;
                 hasGreen = 0;
@@ -423,1418 +972,7136 @@ struct stretch *get_stretch_for_gdal(struct stretchlist *stretchList, GDALDatase
     return NULL;
 }
 
-void printUsage()
-{
-    printf("gdalcacaview [options] filename\n\n");
-
-    printf("where options is one of:\n");
-    printf(" --printdrivers\tPrint list of available drivers and exit\n");
-    printf(" --driver DRIVER\tUse the specified driver. If not given, uses default\n");
-    printf(" --stretch STRETCH\tUse the specified stretch string. If not given uses default stretch rules\n");
-    printf(" --geolink FILE\tUse the specified file to communicate with other instances and geolink\n");
-    printf("and filename is a GDAL supported dataset.\n");
-}
-
-void printDrivers()
+/* TRUE if the file is read over the network */
+int is_remote_filename(const char *pszFilename)
 {
     int i;
-    char const* const* list;
 
-    printf("Driver\tDescription\n");
-    printf("------\t-----------\n");
-    list = caca_get_display_driver_list();
-    for( i = 0; list[i] != NULL; i+=2 )
+    for( i = 0; pszRemotePrefixes[i] != NULL; i++ )
     {
-        printf( "%s\t%s\n", list[i], list[i+1] );
+        if( EQUALN(pszFilename, pszRemotePrefixes[i], strlen(pszRemotePrefixes[i])) )
+            return TRUE;
     }
+
+    return FALSE;
 }
 
-int main(int argc, char **argv)
+/* Sets the GDAL config options that cut down the number of requests */
+/* to object storage, with those that only make sense when bRemote. */
+/* Anything set in the environment is left alone */
+void set_cloud_config_options(int bRemote)
 {
-    char const * const * algos = caca_get_dither_algorithm_list(NULL);
-    int dither_algorithm = 0;
-
-    int quit = 0, update = 1, help = 0, status = 0;
-    int reload = 0, rezoom = 0;
-
     int i;
-    char *pszDriver = NULL;
-    char *pszConfigFile = NULL, *pszHomeDir = NULL;
-    char **pszConfigLines, **pszConfigSingleLine;
-    char *pszFileName = NULL;
-    struct stretchlist stretchList;
-    struct stretch *pCmdStretch = NULL; /* non-NULL when stretch is passed in on command line */
-    char *pszGeolinkFile = NULL;
-    struct extent dispExtent;
-    struct gdalFile gdalfile;
 
-    memset(&dispExtent, 0, sizeof(dispExtent));
-    memset(&gdalfile, 0, sizeof(gdalfile));
-
-    /* -------------------------------------------------------------------- */
-    /*      Read config file if it exists                                   */
-    /* -------------------------------------------------------------------- */
-#if defined(_WIN32) && !defined(__CYGWIN__)
-    pszHomeDir = getenv("USERPROFILE");
-    if( pszHomeDir == NULL )
+    for( i = 0; pszCloudConfigOptions[i] != NULL; i += 2 )
     {
-        /* '.gcv' plus seperating slash plus terminating null */
-        pszConfigFile = CPLMalloc(strlen(pszHomeDir) + 6);
-        /* copy in the path */
-        strcpy(pszConfigFile, pszHomeDir);
-
+        if( CPLGetConfigOption(pszCloudConfigOptions[i], NULL) == NULL )
+        {
+            CPLSetConfigOption(pszCloudConfigOptions[i], pszCloudConfigOptions[i + 1]);
+        }
     }
-    else
+    for( i = 0; bRemote && (pszRemoteConfigOptions[i] != NULL); i += 2 )
     {
-        i = strlen(getenv("HOMEDRIVE")) + 1 + strlen(getenv("HOMEPATH")) + 6;
-        pszConfigFile = CPLMalloc(i);
-        strcpy(pszConfigFile, getenv("HOMEDRIVE"));
-        strcat(pszConfigFile, "\\");
-        strcat(pszConfigFile, getenv("HOMEPATH"));
+        if( CPLGetConfigOption(pszRemoteConfigOptions[i], NULL) == NULL )
+        {
+            CPLSetConfigOption(pszRemoteConfigOptions[i], pszRemoteConfigOptions[i + 1]);
+        }
     }
+}
 
-    /* slash and filename */
-    strcat(pszConfigFile, "\\.gcv");
+/* Sets the GDAL config options from the [performance] section of the */
+/* config file and --config, before anything in GDAL has read them */
+void set_gdal_config_options(void)
+{
+    int i;
+    char *pszKey;
+    const char *pszValue;
 
-#else
-    struct passwd* pwd = getpwuid(getuid());
-    if( pwd != NULL )
+    for( i = 0; (papszGDALConfigOptions != NULL) && (papszGDALConfigOptions[i] != NULL); i++ )
     {
-        pszHomeDir = pwd->pw_dir;
+        pszValue = CPLParseNameValue(papszGDALConfigOptions[i], &pszKey);
+        if( pszKey != NULL )
+        {
+            CPLSetConfigOption(pszKey, pszValue);
+            CPLFree(pszKey);
+        }
     }
-    else
+    CSLDestroy(papszGDALConfigOptions);
+    papszGDALConfigOptions = NULL;
+}
+
+/* Overviews built for files in directories that can't be written go */
+/* to pszOverviewCacheDir, unless GDAL_PAM_PROXY_DIR is already set. */
+/* GDAL looks there for them when the file is opened again */
+void set_overview_cache_dir(void)
+{
+    if( (pszOverviewCacheDir == NULL) || (CPLGetConfigOption("GDAL_PAM_PROXY_DIR", NULL) != NULL) )
+        return;
+
+    VSIMkdir(pszOverviewCacheDir, 0755);
+    CPLSetConfigOption("GDAL_PAM_PROXY_DIR", pszOverviewCacheDir);
+}
+
+/* TRUE if pszName matches pszPattern, which can have * and ? in it */
+int wildcard_match(const char *pszPattern, const char *pszName)
+{
+    if( *pszPattern == '\0' )
+        return *pszName == '\0';
+
+    if( *pszPattern == '*' )
     {
-        pszHomeDir = getenv("HOME");
+        /* as much or as little as makes the rest match */
+        do
+        {
+            if( wildcard_match(pszPattern + 1, pszName) )
+                return TRUE;
+        } while( *pszName++ != '\0' );
+        return FALSE;
     }
 
-    /* '.gcv' plus seperating slash plus terminating null */
-    pszConfigFile = CPLMalloc(strlen(pszHomeDir) + 6);
-    /* copy in the path */
-    strcpy(pszConfigFile, pszHomeDir);
-    /* slash and filename */
-    strcat(pszConfigFile, "/.gcv");
+    if( (*pszName != '\0') && ((*pszPattern == '?') || (*pszPattern == *pszName)) )
+        return wildcard_match(pszPattern + 1, pszName + 1);
 
-#endif
+    return FALSE;
+}
 
-    stretchList.num_stretches = 0;
-    stretchList.stretches = NULL;
+static int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(const char**)a, *(const char**)b);
+}
 
-    /* don't show error if file doesn't exist */
-    CPLSetErrorHandler(CPLQuietErrorHandler);
-    pszConfigLines = CSLLoad(pszConfigFile);
-    CPLSetErrorHandler(NULL);
+/* Adds pszArg to papszFiles, or the files it matches in order if its */
+/* name has wildcards. Done here rather than by the shell so it works */
+/* on /vsis3/ and the other remote file systems */
+char **add_filename(char **papszFiles, const char *pszArg)
+{
+    const char *pszPattern = CPLGetFilename(pszArg);
+    char *pszDir;
+    char **papszEntries;
+    int i, nEntries;
 
-    if( pszConfigLines != NULL )
+    if( strpbrk(pszPattern, "*?") == NULL )
     {
-        /*fprintf(stderr, "reading config file %s\n", pszConfigFile);*/
-        i = 0;
-        while(pszConfigLines[i] != NULL)
-        {
-            pszConfigSingleLine = CSLTokenizeString2(pszConfigLines[i], "=",
-                                  CSLT_STRIPLEADSPACES | CSLT_STRIPENDSPACES);
-            if( ( pszConfigSingleLine[0] != NULL) && (pszConfigSingleLine[1] != NULL ) )
-            {
-                if( strcmp(pszConfigSingleLine[0], "Driver") == 0)
-                {
-                    pszDriver = strdup(pszConfigSingleLine[1]);
-                }
-                else if( strcmp(pszConfigSingleLine[0], "Rule") == 0)
-                {
-                    /* new rule */
-                    stretchList.num_stretches++;
-                    stretchList.stretches = (struct stretch*)CPLRealloc(stretchList.stretches,
-                                            sizeof(struct stretch) * stretchList.num_stretches);
-                    if( !stretch_from_string(&stretchList.stretches[stretchList.num_stretches-1], pszConfigSingleLine[1]) )
-                    {
-                        exit(1);
-                    }
-                }
-            }
-            CSLDestroy(pszConfigSingleLine);
-
-            i++;
-        }
+        return CSLAddString(papszFiles, pszArg);
+    }
 
-        CSLDestroy(pszConfigLines);
+    pszDir = CPLStrdup(CPLGetPath(pszArg));
+    papszEntries = VSIReadDir((pszDir[0] == '\0') ? "." : pszDir);
+    nEntries = CSLCount(papszEntries);
+    if( nEntries > 0 )
+    {
+        qsort(papszEntries, nEntries, sizeof(char*), compare_strings);
     }
-    else
+    for( i = 0; i < nEntries; i++ )
     {
-        /*fprintf(stderr, "no config file %s\n", pszConfigFile);*/
+        if( wildcard_match(pszPattern, papszEntries[i]) )
+        {
+            papszFiles = CSLAddString(papszFiles, (pszDir[0] == '\0') ? papszEntries[i] :
+                            CPLFormFilename(pszDir, papszEntries[i], NULL));
+        }
     }
+    CSLDestroy(papszEntries);
+    CPLFree(pszDir);
 
-    CPLFree(pszConfigFile);
+    return papszFiles;
+}
 
-    /* if no rules were read in then use pszDefaultStretchRules */
-    if( stretchList.num_stretches == 0 )
-    {
-        /*fprintf(stderr, "No stretches supplied, using default\n");*/
-        i = 0;
-        while(pszDefaultStretchRules[i] != NULL)
+/* 64 bit FNV-1a of the strings one after the other, each ended by a newline */
+unsigned long long hash_strings(char **papszStrings)
+{
+    unsigned long long nHash = 14695981039346656037ULL;
+    const unsigned char *p;
+    int i;
+
+    for( i = 0; (papszStrings != NULL) && (papszStrings[i] != NULL); i++ )
+    {
+        for( p = (const unsigned char*)papszStrings[i]; *p != '\0'; p++ )
+            nHash = (nHash ^ *p) * 1099511628211ULL;
+        nHash = (nHash ^ '\n') * 1099511628211ULL;
+    }
+    return nHash;
+}
+
+/* Allocates the per band details of src for src->nBands */
+void mosaic_alloc_bands(struct mosaicSource *src)
+{
+    src->panTypes = (int*)CPLCalloc(src->nBands, sizeof(int));
+    src->pabHasNoData = (int*)CPLCalloc(src->nBands, sizeof(int));
+    src->padfNoData = (double*)CPLCalloc(src->nBands, sizeof(double));
+}
+
+void mosaic_free_source(struct mosaicSource *src)
+{
+    CPLFree(src->panTypes);
+    CPLFree(src->pabHasNoData);
+    CPLFree(src->padfNoData);
+    CPLFree(src->panOverviewSizes);
+}
+
+/* TRUE if src has as many bands as pFirst, each of the same type */
+int mosaic_same_bands(struct mosaicSource *src, struct mosaicSource *pFirst)
+{
+    int i;
+
+    if( src->nBands != pFirst->nBands )
+        return FALSE;
+    for( i = 0; i < src->nBands; i++ )
+    {
+        if( src->panTypes[i] != pFirst->panTypes[i] )
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Fills in src for pszFile from the statistics cache, or by opening it */
+/* and then adding it there. FALSE if it can't be opened or isn't north up */
+int mosaic_get_source(const char *pszFile, const char *pszKey, struct mosaicSource *src)
+{
+    GDALDatasetH hDS;
+    GDALRasterBandH bandh, ovh, srch;
+    char **papszTokens;
+    char *pszLine, *pszNew;
+    int i, nTokens, nBands, nOverviewToken;
+
+    memset(src, 0, sizeof(*src));
+    src->pszFilename = pszFile;
+
+    /* band, size, band count, block size, transform, the type and nodata */
+    /* of each band, then the overviews */
+    papszTokens = stats_cache_find(pszKey, MOSAIC_SOURCE_BAND);
+    nTokens = CSLCount(papszTokens);
+    nBands = (nTokens >= 4) ? atoi(papszTokens[3]) : 0;
+    nOverviewToken = 12 + 3 * nBands;
+    if( (nBands > 0) && (nTokens > nOverviewToken) && 
+            (nTokens == nOverviewToken + 1 + 2 * atoi(papszTokens[nOverviewToken])) )
+    {
+        src->nXSize = atoi(papszTokens[1]);
+        src->nYSize = atoi(papszTokens[2]);
+        src->nBands = nBands;
+        src->nBlockXSize = atoi(papszTokens[4]);
+        src->nBlockYSize = atoi(papszTokens[5]);
+        for( i = 0; i < 6; i++ )
+            src->adfTransform[i] = atof(papszTokens[6 + i]);
+        mosaic_alloc_bands(src);
+        for( i = 0; i < nBands; i++ )
         {
-            stretchList.num_stretches++;
-            stretchList.stretches = (struct stretch*)CPLRealloc(stretchList.stretches,
-                                    sizeof(struct stretch) * stretchList.num_stretches);
-            if( !stretch_from_string(&stretchList.stretches[stretchList.num_stretches-1], pszDefaultStretchRules[i]) )
-            {
-                exit(1);
-            }
-            i++;
+            src->panTypes[i] = atoi(papszTokens[12 + i * 3]);
+            src->pabHasNoData[i] = atoi(papszTokens[13 + i * 3]);
+            src->padfNoData[i] = atof(papszTokens[14 + i * 3]);
         }
+        src->nOverviews = atoi(papszTokens[nOverviewToken]);
+        src->panOverviewSizes = (int*)CPLMalloc(sizeof(int) * 2 * MAX(1, src->nOverviews));
+        for( i = 0; i < src->nOverviews * 2; i++ )
+            src->panOverviewSizes[i] = atoi(papszTokens[nOverviewToken + 1 + i]);
+        CSLDestroy(papszTokens);
+        return TRUE;
+    }
+    CSLDestroy(papszTokens);
+
+    CPLPushErrorHandler(CPLQuietErrorHandler);
+    hDS = GDALOpen(pszFile, GA_ReadOnly);
+    CPLPopErrorHandler();
+    if( hDS == NULL )
+        return FALSE;
+    if( (GDALGetRasterCount(hDS) == 0) || (GDALGetGeoTransform(hDS, src->adfTransform) != CE_None) ||
+            (src->adfTransform[2] != 0) || (src->adfTransform[4] != 0) )
+    {
+        GDALClose(hDS);
+        return FALSE;
     }
 
-    /* -------------------------------------------------------------------- */
-    /*      Handle command line arguments.                                  */
-    /* -------------------------------------------------------------------- */
-    for( i = 1; i < argc; i++ )
+    bandh = GDALGetRasterBand(hDS, 1);
+    src->nXSize = GDALGetRasterXSize(hDS);
+    src->nYSize = GDALGetRasterYSize(hDS);
+    src->nBands = GDALGetRasterCount(hDS);
+    mosaic_alloc_bands(src);
+    for( i = 0; i < src->nBands; i++ )
     {
-        if( strcmp(argv[i], "--printdrivers" ) == 0 )
+        /* each file's own nodata, as gdalbuildvrt does */
+        srch = GDALGetRasterBand(hDS, i + 1);
+        src->panTypes[i] = GDALGetRasterDataType(srch);
+        src->padfNoData[i] = GDALGetRasterNoDataValue(srch, &src->pabHasNoData[i]);
+    }
+    GDALGetBlockSize(bandh, &src->nBlockXSize, &src->nBlockYSize);
+    src->nOverviews = GDALGetOverviewCount(bandh);
+    src->panOverviewSizes = (int*)CPLMalloc(sizeof(int) * 2 * MAX(1, src->nOverviews));
+    for( i = 0; i < src->nOverviews; i++ )
+    {
+        ovh = GDALGetOverview(bandh, i);
+        src->panOverviewSizes[i * 2] = GDALGetRasterBandXSize(ovh);
+        src->panOverviewSizes[i * 2 + 1] = GDALGetRasterBandYSize(ovh);
+    }
+    GDALClose(hDS);
+
+    if( pszKey != NULL )
+    {
+        pszLine = CPLStrdup(CPLSPrintf("%s\t%d\t%d\t%d\t%d\t%d\t%d\t%.17g\t%.17g\t%.17g\t%.17g\t%.17g\t%.17g", 
+                    pszKey, MOSAIC_SOURCE_BAND, src->nXSize, src->nYSize, src->nBands, 
+                    src->nBlockXSize, src->nBlockYSize, src->adfTransform[0], src->adfTransform[1], 
+                    src->adfTransform[2], src->adfTransform[3], src->adfTransform[4], 
+                    src->adfTransform[5]));
+        for( i = 0; i < src->nBands; i++ )
         {
-            printDrivers();
-            exit(1);
+            pszNew = CPLStrdup(CPLSPrintf("%s\t%d\t%d\t%.17g", pszLine, src->panTypes[i], 
+                        src->pabHasNoData[i], src->padfNoData[i]));
+            CPLFree(pszLine);
+            pszLine = pszNew;
         }
-        else if( strcmp( argv[i], "--driver" ) == 0 )
+        pszNew = CPLStrdup(CPLSPrintf("%s\t%d", pszLine, src->nOverviews));
+        CPLFree(pszLine);
+        pszLine = pszNew;
+        for( i = 0; i < src->nOverviews * 2; i++ )
         {
-            if( i+1 < argc )
-            {
-                /* take copy since we free below */
-                /* be consistent with the config file approach above */
-                pszDriver = strdup(argv[i+1]);
-                i++;
-            }
-            else
-            {
-                fprintf(stderr, "Must specify driver name\n");
-                printUsage();
-                exit(1);
-            }
+            pszNew = CPLStrdup(CPLSPrintf("%s\t%d", pszLine, src->panOverviewSizes[i]));
+            CPLFree(pszLine);
+            pszLine = pszNew;
         }
-        else if( strcmp( argv[i], "--stretch" ) == 0 )
+        stats_cache_append(pszLine);
+        CPLFree(pszLine);
+    }
+    return TRUE;
+}
+
+/* Adds src to psBand of a VRT with cells dCellX by dCellY and its top left */
+/* at dMinX, dMaxY. Read from the coarsest overview of src that still */
+/* has a pixel for each cell, or from src itself */
+void mosaic_add_source(CPLXMLNode *psBand, struct mosaicSource *src, int band, double dMinX, 
+            double dMaxY, double dCellX, double dCellY)
+{
+    CPLXMLNode *psSource, *psNode;
+    double dDstXSize = src->nXSize * src->adfTransform[1] / dCellX;
+    double dDstYSize = src->nYSize * -src->adfTransform[5] / dCellY;
+    int bHasNoData = src->pabHasNoData[band - 1];
+    int i, nXSize = src->nXSize, nYSize = src->nYSize, nOverview = -1;
+
+    for( i = 0; i < src->nOverviews; i++ )
+    {
+        if( (src->panOverviewSizes[i * 2] >= (int)dDstXSize) && (src->panOverviewSizes[i * 2] < nXSize) )
         {
-            if( i+1 < argc )
-            {
-                pCmdStretch = (struct stretch*)CPLCalloc(1, sizeof(struct stretch));
-                if( !stretchpart_from_string(pCmdStretch, argv[i+1]) )
-                {
-                    CPLFree(pCmdStretch);
-                    /* error already printed by stretchpart_from_string */
-                    exit(1);
-                }
-                i++;
-            }
-            else
-            {
-                fprintf(stderr, "Must specify stretch string\n");
-                printUsage();
-                exit(1);
-            }
+            nOverview = i;
+            nXSize = src->panOverviewSizes[i * 2];
+            nYSize = src->panOverviewSizes[i * 2 + 1];
         }
-        else if( strcmp( argv[i], "--geolink") == 0 )
+    }
+
+    /* with nodata the sources under it show through */
+    psSource = CPLCreateXMLNode(psBand, CXT_Element, bHasNoData ? "ComplexSource" : "SimpleSource");
+    psNode = CPLCreateXMLElementAndValue(psSource, "SourceFilename", src->pszFilename);
+    CPLAddXMLAttributeAndValue(psNode, "relativeToVRT", "0");
+    if( nOverview >= 0 )
+    {
+        psNode = CPLCreateXMLNode(psSource, CXT_Element, "OpenOptions");
+        psNode = CPLCreateXMLElementAndValue(psNode, "OOI", CPLSPrintf("%d", nOverview));
+        CPLAddXMLAttributeAndValue(psNode, "key", "OVERVIEW_LEVEL");
+    }
+    CPLCreateXMLElementAndValue(psSource, "SourceBand", CPLSPrintf("%d", band));
+
+    /* so GDAL doesn't have to open it to find these out */
+    psNode = CPLCreateXMLNode(psSource, CXT_Element, "SourceProperties");
+    CPLAddXMLAttributeAndValue(psNode, "RasterXSize", CPLSPrintf("%d", nXSize));
+    CPLAddXMLAttributeAndValue(psNode, "RasterYSize", CPLSPrintf("%d", nYSize));
+    CPLAddXMLAttributeAndValue(psNode, "DataType", 
+                GDALGetDataTypeName((GDALDataType)src->panTypes[band - 1]));
+    CPLAddXMLAttributeAndValue(psNode, "BlockXSize", CPLSPrintf("%d", MIN(src->nBlockXSize, nXSize)));
+    CPLAddXMLAttributeAndValue(psNode, "BlockYSize", CPLSPrintf("%d", MIN(src->nBlockYSize, nYSize)));
+
+    psNode = CPLCreateXMLNode(psSource, CXT_Element, "SrcRect");
+    CPLAddXMLAttributeAndValue(psNode, "xOff", "0");
+    CPLAddXMLAttributeAndValue(psNode, "yOff", "0");
+    CPLAddXMLAttributeAndValue(psNode, "xSize", CPLSPrintf("%d", nXSize));
+    CPLAddXMLAttributeAndValue(psNode, "ySize", CPLSPrintf("%d", nYSize));
+    psNode = CPLCreateXMLNode(psSource, CXT_Element, "DstRect");
+    CPLAddXMLAttributeAndValue(psNode, "xOff", CPLSPrintf("%.17g", (src->adfTransform[0] - dMinX) / dCellX));
+    CPLAddXMLAttributeAndValue(psNode, "yOff", CPLSPrintf("%.17g", (dMaxY - src->adfTransform[3]) / dCellY));
+    CPLAddXMLAttributeAndValue(psNode, "xSize", CPLSPrintf("%.17g", dDstXSize));
+    CPLAddXMLAttributeAndValue(psNode, "ySize", CPLSPrintf("%.17g", dDstYSize));
+
+    if( bHasNoData )
+        CPLCreateXMLElementAndValue(psSource, "NODATA", CPLSPrintf("%.17g", src->padfNoData[band - 1]));
+}
+
+/* Writes a VRT of the sources to pszVRT. The other details come from */
+/* hFirstDS, and the first nOverviews MOSAIC_OVERVIEW_FILENAMEs are */
+/* given as its overviews */
+int mosaic_write_vrt(const char *pszVRT, struct mosaicSource *pasSources, int nSources, 
+            GDALDatasetH hFirstDS, int nXSize, int nYSize, double dMinX, double dMaxY, 
+            double dCellX, double dCellY, int nOverviews)
+{
+    CPLXMLNode *psTree, *psBand, *psOverview, *psNode;
+    GDALRasterBandH bandh;
+    const char *pszWKT = GDALGetProjectionRef(hFirstDS);
+    double dNoData;
+    int band, n, bHasNoData, bOK;
+
+    psTree = CPLCreateXMLNode(NULL, CXT_Element, "VRTDataset");
+    CPLAddXMLAttributeAndValue(psTree, "rasterXSize", CPLSPrintf("%d", nXSize));
+    CPLAddXMLAttributeAndValue(psTree, "rasterYSize", CPLSPrintf("%d", nYSize));
+    if( (pszWKT != NULL) && (pszWKT[0] != '\0') )
+        CPLCreateXMLElementAndValue(psTree, "SRS", pszWKT);
+    CPLCreateXMLElementAndValue(psTree, "GeoTransform", 
+                CPLSPrintf("%.17g, %.17g, 0, %.17g, 0, %.17g", dMinX, dCellX, dMaxY, -dCellY));
+
+    for( band = 1; band <= GDALGetRasterCount(hFirstDS); band++ )
+    {
+        bandh = GDALGetRasterBand(hFirstDS, band);
+        psBand = CPLCreateXMLNode(psTree, CXT_Element, "VRTRasterBand");
+        CPLAddXMLAttributeAndValue(psBand, "dataType", 
+                    GDALGetDataTypeName(GDALGetRasterDataType(bandh)));
+        CPLAddXMLAttributeAndValue(psBand, "band", CPLSPrintf("%d", band));
+        dNoData = GDALGetRasterNoDataValue(bandh, &bHasNoData);
+        if( bHasNoData )
+            CPLCreateXMLElementAndValue(psBand, "NoDataValue", CPLSPrintf("%.17g", dNoData));
+        CPLCreateXMLElementAndValue(psBand, "ColorInterp", 
+                    GDALGetColorInterpretationName(GDALGetRasterColorInterpretation(bandh)));
+
+        for( n = 1; n <= nOverviews; n++ )
         {
-            if( i+1 < argc )
-            {
-                pszGeolinkFile = argv[i+1];
-                i++;
-            }
-            else
-            {
-                fprintf(stderr, "Must specify geolink file\n");
-                printUsage();
-                exit(1);
-            }
+            psOverview = CPLCreateXMLNode(psBand, CXT_Element, "Overview");
+            psNode = CPLCreateXMLElementAndValue(psOverview, "SourceFilename", 
+                        CPLSPrintf(MOSAIC_OVERVIEW_FILENAME, n));
+            CPLAddXMLAttributeAndValue(psNode, "relativeToVRT", "0");
+            CPLCreateXMLElementAndValue(psOverview, "SourceBand", CPLSPrintf("%d", band));
         }
-        else if( (strcmp( argv[i], "-h" ) == 0) ||
-                 (strcmp( argv[i], "--help" ) == 0) )
+
+        for( n = 0; n < nSources; n++ )
         {
-            printUsage();
-            exit(1);
+            mosaic_add_source(psBand, &pasSources[n], band, dMinX, dMaxY, dCellX, dCellY);
         }
-        else if( argv[i][0] == '-' )
+    }
+
+    bOK = CPLSerializeXMLTreeToFile(psTree, pszVRT);
+    CPLDestroyXMLNode(psTree);
+    return bOK;
+}
+
+/* Writes the VRTs of the files at MOSAIC_FILENAME, which can then be opened */
+/* like any other file. Files that can't be opened, or don't have the same */
+/* bands as the first, are left out like gdalbuildvrt does. Returns FALSE */
+/* with the message set on failure */
+int build_mosaic(char **papszFiles)
+{
+    struct mosaicSource *pasSources;
+    GDALDatasetH hFirstDS = NULL;
+    char **papszKeys = NULL;
+    char *pszKey;
+    double dMinX = 0, dMaxX = 0, dMinY = 0, dMaxY = 0, dCellX = 0, dCellY = 0;
+    int i, nFiles = CSLCount(papszFiles), nSources = 0, bKeyed = TRUE, bOK;
+    int nXSize, nYSize, nLevel, nFactor;
+    char szOverview[64];
+    struct mosaicSource *src;
+
+    if( CPLGetConfigOption("GDAL_MAX_DATASET_POOL_SIZE", NULL) == NULL )
+    {
+        CPLSetConfigOption("GDAL_MAX_DATASET_POOL_SIZE", CPLSPrintf("%d", MOSAIC_MAX_OPEN_FILES));
+    }
+
+    /* the index of the files, mostly from the cache */
+    pasSources = (struct mosaicSource*)CPLCalloc(MAX(1, nFiles), sizeof(struct mosaicSource));
+    for( i = 0; i < nFiles; i++ )
+    {
+        src = &pasSources[nSources];
+        pszKey = stats_cache_key(papszFiles[i]);
+        if( !mosaic_get_source(papszFiles[i], pszKey, src) || 
+                ((nSources > 0) && !mosaic_same_bands(src, &pasSources[0])) )
         {
-            fprintf(stderr, "Option %s incomplete, or not recognised.\n\n",
-                    argv[i] );
-            printUsage();
-            exit(1);
+            mosaic_free_source(src);
+            CPLFree(pszKey);
+            continue;
         }
+        if( pszKey == NULL )
+            bKeyed = FALSE;
         else
-        {
-            /* a filename */
-            if( pszFileName != NULL )
-            {
-                fprintf(stderr, "only one filename can be specified\n");
-                printUsage();
-                exit(1);
-            }
-            pszFileName = argv[i];
+            papszKeys = CSLAddString(papszKeys, pszKey);
+        CPLFree(pszKey);
 
-            reload = 1;
+        if( nSources == 0 )
+        {
+            dMinX = src->adfTransform[0];
+            dMaxY = src->adfTransform[3];
+            dMaxX = dMinX + src->nXSize * src->adfTransform[1];
+            dMinY = dMaxY + src->nYSize * src->adfTransform[5];
         }
+        dMinX = MIN(dMinX, src->adfTransform[0]);
+        dMaxY = MAX(dMaxY, src->adfTransform[3]);
+        dMaxX = MAX(dMaxX, src->adfTransform[0] + src->nXSize * src->adfTransform[1]);
+        dMinY = MIN(dMinY, src->adfTransform[3] + src->nYSize * src->adfTransform[5]);
+        /* the average resolution, as gdalbuildvrt uses by default */
+        dCellX += src->adfTransform[1];
+        dCellY += -src->adfTransform[5];
+        nSources++;
     }
 
-    if( pszFileName == NULL )
+    if( nSources > 0 )
     {
-        printf( "filename(s) not specified\n" );
-        printUsage();
-        exit(1);
+        CPLPushErrorHandler(CPLQuietErrorHandler);
+        hFirstDS = GDALOpen(pasSources[0].pszFilename, GA_ReadOnly);
+        CPLPopErrorHandler();
     }
-
-    /* Initialise libcaca */
-    cv = caca_create_canvas(0, 0);
-    if(!cv)
+    bOK = (hFirstDS != NULL);
+    if( bOK )
     {
-        fprintf(stderr, "Unable to initialise libcaca\n");
-        return 1;
+        dCellX /= nSources;
+        dCellY /= nSources;
+        nXSize = MAX(1, (int)((dMaxX - dMinX) / dCellX + 0.5));
+        nYSize = MAX(1, (int)((dMaxY - dMinY) / dCellY + 0.5));
+
+        /* each level half the size of the one before, down to OVERVIEW_MIN_SIZE */
+        nMosaicOverviews = 0;
+        for( nLevel = 1, nFactor = 2; bOK && (MAX(nXSize, nYSize) / nFactor >= OVERVIEW_MIN_SIZE); 
+                    nLevel++, nFactor *= 2 )
+        {
+            snprintf(szOverview, sizeof(szOverview), MOSAIC_OVERVIEW_FILENAME, nLevel);
+            bOK = mosaic_write_vrt(szOverview, pasSources, nSources, 
+                        hFirstDS, (nXSize + nFactor - 1) / nFactor, (nYSize + nFactor - 1) / nFactor,
+                        dMinX, dMaxY, dCellX * nFactor, dCellY * nFactor, 0);
+            if( bOK )
+                nMosaicOverviews = nLevel;
+        }
+        bOK = bOK && mosaic_write_vrt(MOSAIC_FILENAME, pasSources, nSources, hFirstDS, nXSize, nYSize, 
+                        dMinX, dMaxY, dCellX, dCellY, nMosaicOverviews);
+        GDALClose(hFirstDS);
     }
 
-    /* If they have specified driver, use that */
-    if( pszDriver != NULL )
+    if( bOK )
     {
-        dp = caca_create_display_with_driver(cv, pszDriver);
-        if(!dp)
+        /* the same files give the same statistics whatever order they are in */
+        if( bKeyed )
         {
-            fprintf(stderr, "Unable to initialise libcaca with driver %s\n", pszDriver);
-            return 1;
+            qsort(papszKeys, nSources, sizeof(char*), compare_strings);
+            pszMosaicStatsKey = CPLStrdup(CPLSPrintf("mosaic:%016llx\t%d\t0", 
+                        hash_strings(papszKeys), nSources));
         }
-        /* finished with it */
-        CPLFree(pszDriver);
-        pszDriver = NULL;
+        pszMosaicRulesFile = CPLStrdup(pasSources[0].pszFilename);
     }
     else
     {
-        /* fall back on default */
-        dp = caca_create_display(cv);
-        if( !dp )
-        {
-            fprintf(stderr, "Unable to initialise libcaca\n");
-            return 1;
-        }
+        snprintf( szGDALMessages, GDAL_ERROR_SIZE, "Unable to mosaic the files%s", 
+                (nSources == 0) ? ": none could be opened" : "" );
     }
 
-    /* init GDAL */
-    GDALAllRegister();
+    for( i = 0; i < nSources; i++ )
+        mosaic_free_source(&pasSources[i]);
+    CPLFree(pasSources);
+    CSLDestroy(papszKeys);
 
-    /* Set the window title */
-    caca_set_display_title(dp, "gdalcacaview");
+    return bOK;
+}
 
-    ww = caca_get_canvas_width(cv);
-    wh = caca_get_canvas_height(cv);
+/* Removes what build_mosaic wrote */
+void mosaic_free(void)
+{
+    int nLevel;
+
+    VSIUnlink(MOSAIC_FILENAME);
+    for( nLevel = 1; nLevel <= nMosaicOverviews; nLevel++ )
+        VSIUnlink(CPLSPrintf(MOSAIC_OVERVIEW_FILENAME, nLevel));
+    nMosaicOverviews = 0;
+    CPLFree(pszMosaicStatsKey);
+    pszMosaicStatsKey = NULL;
+    CPLFree(pszMosaicRulesFile);
+    pszMosaicRulesFile = NULL;
+}
 
-    /* Fill the gamma table */
-    gammatab[0] = 1.0;
-    for(i = 0; i < GAMMA_MAX; i++)
-        gammatab[i + 1] = gammatab[i] * GAMMA_FACTOR;
+/* Sets szGDALMessages from code the loader and read threads run, as */
+/* more than one can fail at the same time and the main loop shows it */
+void set_read_error(const char *pszMessage)
+{
+    CPLCreateOrAcquireMutex(&hGDALMessagesMutex, 1000.0);
+    snprintf( szGDALMessages, GDAL_ERROR_SIZE, "%s", pszMessage );
+    CPLReleaseMutex(hGDALMessagesMutex);
+}
 
-    /* Go ! */
-    while(!quit)
-    {
-        caca_event_t ev;
-        unsigned int const event_mask = CACA_EVENT_KEY_PRESS
-                                        | CACA_EVENT_RESIZE
-                                        | CACA_EVENT_QUIT;
-        unsigned int new_status = 0, new_help = 0;
-        int event;
+/* Copies szGDALMessages to pszMessage, GDAL_ERROR_SIZE long, while the */
+/* other threads can't be setting it */
+void get_read_error(char *pszMessage)
+{
+    CPLCreateOrAcquireMutex(&hGDALMessagesMutex, 1000.0);
+    snprintf( pszMessage, GDAL_ERROR_SIZE, "%s", szGDALMessages );
+    CPLReleaseMutex(hGDALMessagesMutex);
+}
 
-        if(update)
-            event = caca_get_event(dp, event_mask, &ev, 0);
-        else if( pszGeolinkFile != NULL )
-        {
-            /* set timeout to 1 second */
-            event = caca_get_event(dp, event_mask, &ev, GEOLINK_TIMEOUT);
-            if( event == 0 )
-            {
-                /* timeout and we are geolinking */
-                /* read file */
-                FILE *fp = fopen(pszGeolinkFile, "r");
-                if( fp != NULL )
-                {
-                    double dX, dY, dMetersPerCell;
-                    unsigned long long currpid, pid;
+/* Seconds since some time in the past */
+double get_time(void)
+{
 #if !defined(_WIN32) || defined(__CYGWIN__)
-                    currpid = getpid();
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
 #else
-                    currpid = GetCurrentProcessId();
+    LARGE_INTEGER nFrequency, nCount;
+    QueryPerformanceFrequency(&nFrequency);
+    QueryPerformanceCounter(&nCount);
+    return (double)nCount.QuadPart / nFrequency.QuadPart;
 #endif
-                    if( fscanf(fp, "%llu %lf %lf %lf\n", &pid, &dX, &dY, &dMetersPerCell) == 4 )
-                    {
-                        if( (currpid != pid ) && ( (dX != dispExtent.dCentreX) || (dY != dispExtent.dCentreY)
-                                || (dMetersPerCell != dispExtent.dMetersPerCell) ) )
-                        {
-                            /* don't bother with our own pid or location */
-                            dispExtent.dCentreX = dX;
-                            dispExtent.dCentreY = dY;
-                            dispExtent.dMetersPerCell = dMetersPerCell;
-                            rezoom = 1;
-                            update = 1;
-                        }
-                    }
-                    fclose(fp);
-                }
-            }
+}
+
+/* Pass what this returns to stage_end once the stage is done */
+double stage_start(void)
+{
+    return stageTimes.bEnabled ? get_time() : 0;
+}
+
+void stage_end(int nStage, double dStart)
+{
+    double dEnd;
+
+    /* dStart is 0 if it was turned on part way through */
+    if( !stageTimes.bEnabled || (dStart == 0) )
+        return;
+
+    dEnd = get_time();
+    CPLCreateOrAcquireMutex(&stageTimes.hMutex, 1000.0);
+    stageTimes.counters.adSeconds[nStage] += dEnd - dStart;
+    CPLReleaseMutex(stageTimes.hMutex);
+}
+
+/* Adds to what has been read and how many tiles came from the cache */
+void stage_count(GIntBig nSampleBytes, int nTileHits, int nTileMisses)
+{
+    if( !stageTimes.bEnabled )
+        return;
+
+    CPLCreateOrAcquireMutex(&stageTimes.hMutex, 1000.0);
+    stageTimes.counters.nSampleBytes += nSampleBytes;
+    stageTimes.counters.nTileHits += nTileHits;
+    stageTimes.counters.nTileMisses += nTileMisses;
+    CPLReleaseMutex(stageTimes.hMutex);
+}
+
+/* Copies out the counters since it was last called and starts again */
+void stage_times_take(struct perfCounters *pCounters)
+{
+    CPLCreateOrAcquireMutex(&stageTimes.hMutex, 1000.0);
+    *pCounters = stageTimes.counters;
+    memset(&stageTimes.counters, 0, sizeof(stageTimes.counters));
+    CPLReleaseMutex(stageTimes.hMutex);
+}
+
+void stage_times_update_enabled(void)
+{
+    stageTimes.bEnabled = bPerfHUD || (fpPerfLog != NULL) || (benchmark.fp != NULL);
+}
+
+/* Returns FALSE with the message set if the log can't be created */
+int perf_log_start(const char *pszFile)
+{
+    int nStage;
+
+    fpPerfLog = fopen(pszFile, "w");
+    if( fpPerfLog == NULL )
+    {
+        snprintf( szGDALMessages, GDAL_ERROR_SIZE, "Unable to create performance log %s", pszFile );
+        return FALSE;
+    }
+
+    fprintf(fpPerfLog, "frame");
+    for( nStage = 0; nStage < NUM_STAGES; nStage++ )
+        fprintf(fpPerfLog, ",%s_ms", pszStageNames[nStage]);
+    fprintf(fpPerfLog, ",frame_ms,sample_bytes,tile_hits,tile_misses\n");
+    stage_times_update_enabled();
+    return TRUE;
+}
+
+void perf_log_frame(int nFrame, struct perfCounters *pCounters, double dSeconds)
+{
+    int nStage;
+
+    fprintf(fpPerfLog, "%d", nFrame);
+    for( nStage = 0; nStage < NUM_STAGES; nStage++ )
+        fprintf(fpPerfLog, ",%.3f", pCounters->adSeconds[nStage] * 1000.0);
+    fprintf(fpPerfLog, ",%.3f," CPL_FRMT_GIB ",%d,%d\n", dSeconds * 1000.0, pCounters->nSampleBytes,
+            pCounters->nTileHits, pCounters->nTileMisses);
+}
+
+void perf_log_stop(void)
+{
+    if( fpPerfLog != NULL )
+    {
+        fclose(fpPerfLog);
+        fpPerfLog = NULL;
+    }
+}
+
+/* A request for a new extent has gone to an idle loader */
+void perf_start_frame(void)
+{
+    struct perfCounters discard;
+
+    /* not what was done while idle */
+    stage_times_take(&discard);
+    dPerfFrameStart = get_time();
+}
+
+/* The image for the request is on the screen */
+void perf_end_frame(void)
+{
+    stage_times_take(&perfFrame);
+    dPerfFrameSeconds = get_time() - dPerfFrameStart;
+    if( fpPerfLog != NULL )
+        perf_log_frame(nPerfFrames, &perfFrame, dPerfFrameSeconds);
+    nPerfFrames++;
+}
+
+/* Returns FALSE with the message set if the script can't be opened */
+int benchmark_start(const char *pszScript)
+{
+    memset(&benchmark, 0, sizeof(benchmark));
+    benchmark.fp = fopen(pszScript, "r");
+    if( benchmark.fp == NULL )
+    {
+        snprintf( szGDALMessages, GDAL_ERROR_SIZE, "Unable to open benchmark script %s", pszScript );
+        return FALSE;
+    }
+
+    /* the open and first read of the file are the first frame */
+    stage_times_update_enabled();
+    benchmark.bInFrame = TRUE;
+    benchmark.dFrameStart = get_time();
+    return TRUE;
+}
+
+/* Called once the last line's frame is on the screen. Moves the extent */
+/* for an extent line. Returns the BENCHMARK_* type of the next line */
+int benchmark_next_line(struct extent *extent)
+{
+    char *pszLine;
+    char szStage[32];
+    double dX, dY, dMetersPerCell, dBudget;
+    int nLen, nStage;
+
+    while( fgets(benchmark.szLine, BENCHMARK_LINE_SIZE, benchmark.fp) != NULL )
+    {
+        nLen = strlen(benchmark.szLine);
+        while( (nLen > 0) && ((benchmark.szLine[nLen - 1] == '\n') || (benchmark.szLine[nLen - 1] == '\r')) )
+            benchmark.szLine[--nLen] = '\0';
+
+        pszLine = benchmark.szLine;
+        while( (*pszLine == ' ') || (*pszLine == '\t') )
+            pszLine++;
+
+        if( strncmp(pszLine, "keys ", 5) == 0 )
+        {
+            benchmark.nPos = pszLine + 5 - benchmark.szLine;
+            return BENCHMARK_KEYS;
         }
-        else
+        else if( (strncmp(pszLine, "extent ", 7) == 0) &&
+                (sscanf(pszLine + 7, "%lf %lf %lf", &dX, &dY, &dMetersPerCell) == 3) )
+        {
+            extent->dCentreX = dX;
+            extent->dCentreY = dY;
+            extent->dMetersPerCell = dMetersPerCell;
+            return BENCHMARK_EXTENT;
+        }
+        else if( (strncmp(pszLine, "budget ", 7) == 0) &&
+                (sscanf(pszLine + 7, "%31s %lf", szStage, &dBudget) == 2) )
+        {
+            /* not a frame, so on to the next line */
+            for( nStage = 0; (nStage < NUM_STAGES) && !EQUAL(szStage, pszStageNames[nStage]); nStage++ )
+                ;
+            if( (nStage < NUM_STAGES) || EQUAL(szStage, "frame") )
+                benchmark.adBudgets[nStage] = dBudget;
+            else
+                fprintf(stderr, "Ignoring budget for unknown stage '%s'\n", szStage);
+        }
+        else if( (*pszLine != '\0') && (*pszLine != '#') )
+        {
+            fprintf(stderr, "Ignoring benchmark line '%s'\n", pszLine);
+        }
+    }
+
+    return BENCHMARK_END;
+}
+
+/* the next key of a keys line, or 0 when there are no more */
+int benchmark_next_key(void)
+{
+    int ch = (unsigned char)benchmark.szLine[benchmark.nPos];
+
+    if( ch != '\0' )
+        benchmark.nPos++;
+    return ch;
+}
+
+void benchmark_start_frame(void)
+{
+    struct perfCounters discard;
+
+    /* anything since the last frame, like idle prefetching, isn't counted */
+    stage_times_take(&discard);
+    benchmark.bInFrame = TRUE;
+    benchmark.dFrameStart = get_time();
+}
+
+void benchmark_end_frame(void)
+{
+    struct perfCounters counters;
+    double *pdTimes;
+
+    if( !benchmark.bInFrame )
+        return;
+
+    if( benchmark.nFrames == benchmark.nMaxFrames )
+    {
+        benchmark.nMaxFrames = MAX(64, benchmark.nMaxFrames * 2);
+        benchmark.padTimes = (double*)CPLRealloc(benchmark.padTimes, 
+                benchmark.nMaxFrames * (NUM_STAGES + 1) * sizeof(double));
+    }
+    pdTimes = &benchmark.padTimes[benchmark.nFrames * (NUM_STAGES + 1)];
+    stage_times_take(&counters);
+    memcpy(pdTimes, counters.adSeconds, sizeof(counters.adSeconds));
+    pdTimes[NUM_STAGES] = get_time() - benchmark.dFrameStart;
+    benchmark.nSampleBytes += counters.nSampleBytes;
+    benchmark.nTileHits += counters.nTileHits;
+    benchmark.nTileMisses += counters.nTileMisses;
+    if( fpPerfLog != NULL )
+        perf_log_frame(benchmark.nFrames, &counters, pdTimes[NUM_STAGES]);
+    benchmark.nFrames++;
+    benchmark.bInFrame = FALSE;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double dA = *(const double*)a, dB = *(const double*)b;
+    return (dA < dB) ? -1 : (dA > dB) ? 1 : 0;
+}
+
+/* Prints the total and the percentiles over the frames of each stage. */
+/* Returns how many of the script's budgets the p90s went over */
+int benchmark_report(FILE *fp)
+{
+    double *padSorted, dTotal, dP90;
+    int nStage, n, nOver = 0;
+
+    fprintf(fp, "%d frames, times in ms. Stages are summed over the read threads\n", benchmark.nFrames);
+    fprintf(fp, "%-12s %10s %10s %10s %10s %10s %10s\n", "stage", "total", "mean", 
+            "p50", "p90", "p99", "max");
+    if( benchmark.nFrames == 0 )
+        return 0;
+
+    padSorted = (double*)CPLMalloc(benchmark.nFrames * sizeof(double));
+    for( nStage = 0; nStage <= NUM_STAGES; nStage++ )
+    {
+        dTotal = 0;
+        for( n = 0; n < benchmark.nFrames; n++ )
+        {
+            padSorted[n] = benchmark.padTimes[n * (NUM_STAGES + 1) + nStage] * 1000.0;
+            dTotal += padSorted[n];
+        }
+        qsort(padSorted, benchmark.nFrames, sizeof(double), compare_doubles);
+
+        /* nearest rank */
+        dP90 = padSorted[(int)ceil(benchmark.nFrames * 0.9) - 1];
+        fprintf(fp, "%-12s %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f", 
+                (nStage < NUM_STAGES) ? pszStageNames[nStage] : "frame", dTotal, 
+                dTotal / benchmark.nFrames, 
+                padSorted[(benchmark.nFrames - 1) / 2],
+                dP90,
+                padSorted[(int)ceil(benchmark.nFrames * 0.99) - 1],
+                padSorted[benchmark.nFrames - 1]);
+        if( (benchmark.adBudgets[nStage] > 0) && (dP90 > benchmark.adBudgets[nStage]) )
+        {
+            fprintf(fp, "  over the budget of %.2f", benchmark.adBudgets[nStage]);
+            nOver++;
+        }
+        fprintf(fp, "\n");
+    }
+    CPLFree(padSorted);
+
+    fprintf(fp, "%.1f MB of samples", benchmark.nSampleBytes / (1024.0 * 1024.0));
+    if( (benchmark.nTileHits + benchmark.nTileMisses) > 0 )
+    {
+        fprintf(fp, ", %.1f%% of tiles from the cache", 
+                100.0 * benchmark.nTileHits / (benchmark.nTileHits + benchmark.nTileMisses));
+    }
+    fprintf(fp, "\n");
+    return nOver;
+}
+
+void benchmark_stop(void)
+{
+    fclose(benchmark.fp);
+    CPLFree(benchmark.padTimes);
+    memset(&benchmark, 0, sizeof(benchmark));
+    stage_times_update_enabled();
+}
+
+/* Geolinks through pszName, or the shared memory segment named after */
+/* GEOLINK_SHARED_PREFIX if it starts with it. FALSE with the message set */
+int geolink_open(const char *pszName)
+{
+    const char *pszSegment;
+
+    memset(&geolink, 0, sizeof(geolink));
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    geolink.pid = getpid();
+#else
+    geolink.pid = GetCurrentProcessId();
+#endif
+
+    if( !EQUALN(pszName, GEOLINK_SHARED_PREFIX, strlen(GEOLINK_SHARED_PREFIX)) )
+    {
+        geolink.pszFile = CPLStrdup(pszName);
+        return TRUE;
+    }
+
+    pszSegment = pszName + strlen(GEOLINK_SHARED_PREFIX);
+    if( (*pszSegment == '\0') || (strpbrk(pszSegment, "/\\") != NULL) )
+    {
+        snprintf( szGDALMessages, GDAL_ERROR_SIZE, "Invalid geolink segment name %s", pszSegment );
+        return FALSE;
+    }
+
+    /* the first to open it makes it, all zero */
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    {
+        void *pMem = MAP_FAILED;
+        int fd;
+
+        geolink.pszSegment = CPLStrdup(CPLSPrintf("/gdalcacaview_%s", pszSegment));
+        fd = shm_open(geolink.pszSegment, O_RDWR | O_CREAT, 0600);
+        if( fd >= 0 )
+        {
+            if( ftruncate(fd, sizeof(struct geolinkRecord)) == 0 )
+            {
+                pMem = mmap(NULL, sizeof(struct geolinkRecord), PROT_READ | PROT_WRITE, 
+                            MAP_SHARED, fd, 0);
+            }
+            close(fd);
+        }
+        if( pMem != MAP_FAILED )
+            geolink.pRecord = (struct geolinkRecord*)pMem;
+    }
+#else
+    geolink.hMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, 
+                sizeof(struct geolinkRecord), CPLSPrintf("Local\\gdalcacaview_%s", pszSegment));
+    if( geolink.hMapping != NULL )
+    {
+        geolink.pRecord = (struct geolinkRecord*)MapViewOfFile(geolink.hMapping, FILE_MAP_ALL_ACCESS, 
+                    0, 0, sizeof(struct geolinkRecord));
+        if( geolink.pRecord == NULL )
+        {
+            CloseHandle(geolink.hMapping);
+            geolink.hMapping = NULL;
+        }
+    }
+#endif
+
+    if( geolink.pRecord == NULL )
+    {
+        snprintf( szGDALMessages, GDAL_ERROR_SIZE, "Unable to open geolink segment %s", pszSegment );
+        CPLFree(geolink.pszSegment);
+        geolink.pszSegment = NULL;
+        return FALSE;
+    }
+    ATOMIC_INCREMENT(&geolink.pRecord->nUsers);
+    return TRUE;
+}
+
+int geolink_is_open(void)
+{
+    return (geolink.pszFile != NULL) || (geolink.pRecord != NULL);
+}
+
+/* Tells the others where we are, unless it is where they took us */
+void geolink_write(struct extent *extent)
+{
+    FILE *fp;
+    unsigned int nSequence;
+    int nTries = 0;
+
+    if( geolink.bFollowed && (extent->dCentreX == geolink.followed.dCentreX) && 
+            (extent->dCentreY == geolink.followed.dCentreY) && 
+            (extent->dMetersPerCell == geolink.followed.dMetersPerCell) )
+        return;
+    geolink.bFollowed = FALSE;
+
+    if( geolink.pRecord != NULL )
+    {
+        /* makes it odd so readers and the other writers leave it alone */
+        while( TRUE )
+        {
+            nSequence = geolink.pRecord->nSequence;
+            if( !(nSequence & 1) )
+            {
+                if( ATOMIC_COMPARE_SWAP(&geolink.pRecord->nSequence, nSequence, nSequence + 1) )
+                    break;
+            }
+            else if( nTries++ == GEOLINK_WRITE_TRIES )
+            {
+                /* it has stayed odd, so whoever was writing has gone */
+                break;
+            }
+            else
+                CPLSleep(0.001);
+        }
+        geolink.pRecord->pid = geolink.pid;
+        geolink.pRecord->dCentreX = extent->dCentreX;
+        geolink.pRecord->dCentreY = extent->dCentreY;
+        geolink.pRecord->dMetersPerCell = extent->dMetersPerCell;
+        geolink.nLastSequence = ATOMIC_INCREMENT(&geolink.pRecord->nSequence);
+    }
+    else if( geolink.pszFile != NULL )
+    {
+        fp = fopen(geolink.pszFile, "w");
+        if( fp != NULL )
+        {
+            fprintf(fp, "%llu %f %f %f\n", geolink.pid, extent->dCentreX,
+                    extent->dCentreY, extent->dMetersPerCell);
+            fclose(fp);
+        }
+    }
+}
+
+/* TRUE if another instance has moved somewhere else, with extent set to it */
+int geolink_read(struct extent *extent)
+{
+    FILE *fp;
+    unsigned int nSequence;
+    unsigned long long pid = 0;
+    double dX = 0, dY = 0, dMetersPerCell = 0;
+    int bRead = FALSE;
+
+    if( geolink.pRecord != NULL )
+    {
+        nSequence = geolink.pRecord->nSequence;
+        if( (nSequence == geolink.nLastSequence) || (nSequence & 1) )
+            return FALSE;
+
+        MEMORY_BARRIER();
+        pid = geolink.pRecord->pid;
+        dX = geolink.pRecord->dCentreX;
+        dY = geolink.pRecord->dCentreY;
+        dMetersPerCell = geolink.pRecord->dMetersPerCell;
+        MEMORY_BARRIER();
+
+        /* look again next time if it was written meanwhile */
+        bRead = (geolink.pRecord->nSequence == nSequence);
+        if( bRead )
+            geolink.nLastSequence = nSequence;
+    }
+    else if( geolink.pszFile != NULL )
+    {
+        fp = fopen(geolink.pszFile, "r");
+        if( fp != NULL )
+        {
+            bRead = (fscanf(fp, "%llu %lf %lf %lf\n", &pid, &dX, &dY, &dMetersPerCell) == 4);
+            fclose(fp);
+        }
+    }
+
+    /* don't bother with our own pid or location */
+    if( !bRead || (pid == geolink.pid) || ((dX == extent->dCentreX) && (dY == extent->dCentreY) && 
+                (dMetersPerCell == extent->dMetersPerCell)) )
+        return FALSE;
+
+    extent->dCentreX = dX;
+    extent->dCentreY = dY;
+    extent->dMetersPerCell = dMetersPerCell;
+    geolink.followed = *extent;
+    geolink.bFollowed = TRUE;
+    return TRUE;
+}
+
+/* The segment goes with the last instance to close it */
+void geolink_close(void)
+{
+    if( geolink.pRecord != NULL )
+    {
+#if !defined(_WIN32) || defined(__CYGWIN__)
+        if( ATOMIC_DECREMENT(&geolink.pRecord->nUsers) == 0 )
+            shm_unlink(geolink.pszSegment);
+        munmap((void*)geolink.pRecord, sizeof(struct geolinkRecord));
+#else
+        UnmapViewOfFile((void*)geolink.pRecord);
+        CloseHandle(geolink.hMapping);
+#endif
+    }
+    CPLFree(geolink.pszFile);
+    CPLFree(geolink.pszSegment);
+    memset(&geolink, 0, sizeof(geolink));
+}
+
+/* Registers the drivers and sets the options for the files to be opened. */
+/* Those given in the config or with --config go first so they win over */
+/* the cloud ones, and are in place for the block cache and drivers */
+void gdal_init(int nCloudAccess, const char *pszFirstFile)
+{
+    set_gdal_config_options();
+    GDALAllRegister();
+    if( (nCloudAccess == CLOUD_ACCESS_ON) || 
+            ((nCloudAccess == CLOUD_ACCESS_AUTO) && is_remote_filename(pszFirstFile)) )
+    {
+        set_cloud_config_options(is_remote_filename(pszFirstFile));
+    }
+    if( bBuildOverviews )
+    {
+        /* before GDAL looks for any */
+        set_overview_cache_dir();
+    }
+}
+
+/* Extension for the files libcaca exports in pszFormat. NULL if */
+/* libcaca can't export it */
+const char *render_get_extension(const char *pszFormat)
+{
+    static const char *apszExtensions[] = { "caca", "caca", "ansi", "ans", 
+                "utf8", "txt", "utf8cr", "txt", "html", "html", "html3", "html", 
+                "bbfr", "txt", "irc", "txt", "ps", "ps", "svg", "svg", "tga", "tga", 
+                "troff", "roff", NULL };
+    char const * const * list = caca_get_export_list();
+    int i;
+
+    for( i = 0; list[i] != NULL; i += 2 )
+    {
+        if( strcmp(list[i], pszFormat) == 0 )
+            break;
+    }
+    if( list[i] == NULL )
+        return NULL;
+
+    for( i = 0; apszExtensions[i] != NULL; i += 2 )
+    {
+        if( strcmp(apszExtensions[i], pszFormat) == 0 )
+            return apszExtensions[i + 1];
+    }
+    return pszFormat;
+}
+
+/* Names for the snapshots of the files. Their basenames, with _2, _3 */
+/* and so on added where files in different directories have the same one */
+char **render_output_names(char **papszFileNames)
+{
+    char **papszNames = NULL;
+    char *pszBasename;
+    const char *pszName;
+    int i, nSuffix;
+
+    for( i = 0; (papszFileNames != NULL) && (papszFileNames[i] != NULL); i++ )
+    {
+        pszBasename = CPLStrdup(CPLGetBasename(papszFileNames[i]));
+        pszName = pszBasename;
+        nSuffix = 1;
+        /* without regard to case in case the file system is like that */
+        while( CSLFindString(papszNames, pszName) >= 0 )
+        {
+            nSuffix++;
+            pszName = CPLSPrintf("%s_%d", pszBasename, nSuffix);
+        }
+        papszNames = CSLAddString(papszNames, pszName);
+        CPLFree(pszBasename);
+    }
+    return papszNames;
+}
+
+/* Writes the snapshot of the whole of pszFile to the output directory */
+/* as pszName. FALSE with the message set if it couldn't */
+int render_file(struct render *render, const char *pszFile, const char *pszName)
+{
+    struct gdalFile file;
+    struct extent extent;
+    struct image *renderIm;
+    caca_canvas_t *canvas;
+    void *pExported;
+    size_t nBytes;
+    const char *pszOutput;
+    int overviewIndex, bOK = FALSE;
+    FILE *fp;
+
+    memset(&file, 0, sizeof(file));
+    if( !gdal_open_file(pszFile, &file, render->pStretchList, render->pCmdStretch) )
+        return FALSE;
+
+    extent = file.fullExtent;
+    overviewIndex = gdal_get_best_overview(&file, &extent, ww, wh, render->nPixPerCell);
+    renderIm = gdal_load_image(&file, &extent, ww, wh, render->nPixPerCell, overviewIndex, NULL);
+    if( renderIm == NULL )
+    {
+        /* already closed */
+        return FALSE;
+    }
+
+    renderIm->dither = dither_get(renderIm->w, renderIm->h);
+    canvas = caca_create_canvas(ww, wh);
+    if( (renderIm->dither == NULL) || (canvas == NULL) )
+    {
+        snprintf( szGDALMessages, GDAL_ERROR_SIZE, "Unable to create dither" );
+    }
+    else
+    {
+        caca_set_dither_algorithm(renderIm->dither, render->pszDitherAlgorithm);
+        caca_set_dither_antialias(renderIm->dither, render->bAntialias ? "prefilter" : "none");
+        caca_dither_bitmap(canvas, 0, 0, ww, wh, renderIm->dither, renderIm->pixels);
+
+        pExported = caca_export_canvas_to_memory(canvas, render->pszFormat, &nBytes);
+        pszOutput = CPLFormFilename(render->pszOutDir, pszName, render->pszExtension);
+        fp = (pExported != NULL) ? fopen(pszOutput, "wb") : NULL;
+        if( fp != NULL )
+        {
+            bOK = (fwrite(pExported, 1, nBytes, fp) == nBytes);
+            bOK = (fclose(fp) == 0) && bOK;
+        }
+        if( !bOK )
+        {
+            snprintf( szGDALMessages, GDAL_ERROR_SIZE, "Unable to write %s", pszOutput );
+        }
+        free(pExported);
+    }
+
+    if( canvas != NULL )
+        caca_free_canvas(canvas);
+    gdal_unload_image(renderIm);
+    gdal_close_file(&file);
+    return bOK;
+}
+
+/* Renders files until there are none left that another worker hasn't taken */
+void render_worker(struct render *render, struct renderProgress *progress, int nFiles)
+{
+    int nFile;
+
+    while( (nFile = ATOMIC_INCREMENT(&progress->nNextFile) - 1) < nFiles )
+    {
+        if( render_file(render, render->papszFileNames[nFile], render->papszOutputNames[nFile]) )
+            ATOMIC_INCREMENT(&progress->nRendered);
+        else
+            fprintf(stderr, "%s: %s\n", render->papszFileNames[nFile], szGDALMessages);
+    }
+}
+
+/* Renders all the files, with a process for each job where there is fork(). */
+/* The workers only append to the statistics cache, and it is compacted */
+/* here once they are done if it needs to be. Returns the exit status */
+int render_files(struct render *render)
+{
+    struct renderProgress *progress;
+    int nFiles = CSLCount(render->papszFileNames);
+    int nJobs = render->nJobs, nRendered;
+    double dStart = get_time(), dSeconds;
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    pid_t pid;
+    int i, nStarted = 0;
+#endif
+
+    if( nJobs <= 0 )
+        nJobs = CPLGetNumCPUs();
+    nJobs = MIN(MAX(nJobs, 1), MAX(nFiles, 1));
+    render->papszOutputNames = render_output_names(render->papszFileNames);
+    bStatsCacheAppendOnly = TRUE;
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    /* so the workers can all see it */
+    progress = (struct renderProgress*)mmap(NULL, sizeof(struct renderProgress), 
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if( progress == MAP_FAILED )
+    {
+        fprintf(stderr, "Unable to share the file list between workers\n");
+        return 1;
+    }
+    memset((void*)progress, 0, sizeof(struct renderProgress));
+
+    if( nJobs == 1 )
+    {
+        render_worker(render, progress, nFiles);
+    }
+    else
+    {
+        /* or the children write out what is buffered too */
+        fflush(stdout);
+        fflush(stderr);
+        for( i = 0; i < nJobs; i++ )
+        {
+            pid = fork();
+            if( pid == 0 )
+            {
+                /* nothing to tidy up in the copy of the parent */
+                render_worker(render, progress, nFiles);
+                _exit(0);
+            }
+            else if( pid > 0 )
+            {
+                nStarted++;
+            }
+        }
+        if( nStarted == 0 )
+        {
+            /* do them all here then */
+            render_worker(render, progress, nFiles);
+        }
+        while( nStarted > 0 )
+        {
+            if( wait(NULL) > 0 )
+                nStarted--;
+            else if( errno != EINTR )
+                break;
+        }
+    }
+    /* anything a worker that died had taken is a failure too */
+    nRendered = progress->nRendered;
+    munmap((void*)progress, sizeof(struct renderProgress));
+#else
+    /* no fork() so one file after another */
+    progress = CPLCalloc(1, sizeof(struct renderProgress));
+    render_worker(render, progress, nFiles);
+    nRendered = progress->nRendered;
+    CPLFree(progress);
+#endif
+
+    stats_cache_tidy();
+    CSLDestroy(render->papszOutputNames);
+    render->papszOutputNames = NULL;
+
+    dSeconds = get_time() - dStart;
+    printf("Rendered %d of %d files in %.2f s, %.1f files/s\n", nRendered, nFiles, 
+                dSeconds, (dSeconds > 0) ? nRendered / dSeconds : 0.0);
+    return (nRendered < nFiles) ? 1 : 0;
+}
+
+void printUsage()
+{
+    printf("gdalcacaview [options] filename [filename ...]\n\n");
+
+    printf("where options is one of:\n");
+    printf(" --printdrivers\tPrint list of available drivers and exit\n");
+    printf(" --driver DRIVER\tUse the specified driver. If not given, uses default\n");
+    printf(" --stretch STRETCH\tUse the specified stretch string. If not given uses default stretch rules\n");
+    printf(" --geolink FILE\tUse the specified file to communicate with other instances and geolink\n");
+    printf("\t\tshm:NAME uses a shared memory segment of that name instead, which follows the others at once\n");
+    printf(" --cachesize MB\tMemory to use for caching tiles that have been read. 0 disables. Default is %d\n", DEFAULT_CACHE_SIZE);
+    printf(" --noprefetch\tDon't read the tiles around the current view while idle\n");
+    printf(" --nolazystats\tWork out the statistics and read the colour table before showing the image.\n");
+    printf("\t\tBy default it is first stretched to the range of the data type, then to what that\n");
+    printf("\t\tframe had in it, and the real statistics replace those afterwards\n");
+    printf(" --nostatscache\tDon't keep computed statistics in the .gcv.cache file\n");
+    printf(" --buildovr\tBuild overviews in the background for a file that has none. They go in\n");
+    printf("\t\ta .ovr next to it, or in .gcv_overviews if that directory can't be written\n");
+    printf(" --threads N\tNumber of threads to read with, each with its own handle. Default is one per CPU\n");
+    printf(" --nosimd\tDon't use the vector instructions of the CPU for stretching\n");
+    printf(" --nommap\tRead uncompressed local files through RasterIO rather than mapping them into memory\n");
+    printf(" --config KEY VALUE\tSet a GDAL config option, such as GDAL_CACHEMAX or GDAL_NUM_THREADS.\n");
+    printf("\t\tThese can also go in a [performance] section of .gcv as KEY=VALUE\n");
+    printf(" --cloud\tSet the GDAL options for object storage even for local files\n");
+    printf(" --nocloud\tDon't set the GDAL options for object storage for remote files\n");
+    printf(" --quality N\tPixels read across each cell when antialiasing (1-%d). Default is %d\n", PIX_PER_CELL, DEFAULT_QUALITY);
+    printf(" --perf-log FILE\tWrite how long each stage of each frame took to FILE as CSV\n");
+    printf(" --render FORMAT\tWrite a snapshot of each file in FORMAT (ansi, utf8, html, svg...) and exit\n");
+    printf("\t\tinstead of showing them. Several files are rendered at once by worker processes\n");
+    printf(" --rendersize COLSxROWS\tSize of the snapshots in cells. Default is %dx%d\n", 
+            RENDER_DEFAULT_WIDTH, RENDER_DEFAULT_HEIGHT);
+    printf(" --outdir DIR\tDirectory the snapshots are written to, named after each file. Default is .\n");
+    printf(" --jobs N\tNumber of files to render at once. Default is one per CPU\n");
+    printf(" --benchmark SCRIPT\tReplay the lines of SCRIPT, then print how long each stage took.\n");
+    printf("\t\tEach line is 'keys KEYS' or 'extent X Y METERSPERCELL'. Runs with the\n");
+    printf("\t\tnull driver unless one is given. CACA_GEOMETRY sets the size. A line\n");
+    printf("\t\t'budget STAGE MS' exits with 1 if the p90 of STAGE, or frame, is more than MS\n");
+    printf("and filename is a GDAL supported dataset. Several files, or a name with * or ?\n");
+    printf("in it, are shown together as one mosaic.\n");
+}
+
+void printDrivers()
+{
+    int i;
+    char const* const* list;
+
+    printf("Driver\tDescription\n");
+    printf("------\t-----------\n");
+    list = caca_get_display_driver_list();
+    for( i = 0; list[i] != NULL; i+=2 )
+    {
+        printf( "%s\t%s\n", list[i], list[i+1] );
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char const * const * algos = caca_get_dither_algorithm_list(NULL);
+    int dither_algorithm = 0;
+    int bAntialias = TRUE, nQuality = DEFAULT_QUALITY;
+    int bAllowSIMD = TRUE;
+    int nCloudAccess = CLOUD_ACCESS_AUTO;
+
+    int quit = 0, dirty = LAYER_CANVAS, help = 0, status = 0;
+    int reload = 0, loading = 0, bStatsPending = 0, bFrameDone = FALSE;
+    int bKeepExtent = FALSE, nOverviewState = OVERVIEW_BUILD_NONE, nNewOverviewState;
+    double dOverviewProgress = 0;
+    double dStart;
+    int bStatsCache = TRUE;
+    int nConfigSection = CONFIG_SECTION_VIEWER;
+    int nStatusWidth;
+    int nExitCode = 0;
+
+    int i;
+    char *pszDriver = NULL;
+    char *pszConfigFile = NULL, *pszHomeDir = NULL;
+    char **pszConfigLines, **pszConfigSingleLine;
+    char *pszConfigKey = NULL;
+    const char *pszConfigValue;
+    char *pszFileName = NULL;
+    char **papszFileNames = NULL;
+    struct stretchlist stretchList;
+    struct stretch *pCmdStretch = NULL; /* non-NULL when stretch is passed in on command line */
+    char *pszGeolinkFile = NULL;
+    char *pszBenchmarkScript = NULL;
+    char *pszRenderFormat = NULL, *pszRenderOutDir = ".";
+    int nRenderWidth = RENDER_DEFAULT_WIDTH, nRenderHeight = RENDER_DEFAULT_HEIGHT, nRenderJobs = 0;
+    struct render render;
+    struct extent dispExtent;
+    struct gdalFile gdalfile;
+
+    memset(&dispExtent, 0, sizeof(dispExtent));
+    memset(&gdalfile, 0, sizeof(gdalfile));
+
+    /* -------------------------------------------------------------------- */
+    /*      Read config file if it exists                                   */
+    /* -------------------------------------------------------------------- */
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    pszHomeDir = getenv("USERPROFILE");
+    if( pszHomeDir == NULL )
+    {
+        /* '.gcv' plus seperating slash plus terminating null */
+        pszConfigFile = CPLMalloc(strlen(pszHomeDir) + 6);
+        /* copy in the path */
+        strcpy(pszConfigFile, pszHomeDir);
+
+    }
+    else
+    {
+        i = strlen(getenv("HOMEDRIVE")) + 1 + strlen(getenv("HOMEPATH")) + 6;
+        pszConfigFile = CPLMalloc(i);
+        strcpy(pszConfigFile, getenv("HOMEDRIVE"));
+        strcat(pszConfigFile, "\\");
+        strcat(pszConfigFile, getenv("HOMEPATH"));
+    }
+
+    /* slash and filename */
+    strcat(pszConfigFile, "\\.gcv");
+
+#else
+    struct passwd* pwd = getpwuid(getuid());
+    if( pwd != NULL )
+    {
+        pszHomeDir = pwd->pw_dir;
+    }
+    else
+    {
+        pszHomeDir = getenv("HOME");
+    }
+
+    /* '.gcv' plus seperating slash plus terminating null */
+    pszConfigFile = CPLMalloc(strlen(pszHomeDir) + 6);
+    /* copy in the path */
+    strcpy(pszConfigFile, pszHomeDir);
+    /* slash and filename */
+    strcat(pszConfigFile, "/.gcv");
+
+#endif
+
+    stretchList.num_stretches = 0;
+    stretchList.stretches = NULL;
+    tile_cache_set_size((size_t)DEFAULT_CACHE_SIZE * 1024 * 1024);
+
+    /* don't show error if file doesn't exist */
+    CPLSetErrorHandler(CPLQuietErrorHandler);
+    pszConfigLines = CSLLoad(pszConfigFile);
+    CPLSetErrorHandler(NULL);
+
+    if( pszConfigLines != NULL )
+    {
+        /*fprintf(stderr, "reading config file %s\n", pszConfigFile);*/
+        i = 0;
+        while(pszConfigLines[i] != NULL)
+        {
+            pszConfigSingleLine = CSLTokenizeString2(pszConfigLines[i], "=",
+                                  CSLT_STRIPLEADSPACES | CSLT_STRIPENDSPACES);
+            if( (pszConfigSingleLine[0] != NULL) && (pszConfigSingleLine[0][0] == '[') )
+            {
+                /* the lines up to the next section are for this one */
+                if( EQUAL(pszConfigSingleLine[0], "[performance]") )
+                    nConfigSection = CONFIG_SECTION_PERFORMANCE;
+                else
+                    nConfigSection = CONFIG_SECTION_OTHER;
+            }
+            else if( (nConfigSection == CONFIG_SECTION_PERFORMANCE) && 
+                    (pszConfigSingleLine[0] != NULL) && (pszConfigSingleLine[1] != NULL) )
+            {
+                /* the value from the whole line, as it can have = in it. */
+                /* Anything in the environment is left alone */
+                pszConfigValue = CPLParseNameValue(pszConfigLines[i], &pszConfigKey);
+                if( (pszConfigValue != NULL) && 
+                        (CPLGetConfigOption(pszConfigSingleLine[0], NULL) == NULL) )
+                {
+                    papszGDALConfigOptions = CSLSetNameValue(papszGDALConfigOptions, 
+                                pszConfigSingleLine[0], pszConfigValue);
+                }
+                CPLFree(pszConfigKey);
+            }
+            else if( (nConfigSection == CONFIG_SECTION_VIEWER) && 
+                    (pszConfigSingleLine[0] != NULL) && (pszConfigSingleLine[1] != NULL) )
+            {
+                if( strcmp(pszConfigSingleLine[0], "Driver") == 0)
+                {
+                    pszDriver = strdup(pszConfigSingleLine[1]);
+                }
+                else if( strcmp(pszConfigSingleLine[0], "CacheSize") == 0)
+                {
+                    tile_cache_set_size((size_t)atol(pszConfigSingleLine[1]) * 1024 * 1024);
+                }
+                else if( strcmp(pszConfigSingleLine[0], "Prefetch") == 0)
+                {
+                    bPrefetch = atol(pszConfigSingleLine[1]);
+                }
+                else if( strcmp(pszConfigSingleLine[0], "StatsCache") == 0)
+                {
+                    bStatsCache = atol(pszConfigSingleLine[1]);
+                }
+                else if( strcmp(pszConfigSingleLine[0], "LazyStats") == 0)
+                {
+                    bLazyStats = atol(pszConfigSingleLine[1]);
+                }
+                else if( strcmp(pszConfigSingleLine[0], "Threads") == 0)
+                {
+                    nReadThreads = atol(pszConfigSingleLine[1]);
+                }
+                else if( strcmp(pszConfigSingleLine[0], "CloudAccess") == 0)
+                {
+                    nCloudAccess = atol(pszConfigSingleLine[1]);
+                }
+                else if( strcmp(pszConfigSingleLine[0], "Quality") == 0)
+                {
+                    nQuality = atol(pszConfigSingleLine[1]);
+                }
+                else if( strcmp(pszConfigSingleLine[0], "Antialias") == 0)
+                {
+                    bAntialias = atol(pszConfigSingleLine[1]);
+                }
+                else if( strcmp(pszConfigSingleLine[0], "Rule") == 0)
+                {
+                    /* new rule */
+                    stretchList.num_stretches++;
+                    stretchList.stretches = (struct stretch*)CPLRealloc(stretchList.stretches,
+                                            sizeof(struct stretch) * stretchList.num_stretches);
+                    if( !stretch_from_string(&stretchList.stretches[stretchList.num_stretches-1], pszConfigSingleLine[1]) )
+                    {
+                        exit(1);
+                    }
+                }
+            }
+            CSLDestroy(pszConfigSingleLine);
+
+            i++;
+        }
+
+        CSLDestroy(pszConfigLines);
+    }
+    else
+    {
+        /*fprintf(stderr, "no config file %s\n", pszConfigFile);*/
+    }
+
+    /* statistics computed for files are kept next to the config */
+    if( bStatsCache )
+    {
+        pszStatsCacheFile = CPLMalloc(strlen(pszConfigFile) + 7);
+        strcpy(pszStatsCacheFile, pszConfigFile);
+        strcat(pszStatsCacheFile, ".cache");
+    }
+    pszOverviewCacheDir = CPLMalloc(strlen(pszConfigFile) + 11);
+    strcpy(pszOverviewCacheDir, pszConfigFile);
+    strcat(pszOverviewCacheDir, "_overviews");
+
+    CPLFree(pszConfigFile);
+
+    /* if no rules were read in then use pszDefaultStretchRules */
+    if( stretchList.num_stretches == 0 )
+    {
+        /*fprintf(stderr, "No stretches supplied, using default\n");*/
+        i = 0;
+        while(pszDefaultStretchRules[i] != NULL)
+        {
+            stretchList.num_stretches++;
+            stretchList.stretches = (struct stretch*)CPLRealloc(stretchList.stretches,
+                                    sizeof(struct stretch) * stretchList.num_stretches);
+            if( !stretch_from_string(&stretchList.stretches[stretchList.num_stretches-1], pszDefaultStretchRules[i]) )
+            {
+                exit(1);
+            }
+            i++;
+        }
+    }
+
+    /* -------------------------------------------------------------------- */
+    /*      Handle command line arguments.                                  */
+    /* -------------------------------------------------------------------- */
+    for( i = 1; i < argc; i++ )
+    {
+        if( strcmp(argv[i], "--printdrivers" ) == 0 )
+        {
+            printDrivers();
+            exit(1);
+        }
+        else if( strcmp( argv[i], "--driver" ) == 0 )
+        {
+            if( i+1 < argc )
+            {
+                /* take copy since we free below */
+                /* be consistent with the config file approach above */
+                pszDriver = strdup(argv[i+1]);
+                i++;
+            }
+            else
+            {
+                fprintf(stderr, "Must specify driver name\n");
+                printUsage();
+                exit(1);
+            }
+        }
+        else if( strcmp( argv[i], "--stretch" ) == 0 )
+        {
+            if( i+1 < argc )
+            {
+                pCmdStretch = (struct stretch*)CPLCalloc(1, sizeof(struct stretch));
+                if( !stretchpart_from_string(pCmdStretch, argv[i+1]) )
+                {
+                    CPLFree(pCmdStretch);
+                    /* error already printed by stretchpart_from_string */
+                    exit(1);
+                }
+                i++;
+            }
+            else
+            {
+                fprintf(stderr, "Must specify stretch string\n");
+                printUsage();
+                exit(1);
+            }
+        }
+        else if( strcmp( argv[i], "--geolink") == 0 )
+        {
+            if( i+1 < argc )
+            {
+                pszGeolinkFile = argv[i+1];
+                i++;
+            }
+            else
+            {
+                fprintf(stderr, "Must specify geolink file\n");
+                printUsage();
+                exit(1);
+            }
+        }
+        else if( strcmp( argv[i], "--cachesize") == 0 )
+        {
+            if( i+1 < argc )
+            {
+                tile_cache_set_size((size_t)atol(argv[i+1]) * 1024 * 1024);
+                i++;
+            }
+            else
+            {
+                fprintf(stderr, "Must specify cache size\n");
+                printUsage();
+                exit(1);
+            }
+        }
+        else if( strcmp( argv[i], "--perf-log") == 0 )
+        {
+            if( i+1 < argc )
+            {
+                if( !perf_log_start(argv[i+1]) )
+                {
+                    fprintf(stderr, "%s\n", szGDALMessages);
+                    exit(1);
+                }
+                i++;
+            }
+            else
+            {
+                fprintf(stderr, "Must specify performance log file\n");
+                printUsage();
+                exit(1);
+            }
+        }
+        else if( strcmp( argv[i], "--benchmark") == 0 )
+        {
+            if( i+1 < argc )
+            {
+                pszBenchmarkScript = argv[i+1];
+                i++;
+            }
+            else
+            {
+                fprintf(stderr, "Must specify benchmark script\n");
+                printUsage();
+                exit(1);
+            }
+        }
+        else if( strcmp( argv[i], "--render") == 0 )
+        {
+            if( i+1 < argc )
+            {
+                pszRenderFormat = argv[i+1];
+                i++;
+            }
+            else
+            {
+                fprintf(stderr, "Must specify render format\n");
+                printUsage();
+                exit(1);
+            }
+        }
+        else if( strcmp( argv[i], "--rendersize") == 0 )
+        {
+            if( (i+1 < argc) && (sscanf(argv[i+1], "%dx%d", &nRenderWidth, &nRenderHeight) == 2) &&
+                    (nRenderWidth > 0) && (nRenderHeight > 0) )
+            {
+                i++;
+            }
+            else
+            {
+                fprintf(stderr, "Must specify render size as COLSxROWS\n");
+                printUsage();
+                exit(1);
+            }
+        }
+        else if( strcmp( argv[i], "--outdir") == 0 )
+        {
+            if( i+1 < argc )
+            {
+                pszRenderOutDir = argv[i+1];
+                i++;
+            }
+            else
+            {
+                fprintf(stderr, "Must specify output directory\n");
+                printUsage();
+                exit(1);
+            }
+        }
+        else if( strcmp( argv[i], "--jobs") == 0 )
+        {
+            if( i+1 < argc )
+            {
+                nRenderJobs = atol(argv[i+1]);
+                i++;
+            }
+            else
+            {
+                fprintf(stderr, "Must specify number of jobs\n");
+                printUsage();
+                exit(1);
+            }
+        }
+        else if( strcmp( argv[i], "--quality") == 0 )
+        {
+            if( i+1 < argc )
+            {
+                nQuality = atol(argv[i+1]);
+                i++;
+            }
+            else
+            {
+                fprintf(stderr, "Must specify quality\n");
+                printUsage();
+                exit(1);
+            }
+        }
+        else if( strcmp( argv[i], "--noprefetch") == 0 )
+        {
+            bPrefetch = FALSE;
+        }
+        else if( strcmp( argv[i], "--lazystats") == 0 )
+        {
+            bLazyStats = TRUE;
+        }
+        else if( strcmp( argv[i], "--nolazystats") == 0 )
+        {
+            bLazyStats = FALSE;
+        }
+        else if( strcmp( argv[i], "--nostatscache") == 0 )
+        {
+            CPLFree(pszStatsCacheFile);
+            pszStatsCacheFile = NULL;
+        }
+        else if( strcmp( argv[i], "--nommap") == 0 )
+        {
+            bMapFiles = FALSE;
+        }
+        else if( strcmp( argv[i], "--buildovr") == 0 )
+        {
+            bBuildOverviews = TRUE;
+        }
+        else if( strcmp( argv[i], "--threads") == 0 )
+        {
+            if( i+1 < argc )
+            {
+                nReadThreads = atol(argv[i+1]);
+                i++;
+            }
+            else
+            {
+                fprintf(stderr, "Must specify number of threads\n");
+                printUsage();
+                exit(1);
+            }
+        }
+        else if( strcmp( argv[i], "--nosimd") == 0 )
+        {
+            bAllowSIMD = FALSE;
+        }
+        else if( strcmp( argv[i], "--config") == 0 )
+        {
+            if( i+2 < argc )
+            {
+                /* over anything in the config file or the environment */
+                papszGDALConfigOptions = CSLSetNameValue(papszGDALConfigOptions, 
+                            argv[i+1], argv[i+2]);
+                i += 2;
+            }
+            else
+            {
+                fprintf(stderr, "Must specify config option name and value\n");
+                printUsage();
+                exit(1);
+            }
+        }
+        else if( strcmp( argv[i], "--cloud") == 0 )
+        {
+            nCloudAccess = CLOUD_ACCESS_ON;
+        }
+        else if( strcmp( argv[i], "--nocloud") == 0 )
+        {
+            nCloudAccess = CLOUD_ACCESS_OFF;
+        }
+        else if( (strcmp( argv[i], "-h" ) == 0) ||
+                 (strcmp( argv[i], "--help" ) == 0) )
+        {
+            printUsage();
+            exit(1);
+        }
+        else if( argv[i][0] == '-' )
+        {
+            fprintf(stderr, "Option %s incomplete, or not recognised.\n\n",
+                    argv[i] );
+            printUsage();
+            exit(1);
+        }
+        else
+        {
+            /* a filename, or a pattern for some */
+            papszFileNames = add_filename(papszFileNames, argv[i]);
+        }
+    }
+
+    if( CSLCount(papszFileNames) == 1 )
+    {
+        pszFileName = CPLStrdup(papszFileNames[0]);
+        reload = 1;
+    }
+    else if( papszFileNames != NULL )
+    {
+        /* built once GDAL is initialised */
+        pszFileName = CPLStrdup(MOSAIC_FILENAME);
+        reload = 1;
+    }
+
+    if( pszFileName == NULL )
+    {
+        printf( "filename(s) not specified\n" );
+        printUsage();
+        exit(1);
+    }
+
+    if( pszBenchmarkScript != NULL )
+    {
+        if( !benchmark_start(pszBenchmarkScript) )
+        {
+            fprintf(stderr, "%s\n", szGDALMessages);
+            exit(1);
+        }
+        /* headless, and the same work every run */
+        if( pszDriver == NULL )
+            pszDriver = strdup("null");
+        bLazyStats = FALSE;
+    }
+
+    if( pszRenderFormat != NULL )
+    {
+        /* each file on its own rather than in a mosaic, and no display */
+        memset(&render, 0, sizeof(render));
+        render.pszFormat = pszRenderFormat;
+        render.pszExtension = render_get_extension(pszRenderFormat);
+        if( render.pszExtension == NULL )
+        {
+            fprintf(stderr, "Unable to render to %s\n", pszRenderFormat);
+            exit(1);
+        }
+        render.pszOutDir = pszRenderOutDir;
+        render.papszFileNames = papszFileNames;
+        render.pStretchList = &stretchList;
+        render.pCmdStretch = pCmdStretch;
+        render.pszDitherAlgorithm = algos[dither_algorithm * 2];
+        render.bAntialias = bAntialias;
+        render.nPixPerCell = get_pix_per_cell(bAntialias, nQuality);
+        render.nJobs = nRenderJobs;
+
+        ww = nRenderWidth;
+        wh = nRenderHeight;
+        /* each file is looked at once, and not again afterwards */
+        bLazyStats = FALSE;
+        bBuildOverviews = FALSE;
+        select_stretch_kernel(bAllowSIMD);
+        gdal_init(nCloudAccess, papszFileNames[0]);
+
+        i = render_files(&render);
+
+        tile_cache_purge(NULL);
+        frame_pool_trim();
+        CPLFree(pCmdStretch);
+        CPLFree(pszStatsCacheFile);
+        CSLDestroy(papszStatsCache);
+        CPLFree(pszOverviewCacheDir);
+        CSLDestroy(papszFileNames);
+        CPLFree(pszFileName);
+        perf_log_stop();
+        return i;
+    }
+
+    if( (pszGeolinkFile != NULL) && !geolink_open(pszGeolinkFile) )
+    {
+        fprintf(stderr, "%s\n", szGDALMessages);
+        exit(1);
+    }
+
+    /* before the loader thread starts */
+    select_stretch_kernel(bAllowSIMD);
+
+    /* Initialise libcaca */
+    cv = caca_create_canvas(0, 0);
+    if(!cv)
+    {
+        fprintf(stderr, "Unable to initialise libcaca\n");
+        return 1;
+    }
+
+    /* If they have specified driver, use that */
+    if( pszDriver != NULL )
+    {
+        dp = caca_create_display_with_driver(cv, pszDriver);
+        if(!dp)
+        {
+            fprintf(stderr, "Unable to initialise libcaca with driver %s\n", pszDriver);
+            return 1;
+        }
+        /* finished with it */
+        CPLFree(pszDriver);
+        pszDriver = NULL;
+    }
+    else
+    {
+        /* fall back on default */
+        dp = caca_create_display(cv);
+        if( !dp )
+        {
+            fprintf(stderr, "Unable to initialise libcaca\n");
+            return 1;
+        }
+    }
+
+    /* init GDAL */
+    gdal_init(nCloudAccess, papszFileNames[0]);
+
+    if( (CSLCount(papszFileNames) > 1) && !build_mosaic(papszFileNames) )
+    {
+        caca_free_display(dp);
+        caca_free_canvas(cv);
+        fprintf(stderr, "%s\n", szGDALMessages);
+        return 1;
+    }
+
+    /* Set the window title */
+    caca_set_display_title(dp, "gdalcacaview");
+
+    ww = caca_get_canvas_width(cv);
+    wh = caca_get_canvas_height(cv);
+
+    /* Fill the gamma table */
+    gammatab[0] = 1.0;
+    for(i = 0; i < GAMMA_MAX; i++)
+        gammatab[i + 1] = gammatab[i] * GAMMA_FACTOR;
+
+    /* Go ! */
+    while(!quit)
+    {
+        caca_event_t ev;
+        unsigned int const event_mask = CACA_EVENT_KEY_PRESS
+                                        | CACA_EVENT_RESIZE
+                                        | CACA_EVENT_QUIT;
+        unsigned int new_status = 0, new_help = 0;
+        int event, nKeyWaits = 0, bBurst = FALSE;
+
+        /* nothing to read in the segment, so follow the others as soon as they move */
+        if( (geolink.pRecord != NULL) && geolink_read(&dispExtent) )
+            dirty |= LAYER_SOURCE | LAYER_CANVAS;
+
+        if( pszBenchmarkScript != NULL )
+        {
+            /* the script stands in for the keyboard */
+            event = 0;
+            if( loading )
+            {
+                /* keep checking for the loader finishing */
+                if( caca_get_event(dp, CACA_EVENT_QUIT, &ev, LOADER_POLL_TIMEOUT) )
+                    quit = 1;
+            }
+            else if( !dirty )
+            {
+                /* the last line's frame is up */
+                benchmark_end_frame();
+                i = benchmark_next_line(&dispExtent);
+                if( i == BENCHMARK_END )
+                    quit = 1;
+                else if( i == BENCHMARK_EXTENT )
+                    dirty |= LAYER_SOURCE | LAYER_CANVAS;
+                else
+                    event = benchmark_next_key();
+                benchmark_start_frame();
+            }
+        }
+        else if(dirty)
+            event = caca_get_event(dp, event_mask, &ev, 0);
+        else if(loading || bStatsPending)
+        {
+            /* keep checking for the loader finishing */
+            event = caca_get_event(dp, event_mask, &ev, LOADER_POLL_TIMEOUT);
+        }
+        else if( geolink.pRecord != NULL )
+        {
+            /* libcaca can't wait on the segment as well, so check it often */
+            event = caca_get_event(dp, event_mask, &ev, GEOLINK_SHARED_TIMEOUT);
+        }
+        else if( geolink.pszFile != NULL )
+        {
+            /* set timeout to 1 second */
+            event = caca_get_event(dp, event_mask, &ev, GEOLINK_TIMEOUT);
+            if( (event == 0) && geolink_read(&dispExtent) )
+            {
+                /* timeout and we are geolinking */
+                dirty |= LAYER_SOURCE | LAYER_CANVAS;
+            }
+        }
+        else if( nOverviewState == OVERVIEW_BUILD_RUNNING )
+        {
+            /* keep the progress up to date */
+            event = caca_get_event(dp, event_mask, &ev, OVERVIEW_POLL_TIMEOUT);
+        }
+        else
         {
             event = caca_get_event(dp, event_mask, &ev, -1);
         }
 
-        while(event)
+        while(event)
+        {
+            if( (pszBenchmarkScript != NULL) || (caca_get_event_type(&ev) & CACA_EVENT_KEY_PRESS) )
+            {
+                int ch = (pszBenchmarkScript != NULL) ? event : caca_get_event_key_ch(&ev);
+                switch(ch)
+                {
+                case 'd':
+                    dither_algorithm++;
+                    if(algos[dither_algorithm * 2] == NULL)
+                        dither_algorithm = 0;
+                    new_status = STATUS_DITHERING;
+                    dirty |= LAYER_DITHER | LAYER_CANVAS;
+                    break;
+                case 'D':
+                    dither_algorithm--;
+                    if(dither_algorithm < 0)
+                        while(algos[dither_algorithm * 2 + 2] != NULL)
+                            dither_algorithm++;
+                    new_status = STATUS_DITHERING;
+                    dirty |= LAYER_DITHER | LAYER_CANVAS;
+                    break;
+                case 'a':
+                case 'A':
+                    bAntialias = !bAntialias;
+                    new_status = STATUS_ANTIALIASING;
+                    /* needs reading at the new resolution */
+                    dirty |= LAYER_SOURCE | LAYER_DITHER | LAYER_CANVAS;
+                    break;
+                case '+':
+                    dispExtent.dMetersPerCell *= ZOOM_IN_FACTOR;
+                    dirty |= LAYER_SOURCE | LAYER_CANVAS;
+                    bBurst = TRUE;
+                    break;
+                case '-':
+                    dispExtent.dMetersPerCell *= ZOOM_OUT_FACTOR;
+                    dirty |= LAYER_SOURCE | LAYER_CANVAS;
+                    bBurst = TRUE;
+                    break;
+                case 'G':
+                    dirty |= LAYER_DITHER | LAYER_CANVAS;
+                    set_gamma(g + 1);
+                    break;
+                case 'g':
+                    dirty |= LAYER_DITHER | LAYER_CANVAS;
+                    set_gamma(g - 1);
+                    break;
+                case 'x':
+                case 'X':
+                    dispExtent.dCentreX = gdalfile.fullExtent.dCentreX;
+                    dispExtent.dCentreY = gdalfile.fullExtent.dCentreY;
+                    dispExtent.dMetersPerCell = gdalfile.fullExtent.dMetersPerCell;
+                    dirty |= LAYER_SOURCE | LAYER_DITHER | LAYER_CANVAS;
+                    set_gamma(0);
+                    break;
+                case 'k':
+                case 'K':
+                case CACA_KEY_UP:
+                    pan_extent(&dispExtent, 0, 1);
+                    dirty |= LAYER_SOURCE | LAYER_CANVAS;
+                    bBurst = TRUE;
+                    break;
+                case 'j':
+                case 'J':
+                case CACA_KEY_DOWN:
+                    pan_extent(&dispExtent, 0, -1);
+                    dirty |= LAYER_SOURCE | LAYER_CANVAS;
+                    bBurst = TRUE;
+                    break;
+                case 'h':
+                case 'H':
+                case CACA_KEY_LEFT:
+                    pan_extent(&dispExtent, -1, 0);
+                    dirty |= LAYER_SOURCE | LAYER_CANVAS;
+                    bBurst = TRUE;
+                    break;
+                case 'l':
+                case 'L':
+                case CACA_KEY_RIGHT:
+                    pan_extent(&dispExtent, 1, 0);
+                    dirty |= LAYER_SOURCE | LAYER_CANVAS;
+                    bBurst = TRUE;
+                    break;
+                case 'p':
+                case 'P':
+                    bPerfHUD = !bPerfHUD;
+                    stage_times_update_enabled();
+                    dirty |= LAYER_CANVAS;
+                    break;
+                case '?':
+                    new_help = !help;
+                    dirty |= LAYER_CANVAS;
+                    break;
+                case 'q':
+                case 'Q':
+                case CACA_KEY_ESCAPE:
+                    quit = 1;
+                    break;
+                }
+            }
+            else if(caca_get_event_type(&ev) == CACA_EVENT_RESIZE)
+            {
+                caca_refresh_display(dp);
+                ww = caca_get_event_resize_width(&ev);
+                wh = caca_get_event_resize_height(&ev);
+                dirty |= LAYER_CANVAS;
+                /* the images will be a different size from now on */
+                frame_pool_trim();
+                /* the image we have can just be dithered again if it still */
+                /* covers the window. Otherwise ask for one of the new size */
+                if( (im == NULL) || loading || !image_covers(im, &dispExtent) )
+                    dirty |= LAYER_SOURCE;
+            }
+            else if(caca_get_event_type(&ev) & CACA_EVENT_QUIT)
+                quit = 1;
+
+            if(status || new_status)
+                status = new_status;
+
+            if(help || new_help)
+                help = new_help;
+
+            if( pszBenchmarkScript != NULL )
+            {
+                /* the keys of a line are one burst */
+                event = benchmark_next_key();
+            }
+            /* a burst of zoom and pan keys adds up to one extent and */
+            /* one load, so give the next key of the burst a moment to come. */
+            /* Resizes and quits that come meanwhile are handled as usual */
+            else if( bBurst && !quit && (nKeyWaits < MAX_KEY_REPEAT_WAITS) )
+            {
+                nKeyWaits++;
+                event = caca_get_event(dp, event_mask, &ev, KEY_REPEAT_TIMEOUT);
+            }
+            else
+            {
+                event = caca_get_event(dp, event_mask, &ev, 0);
+            }
+        }
+
+        /* reopen once overviews are built so they get used */
+        nNewOverviewState = overview_build_poll(&dOverviewProgress);
+        if( (nNewOverviewState == OVERVIEW_BUILD_RUNNING) && 
+                ((int)(dOverviewProgress * 100) != nOverviewPercent) )
+        {
+            nOverviewPercent = (int)(dOverviewProgress * 100);
+            dirty |= LAYER_CANVAS;
+        }
+        else if( nNewOverviewState != nOverviewState )
+        {
+            nOverviewPercent = -1;
+            bOverviewsFailed = (nNewOverviewState == OVERVIEW_BUILD_FAILED);
+            if( nNewOverviewState == OVERVIEW_BUILD_DONE )
+            {
+                reload = 1;
+                bKeepExtent = TRUE;
+            }
+            dirty |= LAYER_CANVAS;
+        }
+        nOverviewState = nNewOverviewState;
+
+        if(reload)
+        {
+            char *buffer;
+            int len = strlen(" Loading `%s'... ") + strlen(pszFileName);
+
+            if(len < ww + 1)
+                len = ww + 1;
+
+            buffer = CPLMalloc(len);
+
+            /* the same file again carries on showing what it was */
+            /* until the new image is ready */
+            if( !bKeepExtent || (im == NULL) )
+            {
+                sprintf(buffer, " Loading `%s'... ", pszFileName);
+                buffer[ww] = '\0';
+                caca_set_color_ansi(cv, CACA_WHITE, CACA_BLUE);
+                caca_put_str(cv, (ww - strlen(buffer)) / 2, wh / 2, buffer);
+                caca_refresh_display(dp);
+            }
+            ww = caca_get_canvas_width(cv);
+            wh = caca_get_canvas_height(cv);
+
+            loader_stop();
+            loading = 0;
+            bStatsPending = 0;
+            if(gdalfile.ds)
+            {
+                gdal_close_file(&gdalfile);
+            }
+            if( im && !bKeepExtent )
+            {
+                gdal_unload_image(im);
+                im = NULL;
+            }
+
+            /* the open is part of the first frame */
+            perf_start_frame();
+            if( gdal_open_file(pszFileName, &gdalfile, &stretchList, pCmdStretch) )
+            {
+                if( !bKeepExtent )
+                {
+                    dispExtent.dCentreX = gdalfile.fullExtent.dCentreX;
+                    dispExtent.dCentreY = gdalfile.fullExtent.dCentreY;
+                    dispExtent.dMetersPerCell = gdalfile.fullExtent.dMetersPerCell;
+                }
+                loader_start(&gdalfile);
+                loader_request(&dispExtent, ww, wh, get_pix_per_cell(bAntialias, nQuality));
+                loading = 1;
+                overview_build_start(&gdalfile);
+            }
+            else if( im )
+            {
+                /* nothing to replace it */
+                gdal_unload_image(im);
+                im = NULL;
+            }
+
+            reload = 0;
+
+            /* Reset image-specific runtime variables unless it is the */
+            /* same image again */
+            dirty = LAYER_CANVAS;
+            if( !bKeepExtent )
+                set_gamma(0);
+            bKeepExtent = FALSE;
+
+            CPLFree(buffer);
+        }
+
+        /* real statistics or the colour table have replaced the */
+        /* estimates so restretch */
+        if( loader.bRunning && loader_stats_updated(&bStatsPending) )
+        {
+            CPLFree(pszStretchStatusString);
+            pszStretchStatusString = get_stretch_as_string(gdalfile.stretch);
+            dirty |= LAYER_SOURCE;
+        }
+
+        if(dirty & LAYER_SOURCE)
+        {
+            /* carry on showing the current image until the new one is ready */
+            if(loader.bRunning)
+            {
+                if( !loading )
+                {
+                    perf_start_frame();
+                }
+                loader_request(&dispExtent, ww, wh, get_pix_per_cell(bAntialias, nQuality));
+                loading = 1;
+            }
+
+            /* Write out new information to geolink file if required */
+            if( geolink_is_open() )
+                geolink_write(&dispExtent);
+
+            dirty &= ~LAYER_SOURCE;
+        }
+
+        if(loading)
+        {
+            struct image *newIm;
+            if( loader_get_result(&newIm, &loading) )
+            {
+                if(im)
+                    gdal_unload_image(im);
+                im = newIm;
+                dirty |= LAYER_DITHER | LAYER_CANVAS;
+                /* the benchmark does its own frames */
+                bFrameDone = !loading && (pszBenchmarkScript == NULL);
+            }
+        }
+
+        /* new image or new settings - the pixels themselves are left alone */
+        if( (dirty & LAYER_DITHER) && (im != NULL) )
+        {
+            if( im->dither == NULL )
+            {
+                im->dither = dither_get(im->w, im->h);
+            }
+            if( im->dither == NULL )
+            {
+                set_read_error("Unable to create dither");
+                gdal_unload_image(im);
+                im = NULL;
+            }
+            else
+            {
+                caca_set_dither_algorithm(im->dither, algos[dither_algorithm * 2]);
+                caca_set_dither_antialias(im->dither, bAntialias ? "prefilter" : "none");
+                caca_set_dither_gamma(im->dither, GAMMA(g));
+            }
+            dirty |= LAYER_CANVAS;
+        }
+        dirty &= ~LAYER_DITHER;
+
+        if(!(dirty & LAYER_CANVAS))
+        {
+            /* nothing has changed */
+            continue;
+        }
+
+        caca_set_color_ansi(cv, CACA_WHITE, CACA_BLACK);
+        caca_clear_canvas(cv);
+
+        if(!im)
+        {
+            char *buffer;
+            char *error = " Error loading `%s'. ";
+            char szMessage[GDAL_ERROR_SIZE];
+            int len;
+
+            if(loading)
+            {
+                error = " Loading `%s'... ";
+            }
+            len = strlen(error) + strlen(pszFileName);
+
+            /* the loader can still be setting it while prefetching */
+            get_read_error(szMessage);
+            if( !loading && (strlen( szMessage ) != 0) )
+            {
+                /* if there was a message returned use it */
+                /* no extra formatting required */
+                error = szMessage;
+                len = strlen(error);
+            }
+
+            if(len < ww + 1)
+                len = ww + 1;
+
+            buffer = CPLMalloc(len);
+
+            sprintf(buffer, error, pszFileName);
+            buffer[ww] = '\0';
+            caca_set_color_ansi(cv, CACA_WHITE, CACA_BLUE);
+            caca_put_str(cv, (ww - strlen(buffer)) / 2, wh / 2, buffer);
+            CPLFree(buffer);
+        }
+        else
+        {
+            draw_image(im, &dispExtent);
+        }
+
+        nStatusWidth = print_status();
+
+        caca_set_color_ansi(cv, CACA_LIGHTGRAY, CACA_BLACK);
+        switch(status)
+        {
+        case STATUS_DITHERING:
+            nStatusWidth = MAX(nStatusWidth, caca_printf(cv, 0, wh - 1, "Dithering: %s", 
+                        algos[dither_algorithm * 2]));
+            break;
+        case STATUS_ANTIALIASING:
+            nStatusWidth = MAX(nStatusWidth, caca_printf(cv, 0, wh - 1, 
+                        "Antialiasing: %s (%d pixels per cell)", bAntialias ? "prefilter" : "none", 
+                        get_pix_per_cell(bAntialias, nQuality)));
+            break;
+        }
+
+        if( bPerfHUD )
+        {
+            /* in what the messages leave of the bottom line */
+            print_perf_hud(nStatusWidth);
+        }
+
+        if(help)
+        {
+            print_help(ww - 26, 2);
+        }
+
+        dStart = stage_start();
+        caca_refresh_display(dp);
+        stage_end(STAGE_REFRESH, dStart);
+        dirty &= ~LAYER_CANVAS;
+
+        if( bFrameDone )
+        {
+            perf_end_frame();
+            bFrameDone = FALSE;
+            /* draw again to show the figures for this frame */
+            if( bPerfHUD )
+                dirty |= LAYER_CANVAS;
+        }
+    }
+
+    /* Clean up */
+    overview_build_stop();
+    geolink_close();
+    loader_stop();
+    if(im)
+        gdal_unload_image(im);
+    if(gdalfile.ds)
+        gdal_close_file(&gdalfile);
+    if(pszStretchStatusString)
+        CPLFree(pszStretchStatusString);
+    if(pCmdStretch)
+        CPLFree(pCmdStretch);
+    tile_cache_purge(NULL);
+    frame_pool_trim();
+    CPLFree(pszStatsCacheFile);
+    CSLDestroy(papszStatsCache);
+    CPLFree(pszOverviewCacheDir);
+    if( CSLCount(papszFileNames) > 1 )
+    {
+        mosaic_free();
+    }
+    CSLDestroy(papszFileNames);
+    CPLFree(pszFileName);
+    caca_free_display(dp);
+    caca_free_canvas(cv);
+
+    if( pszBenchmarkScript != NULL )
+    {
+        /* so a script's budgets can fail a test */
+        if( benchmark_report(stdout) > 0 )
+            nExitCode = 1;
+        benchmark_stop();
+    }
+    perf_log_stop();
+
+    return nExitCode;
+}
+
+/* Returns how much of the bottom line its messages took */
+static int print_status(void)
+{
+    int nWidth = 0;
+
+    caca_set_color_ansi(cv, CACA_WHITE, CACA_BLUE);
+    caca_draw_line(cv, 0, 0, ww - 1, 0, ' ');
+    caca_draw_line(cv, 0, wh - 2, ww - 1, wh - 2, '-');
+    caca_put_str(cv, 0, 0, "q:Quit +-x:Zoom  gG:Gamma  "
+                 "hjkl:Move  d:Dither  a:Antialias");
+    caca_put_str(cv, ww - strlen("?:Help"), 0, "?:Help");
+    caca_printf(cv, ww - 30, wh - 2, "(gamma: %#.3g)", GAMMA(g));
+    /*    caca_printf(cv, ww - 14, wh - 2, "(zoom: %s%i)", zoom > 0 ? "+" : "", zoom);*/
+
+    if( pszStretchStatusString != NULL )
+    {
+        caca_put_str(cv, 10, wh - 2, pszStretchStatusString);
+    }
+    else
+    {
+        caca_put_str(cv, 10, wh - 2, "No Stretch");
+    }
+
+    caca_set_color_ansi(cv, CACA_LIGHTGRAY, CACA_BLACK);
+    caca_draw_line(cv, 0, wh - 1, ww - 1, wh - 1, ' ');
+
+    if( nOverviewPercent >= 0 )
+    {
+        nWidth = caca_printf(cv, 0, wh - 1, "Building overviews %d%%", nOverviewPercent);
+    }
+    else if( bOverviewsFailed )
+    {
+        nWidth = caca_put_str(cv, 0, wh - 1, "Couldn't build overviews");
+    }
+
+    return nWidth;
+}
+
+/* ms of the last frame and the samples read for it, on the right of the */
+/* bottom line and cut short to keep clear of the nUsed columns on its left */
+static void print_perf_hud(int nUsed)
+{
+    char szHUD[256];
+    struct perfCounters *p = &perfFrame;
+    int nTiles = p->nTileHits + p->nTileMisses;
+    int nRoom = ww - nUsed - 1;
+
+    snprintf(szHUD, sizeof(szHUD), "ov %.1f io %.1f str %.1f il %.1f dith %.1f ref %.1f = %.1fms",
+             p->adSeconds[STAGE_OVERVIEW] * 1000.0, p->adSeconds[STAGE_RASTERIO] * 1000.0,
+             p->adSeconds[STAGE_STRETCH] * 1000.0, p->adSeconds[STAGE_INTERLEAVE] * 1000.0,
+             p->adSeconds[STAGE_DITHER] * 1000.0, p->adSeconds[STAGE_REFRESH] * 1000.0,
+             dPerfFrameSeconds * 1000.0);
+    if( nTiles > 0 )
+    {
+        snprintf(szHUD + strlen(szHUD), sizeof(szHUD) - strlen(szHUD), " hit %d%%", 
+                 (100 * p->nTileHits) / nTiles);
+    }
+    snprintf(szHUD + strlen(szHUD), sizeof(szHUD) - strlen(szHUD), " samples %.1fMB", 
+             p->nSampleBytes / (1024.0 * 1024.0));
+
+    if( nRoom <= 0 )
+        return;
+    if( (int)strlen(szHUD) > nRoom )
+        szHUD[nRoom] = '\0';
+    caca_put_str(cv, ww - (int)strlen(szHUD), wh - 1, szHUD);
+}
+
+static void print_help(int x, int y)
+{
+    static char const *help[] =
+    {
+        " +: zoom in              ",
+        " -: zoom out             ",
+        " g: decrease gamma       ",
+        " G: increase gamma       ",
+        " x: reset zoom and gamma ",
+        " ----------------------- ",
+        " hjkl: move view         ",
+        " arrows: move view       ",
+        " ----------------------- ",
+        " d: dithering method     ",
+        " a: toggle antialiasing  ",
+        " p: performance readout  ",
+        " ----------------------- ",
+        " ?: help                 ",
+        " q: quit                 ",
+        NULL
+    };
+
+    int i;
+
+    caca_set_color_ansi(cv, CACA_WHITE, CACA_BLUE);
+
+    for(i = 0; help[i]; i++)
+        caca_put_str(cv, x, y + i, help[i]);
+}
+
+static void set_gamma(int new_gamma)
+{
+    g = new_gamma;
+
+    if(g > GAMMA_MAX) g = GAMMA_MAX;
+    if(g < -GAMMA_MAX) g = -GAMMA_MAX;
+
+    /* the main loop passes it on to the dither */
+}
+
+/* Moves the extent by PAN_STEP of the window in the directions given. */
+/* Always by whole cells so the loader can shift the last image along */
+static void pan_extent(struct extent *extent, int nDirX, int nDirY)
+{
+    /* cells are half as wide on the ground as they are high */
+    extent->dCentreX += nDirX * floor(ww * PAN_STEP * 2 + 0.5) * extent->dMetersPerCell * 0.5;
+    extent->dCentreY += nDirY * floor(wh * PAN_STEP + 0.5) * extent->dMetersPerCell;
+}
+
+/* Where the image falls on the canvas for the extent being displayed */
+static void get_image_rect(struct image *im, struct extent *extent, int *px, int *py, int *pw, int *ph)
+{
+    double dCellX, dCellY, dLeft, dTop;
+    double dImLeft, dImRight, dImTop, dImBottom;
+
+    /* size of a cell on the ground. Same fiddle as prepare_for_reading */
+    /* and the image is squashed into wh - 3 lines */
+    dCellX = extent->dMetersPerCell * 0.5;
+    dCellY = (wh * extent->dMetersPerCell) / (wh - 3);
+    dLeft = extent->dCentreX - ((ww / 2.0) * dCellX);
+    dTop = extent->dCentreY + ((wh / 2.0) * extent->dMetersPerCell);
+
+    dImLeft = im->extent.dCentreX - ((im->nCellsX / 2.0) * im->extent.dMetersPerCell * 0.5);
+    dImRight = im->extent.dCentreX + ((im->nCellsX / 2.0) * im->extent.dMetersPerCell * 0.5);
+    dImTop = im->extent.dCentreY + ((im->nCellsY / 2.0) * im->extent.dMetersPerCell);
+    dImBottom = im->extent.dCentreY - ((im->nCellsY / 2.0) * im->extent.dMetersPerCell);
+
+    *px = floor(((dImLeft - dLeft) / dCellX) + 0.5);
+    *pw = floor(((dImRight - dLeft) / dCellX) + 0.5) - *px;
+    *py = 1 + floor(((dTop - dImTop) / dCellY) + 0.5);
+    *ph = 1 + floor(((dTop - dImBottom) / dCellY) + 0.5) - *py;
+}
+
+/* TRUE if the image fills the window for the extent, so it can be */
+/* shown without reading a new one */
+static int image_covers(struct image *im, struct extent *extent)
+{
+    int x, y, w, h;
+
+    if( im->extent.dMetersPerCell != extent->dMetersPerCell )
+        return FALSE;
+
+    get_image_rect(im, extent, &x, &y, &w, &h);
+    return (x <= 0) && (y <= 1) && (x + w >= ww) && (y + h >= wh - 2);
+}
+
+/* Draws the image where it falls within the extent being displayed. */
+/* Means the previous image can be shown shifted or scaled while a */
+/* new one is loading */
+static void draw_image(struct image *im, struct extent *extent)
+{
+    int x, y, w, h;
+    double dStart = stage_start();
+
+    if( (im->nCellsX == ww) && (im->nCellsY == wh) &&
+            (im->extent.dCentreX == extent->dCentreX) &&
+            (im->extent.dCentreY == extent->dCentreY) &&
+            (im->extent.dMetersPerCell == extent->dMetersPerCell) )
+    {
+        caca_dither_bitmap(cv, 0, 1, ww, wh - 3, im->dither, im->pixels);
+    }
+    else
+    {
+        get_image_rect(im, extent, &x, &y, &w, &h);
+
+        /* don't try and dither something silly sized */
+        if( (w > 0) && (h > 0) && (w < 100 * ww) && (h < 100 * wh) )
+        {
+            caca_dither_bitmap(cv, x, y, w, h, im->dither, im->pixels);
+        }
+    }
+
+    stage_end(STAGE_DITHER, dStart);
+}
+
+static void draw_checkers(int x, int y, int w, int h)
+{
+    int xn, yn;
+
+    if(x + w > (int)caca_get_canvas_width(cv))
+        w = caca_get_canvas_width(cv) - x;
+    if(y + h > (int)caca_get_canvas_height(cv))
+        h = caca_get_canvas_height(cv) - y;
+
+    for(yn = y > 0 ? y : 0; yn < y + h; yn++)
+        for(xn = x > 0 ? x : 0; xn < x + w; xn++)
+        {
+            if((((xn - x) / 5) ^ ((yn - y) / 3)) & 1)
+                caca_set_color_ansi(cv, CACA_LIGHTGRAY, CACA_DARKGRAY);
+            else
+                caca_set_color_ansi(cv, CACA_DARKGRAY, CACA_LIGHTGRAY);
+            caca_put_char(cv, xn, yn, ' ');
+        }
+}
+
+/* How many pixels across each cell needs. libcaca takes a single sample */
+/* per cell unless it is antialiasing, in which case it averages the box */
+/* under the cell and there is little gain past a few pixels. The dither */
+/* algorithm works on the one colour per cell so doesn't come into it */
+int get_pix_per_cell(int bAntialias, int nQuality)
+{
+    if( !bAntialias )
+        return 1;
+    return MAX(1, MIN(nQuality, PIX_PER_CELL));
+}
+
+/* Captures the overviews of every band of the file */
+void gdal_read_pyramids(struct gdalFile *file)
+{
+    int nBand, count, nOverviews;
+    GDALRasterBandH bandh, ovh;
+    struct bandPyramid *pyramid;
+    struct pyramidLevel *level;
+
+    file->nPyramidBands = GDALGetRasterCount(file->ds);
+    file->pasPyramids = (struct bandPyramid*)CPLCalloc(MAX(1, file->nPyramidBands),
+                                                       sizeof(struct bandPyramid));
+    for( nBand = 0; nBand < file->nPyramidBands; nBand++ )
+    {
+        bandh = GDALGetRasterBand(file->ds, nBand + 1);
+        pyramid = &file->pasPyramids[nBand];
+        nOverviews = GDALGetOverviewCount(bandh);
+        pyramid->pasLevels = (struct pyramidLevel*)CPLCalloc(nOverviews + 1, sizeof(struct pyramidLevel));
+        pyramid->nLevels = nOverviews + 1;
+        for( count = 0; count < pyramid->nLevels; count++ )
+        {
+            ovh = (count == 0) ? bandh : GDALGetOverview(bandh, count - 1);
+            if( ovh == NULL )
+            {
+                /* left 0 by 0 so it is never used */
+                continue;
+            }
+            level = &pyramid->pasLevels[count];
+            level->width = GDALGetRasterBandXSize(ovh);
+            level->height = GDALGetRasterBandYSize(ovh);
+            level->dXFactor = GDALGetRasterXSize(file->ds) / (double)MAX(1, level->width);
+            level->dYFactor = GDALGetRasterYSize(file->ds) / (double)MAX(1, level->height);
+            GDALGetBlockSize(ovh, &level->nBlockXSize, &level->nBlockYSize);
+            level->nBlockXSize = MAX(1, level->nBlockXSize);
+            level->nBlockYSize = MAX(1, level->nBlockYSize);
+        }
+    }
+}
+
+void gdal_free_pyramids(struct gdalFile *file)
+{
+    int nBand;
+
+    if( file->pasPyramids != NULL )
+    {
+        for( nBand = 0; nBand < file->nPyramidBands; nBand++ )
+        {
+            CPLFree(file->pasPyramids[nBand].pasLevels);
+        }
+        CPLFree(file->pasPyramids);
+    }
+    file->pasPyramids = NULL;
+    file->nPyramidBands = 0;
+}
+
+int gdal_get_stretch_band_count(struct stretch *stretch)
+{
+    return (stretch->mode == VIEWER_MODE_RGB) ? 3 : 1;
+}
+
+/* The level of the nth band of the stretch. NULL if it doesn't have it */
+struct pyramidLevel *gdal_get_pyramid_level(struct gdalFile *file, int nStretchBand, int nLevel)
+{
+    int nBand = file->stretch->bands[nStretchBand];
+    struct bandPyramid *pyramid;
+
+    if( (nBand < 1) || (nBand > file->nPyramidBands) )
+        return NULL;
+    pyramid = &file->pasPyramids[nBand - 1];
+    if( (nLevel >= pyramid->nLevels) || (pyramid->pasLevels[nLevel].width == 0) )
+        return NULL;
+    return &pyramid->pasLevels[nLevel];
+}
+
+/* The readers use the one overviewIndex for all the bands of the stretch */
+/* so a level can only be used if they all have it at the same size */
+int gdal_level_usable(struct gdalFile *file, int nLevel)
+{
+    int count;
+    struct pyramidLevel *first, *level;
+
+    first = gdal_get_pyramid_level(file, 0, nLevel);
+    if( first == NULL )
+        return FALSE;
+    for( count = 1; count < gdal_get_stretch_band_count(file->stretch); count++ )
+    {
+        level = gdal_get_pyramid_level(file, count, nLevel);
+        if( (level == NULL) || (level->width != first->width) || (level->height != first->height) )
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Estimate of the work to read the extent from a level: the pixels of */
+/* every block the window touches in each band plus an overhead per block */
+double gdal_get_level_cost(struct gdalFile *file, int nLevel, struct extent *extent,
+                           int nCellsX, int nCellsY)
+{
+    int count;
+    double dWidth, dHeight, dBlocksX, dBlocksY, dCost = 0;
+    struct pyramidLevel *level;
+
+    for( count = 0; count < gdal_get_stretch_band_count(file->stretch); count++ )
+    {
+        level = gdal_get_pyramid_level(file, count, nLevel);
+        dWidth = nCellsX * extent->dMetersPerCell * 0.5 / (file->adfTransform[1] * level->dXFactor);
+        dHeight = nCellsY * extent->dMetersPerCell / (fabs(file->adfTransform[5]) * level->dYFactor);
+        dWidth = MIN(dWidth, level->width);
+        dHeight = MIN(dHeight, level->height);
+
+        /* a window that isn't on a block boundary touches one more each way */
+        dBlocksX = MIN(ceil(dWidth / level->nBlockXSize) + 1,
+                       ceil(level->width / (double)level->nBlockXSize));
+        dBlocksY = MIN(ceil(dHeight / level->nBlockYSize) + 1,
+                       ceil(level->height / (double)level->nBlockYSize));
+        dCost += dBlocksX * dBlocksY * ((double)level->nBlockXSize * level->nBlockYSize + BLOCK_READ_COST);
+    }
+    return dCost;
+}
+
+int gdal_get_best_overview(struct gdalFile *file, struct extent *extent, int nCellsX, int nCellsY,
+                           int nPixPerCell)
+{
+    /* return 0 to use full res, or overviewIndex+1 */
+    int count, nLevels, nBestIndex;
+    double dCost, dBestCost, dPixelsPerCell;
+    struct pyramidLevel *level, *best;
+
+    best = gdal_get_pyramid_level(file, 0, 0);
+    if( best == NULL )
+    {
+        return 0;
+    }
+    nLevels = file->pasPyramids[file->stretch->bands[0] - 1].nLevels;
+    nBestIndex = 0;
+    dBestCost = gdal_get_level_cost(file, 0, extent, nCellsX, nCellsY);
+
+    /* of the overviews with more than nPixPerCell the cheapest to read. */
+    /* This is usually the coarsest but not if its blocks are much bigger */
+    for( count = 1; count < nLevels; count++ )
+    {
+        if( !gdal_level_usable(file, count) )
+            continue;
+        level = gdal_get_pyramid_level(file, 0, count);
+        dPixelsPerCell = extent->dMetersPerCell / (file->adfTransform[1] * level->dXFactor);
+        if( dPixelsPerCell <= nPixPerCell )
+            continue;
+
+        dCost = gdal_get_level_cost(file, count, extent, nCellsX, nCellsY);
+        if( (dCost < dBestCost) || ((dCost == dBestCost) && (level->dXFactor > best->dXFactor)) )
+        {
+            dBestCost = dCost;
+            best = level;
+            nBestIndex = count;
+        }
+    }
+
+    return nBestIndex;
+}
+
+/* Coarsest overview worth drawing while the one nBestIndex refers to is */
+/* read. Returns -1 if there isn't one coarser than that */
+int gdal_get_preview_overview(struct gdalFile *file, struct extent *extent, int nBestIndex)
+{
+    int count, nLevels, nPreviewIndex;
+    double dBestFactor, dPixelsPerCell;
+    struct pyramidLevel *level;
+
+    level = gdal_get_pyramid_level(file, 0, nBestIndex);
+    if( level == NULL )
+    {
+        return -1;
+    }
+    nLevels = file->pasPyramids[file->stretch->bands[0] - 1].nLevels;
+    dBestFactor = level->dXFactor;
+
+    /* overviews aren't necessarily in order so go by the factor */
+    nPreviewIndex = -1;
+    for( count = 1; count < nLevels; count++ )
+    {
+        if( !gdal_level_usable(file, count) )
+            continue;
+        level = gdal_get_pyramid_level(file, 0, count);
+        dPixelsPerCell = extent->dMetersPerCell / (file->adfTransform[1] * level->dXFactor);
+        if( (level->dXFactor > dBestFactor) && (dPixelsPerCell >= PREVIEW_MIN_PIX_PER_CELL) )
+        {
+            dBestFactor = level->dXFactor;
+            nPreviewIndex = count;
+        }
+    }
+
+    return nPreviewIndex;
+}
+
+void gdal_dump_image(const char *pszFilename,int depth, struct image *im)
+{
+    /* debugging routine for dumping contents of im->pixels to text file */
+    int xcount, ycount;
+    FILE *fh = fopen(pszFilename,"w");
+    if( fh != NULL )
+    {
+        fprintf( fh, "width = %d height = %d\n", im->w, im->h );
+
+        for( ycount = 0; ycount < im->h; ycount++ )
+        {
+            for( xcount = 0; xcount < im->w*depth; xcount++ )
+            {
+                fprintf( fh, "%d,", (int)im->pixels[ycount*im->w*depth+xcount] );
+            }
+            fprintf( fh, "\n" );
+        }
+        fclose(fh);
+    }
+}
+
+/* Types we read in natively. GDAL converts anything else to Float32 for us */
+GDALDataType gdal_get_read_type(GDALRasterBandH bandh)
+{
+    GDALDataType eType = GDALGetRasterDataType(bandh);
+    if( (eType == GDT_Byte) || (eType == GDT_UInt16) || (eType == GDT_Int16) )
+        return eType;
+    return GDT_Float32;
+}
+
+/* The stretch as cut offs then an offset and scale. That way the */
+/* scalar and vector kernels below all do exactly the same thing */
+void get_stretch_params(struct statisticsForBand *pStats, struct stretch *stretch, 
+                    struct stretchParams *p)
+{
+    if( stretch->stretchmode == VIEWER_STRETCHMODE_STDDEV )
+    {
+        p->fMin = pStats->dMin;
+        p->fMax = pStats->dMax;
+        p->fOffset = pStats->dMean - pStats->dStdDev * stretch->stretchparam[0];
+        p->fScale = 255.0 / (pStats->dStdDev * 2 * stretch->stretchparam[0]);
+    }
+    else if( stretch->stretchmode == VIEWER_STRETCHMODE_HIST )
+    {
+        p->fMin = pStats->dHistMin;
+        p->fMax = pStats->dHistMax;
+        p->fOffset = pStats->dHistMin;
+        p->fScale = 255.0 / (pStats->dHistMax - pStats->dHistMin);
+    }
+    else if( stretch->stretchmode == VIEWER_STRETCHMODE_LINEAR )
+    {
+        p->fMin = pStats->dMin;
+        p->fMax = pStats->dMax;
+        p->fOffset = pStats->dMin;
+        p->fScale = 255.0 / (pStats->dMax - pStats->dMin);
+    }
+    else
+    {
+        /* no stretch - just clamp */
+        p->fMin = 0;
+        p->fMax = 255;
+        p->fOffset = 0;
+        p->fScale = 1;
+    }
+
+    /* without a nodata value 0 is taken as one for the standard deviation stretch */
+    p->bNoData = pStats->bHasNoData || (stretch->stretchmode == VIEWER_STRETCHMODE_STDDEV);
+    p->fNoData = pStats->bHasNoData ? (float)pStats->dNoData : 0;
+}
+
+/* stretches a single value to range 0-255 */
+static unsigned char stretch_value(float fVal, const struct stretchParams *p)
+{
+    float fOut;
+
+    if( (fVal <= p->fMin) || (p->bNoData && (fVal == p->fNoData)) )
+        return 0;
+    if( fVal >= p->fMax )
+        return 255;
+
+    fOut = (fVal - p->fOffset) * p->fScale;
+    /* written this way so NaN is 0 as well, like the vector kernels */
+    if( !(fOut > 0) )
+        return 0;
+    if( fOut > 255 )
+        return 255;
+    return (unsigned char)fOut;
+}
+
+/* number of entries in the stretch lookup table for a type. 0 if it doesn't have one */
+int get_stretch_lut_size(GDALDataType eType)
+{
+    if( eType == GDT_Byte )
+        return 256;
+    if( (eType == GDT_UInt16) || (eType == GDT_Int16) )
+        return 65536;
+    return 0;
+}
+
+/* Build the table for the integer types so stretching is a lookup per pixel. */
+/* Stats and stretch don't change while the file is open */
+void build_stretch_lut(struct statisticsForBand *pStats, GDALDataType eType, struct stretch *stretch)
+{
+    int n, nSize = get_stretch_lut_size(eType);
+    int nOffset = (eType == GDT_Int16) ? INT16_LUT_OFFSET : 0;
+    struct stretchParams params;
+
+    CPLFree(pStats->pLUT);
+    pStats->pLUT = NULL;
+    if( nSize == 0 )
+        return;
+
+    get_stretch_params(pStats, stretch, &params);
+    pStats->pLUT = (unsigned char*)CPLMalloc(nSize);
+    for( n = 0; n < nSize; n++ )
+    {
+        pStats->pLUT[n] = stretch_value(n - nOffset, &params);
+    }
+}
+
+/* stretch kernels for the integer types */
+#define STRETCH_LUT_KERNEL(NAME, TYPE, OFFSET) \
+static void NAME(const void *pData, int size, unsigned char *pOut, int nOutSpace, \
+                    const unsigned char *pLUT) \
+{ \
+    const TYPE *pIn = (const TYPE*)pData; \
+    int n; \
+    for( n = 0; n < size; n++ ) \
+    { \
+        *pOut = pLUT[pIn[n] + OFFSET]; \
+        pOut += nOutSpace; \
+    } \
+}
+
+STRETCH_LUT_KERNEL(stretch_lut_byte, GByte, 0)
+STRETCH_LUT_KERNEL(stretch_lut_uint16, GUInt16, 0)
+STRETCH_LUT_KERNEL(stretch_lut_int16, GInt16, INT16_LUT_OFFSET)
+
+/* Float32 kernels. Output goes to every nOutSpace bytes of pOut */
+static void stretch_float_scalar(const float *pIn, int size, unsigned char *pOut, int nOutSpace,
+                    const struct stretchParams *p)
+{
+    int n;
+    for( n = 0; n < size; n++ )
+    {
+        *pOut = stretch_value(pIn[n], p);
+        pOut += nOutSpace;
+    }
+}
+
+/* copies a vector's worth of results to the output if it isn't contiguous */
+static void store_strided(const unsigned char *pTmp, int size, unsigned char *pOut, int nOutSpace)
+{
+    int n;
+    for( n = 0; n < size; n++ )
+    {
+        *pOut = pTmp[n];
+        pOut += nOutSpace;
+    }
+}
+
+#ifdef HAVE_SSE2_KERNEL
+/* 4 floats stretched to 4 ints */
+static __m128i stretch_sse2(__m128 v, __m128 vMin, __m128 vMax, __m128 vOffset, __m128 vScale,
+                    __m128 vNoData, int bNoData)
+{
+    __m128 vZero = _mm_setzero_ps(), v255 = _mm_set1_ps(255.0f);
+    __m128 r, mLow, mHigh;
+
+    r = _mm_mul_ps(_mm_sub_ps(v, vOffset), vScale);
+    r = _mm_min_ps(_mm_max_ps(r, vZero), v255);
+
+    /* cut offs. Low wins like in stretch_value */
+    mLow = _mm_cmple_ps(v, vMin);
+    if( bNoData )
+        mLow = _mm_or_ps(mLow, _mm_cmpeq_ps(v, vNoData));
+    mHigh = _mm_cmpge_ps(v, vMax);
+    r = _mm_or_ps(_mm_andnot_ps(mHigh, r), _mm_and_ps(mHigh, v255));
+    r = _mm_andnot_ps(mLow, r);
+
+    return _mm_cvttps_epi32(r);
+}
+
+static void stretch_float_sse2(const float *pIn, int size, unsigned char *pOut, int nOutSpace,
+                    const struct stretchParams *p)
+{
+    __m128 vMin = _mm_set1_ps(p->fMin), vMax = _mm_set1_ps(p->fMax);
+    __m128 vOffset = _mm_set1_ps(p->fOffset), vScale = _mm_set1_ps(p->fScale);
+    __m128 vNoData = _mm_set1_ps(p->fNoData);
+    __m128i a, b, c, d, packed;
+    unsigned char aTmp[16];
+    int n;
+
+    for( n = 0; (n + 16) <= size; n += 16 )
+    {
+        a = stretch_sse2(_mm_loadu_ps(pIn + n), vMin, vMax, vOffset, vScale, vNoData, p->bNoData);
+        b = stretch_sse2(_mm_loadu_ps(pIn + n + 4), vMin, vMax, vOffset, vScale, vNoData, p->bNoData);
+        c = stretch_sse2(_mm_loadu_ps(pIn + n + 8), vMin, vMax, vOffset, vScale, vNoData, p->bNoData);
+        d = stretch_sse2(_mm_loadu_ps(pIn + n + 12), vMin, vMax, vOffset, vScale, vNoData, p->bNoData);
+        packed = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+        if( nOutSpace == 1 )
+        {
+            _mm_storeu_si128((__m128i*)(pOut + n), packed);
+        }
+        else
+        {
+            _mm_storeu_si128((__m128i*)aTmp, packed);
+            store_strided(aTmp, 16, pOut + n * nOutSpace, nOutSpace);
+        }
+    }
+
+    stretch_float_scalar(pIn + n, size - n, pOut + n * nOutSpace, nOutSpace, p);
+}
+#endif
+
+#ifdef HAVE_AVX2_KERNEL
+/* 8 floats stretched to 8 ints */
+static TARGET_AVX2 __m256i stretch_avx2(__m256 v, __m256 vMin, __m256 vMax, __m256 vOffset, 
+                    __m256 vScale, __m256 vNoData, int bNoData)
+{
+    __m256 vZero = _mm256_setzero_ps(), v255 = _mm256_set1_ps(255.0f);
+    __m256 r, mLow, mHigh;
+
+    r = _mm256_mul_ps(_mm256_sub_ps(v, vOffset), vScale);
+    r = _mm256_min_ps(_mm256_max_ps(r, vZero), v255);
+
+    mLow = _mm256_cmp_ps(v, vMin, _CMP_LE_OQ);
+    if( bNoData )
+        mLow = _mm256_or_ps(mLow, _mm256_cmp_ps(v, vNoData, _CMP_EQ_OQ));
+    mHigh = _mm256_cmp_ps(v, vMax, _CMP_GE_OQ);
+    r = _mm256_blendv_ps(r, v255, mHigh);
+    r = _mm256_andnot_ps(mLow, r);
+
+    return _mm256_cvttps_epi32(r);
+}
+
+static TARGET_AVX2 void stretch_float_avx2(const float *pIn, int size, unsigned char *pOut, 
+                    int nOutSpace, const struct stretchParams *p)
+{
+    __m256 vMin = _mm256_set1_ps(p->fMin), vMax = _mm256_set1_ps(p->fMax);
+    __m256 vOffset = _mm256_set1_ps(p->fOffset), vScale = _mm256_set1_ps(p->fScale);
+    __m256 vNoData = _mm256_set1_ps(p->fNoData);
+    /* the packs work within each 128 bit lane so the result needs putting back in order */
+    __m256i vOrder = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    __m256i a, b, c, d, packed;
+    unsigned char aTmp[32];
+    int n;
+
+    for( n = 0; (n + 32) <= size; n += 32 )
+    {
+        a = stretch_avx2(_mm256_loadu_ps(pIn + n), vMin, vMax, vOffset, vScale, vNoData, p->bNoData);
+        b = stretch_avx2(_mm256_loadu_ps(pIn + n + 8), vMin, vMax, vOffset, vScale, vNoData, p->bNoData);
+        c = stretch_avx2(_mm256_loadu_ps(pIn + n + 16), vMin, vMax, vOffset, vScale, vNoData, p->bNoData);
+        d = stretch_avx2(_mm256_loadu_ps(pIn + n + 24), vMin, vMax, vOffset, vScale, vNoData, p->bNoData);
+        packed = _mm256_packus_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d));
+        packed = _mm256_permutevar8x32_epi32(packed, vOrder);
+        if( nOutSpace == 1 )
+        {
+            _mm256_storeu_si256((__m256i*)(pOut + n), packed);
+        }
+        else
+        {
+            _mm256_storeu_si256((__m256i*)aTmp, packed);
+            store_strided(aTmp, 32, pOut + n * nOutSpace, nOutSpace);
+        }
+    }
+
+    stretch_float_scalar(pIn + n, size - n, pOut + n * nOutSpace, nOutSpace, p);
+}
+#endif
+
+#ifdef HAVE_NEON_KERNEL
+/* 4 floats stretched to 4 ints */
+static uint16x4_t stretch_neon(float32x4_t v, float32x4_t vMin, float32x4_t vMax, 
+                    float32x4_t vOffset, float32x4_t vScale, float32x4_t vNoData, int bNoData)
+{
+    float32x4_t vZero = vdupq_n_f32(0.0f), v255 = vdupq_n_f32(255.0f);
+    float32x4_t r;
+    uint32x4_t mLow, mHigh;
+
+    r = vmulq_f32(vsubq_f32(v, vOffset), vScale);
+    r = vminq_f32(vmaxq_f32(r, vZero), v255);
+
+    mLow = vcleq_f32(v, vMin);
+    if( bNoData )
+        mLow = vorrq_u32(mLow, vceqq_f32(v, vNoData));
+    mHigh = vcgeq_f32(v, vMax);
+    r = vbslq_f32(mHigh, v255, r);
+    r = vbslq_f32(mLow, vZero, r);
+
+    return vmovn_u32(vcvtq_u32_f32(r));
+}
+
+static void stretch_float_neon(const float *pIn, int size, unsigned char *pOut, int nOutSpace,
+                    const struct stretchParams *p)
+{
+    float32x4_t vMin = vdupq_n_f32(p->fMin), vMax = vdupq_n_f32(p->fMax);
+    float32x4_t vOffset = vdupq_n_f32(p->fOffset), vScale = vdupq_n_f32(p->fScale);
+    float32x4_t vNoData = vdupq_n_f32(p->fNoData);
+    uint16x8_t lo, hi;
+    uint8x16_t packed;
+    unsigned char aTmp[16];
+    int n;
+
+    for( n = 0; (n + 16) <= size; n += 16 )
+    {
+        lo = vcombine_u16(stretch_neon(vld1q_f32(pIn + n), vMin, vMax, vOffset, vScale, vNoData, p->bNoData),
+                    stretch_neon(vld1q_f32(pIn + n + 4), vMin, vMax, vOffset, vScale, vNoData, p->bNoData));
+        hi = vcombine_u16(stretch_neon(vld1q_f32(pIn + n + 8), vMin, vMax, vOffset, vScale, vNoData, p->bNoData),
+                    stretch_neon(vld1q_f32(pIn + n + 12), vMin, vMax, vOffset, vScale, vNoData, p->bNoData));
+        packed = vcombine_u8(vmovn_u16(lo), vmovn_u16(hi));
+        if( nOutSpace == 1 )
+        {
+            vst1q_u8(pOut + n, packed);
+        }
+        else
+        {
+            vst1q_u8(aTmp, packed);
+            store_strided(aTmp, 16, pOut + n * nOutSpace, nOutSpace);
+        }
+    }
+
+    stretch_float_scalar(pIn + n, size - n, pOut + n * nOutSpace, nOutSpace, p);
+}
+#endif
+
+/* fastest kernel the CPU supports. Set once by select_stretch_kernel */
+static void (*pfnStretchFloat)(const float *, int, unsigned char *, int, 
+                    const struct stretchParams *) = stretch_float_scalar;
+
+#if defined(HAVE_AVX2_KERNEL) && defined(_MSC_VER)
+static int cpu_has_avx2(void)
+{
+    int anInfo[4];
+
+    __cpuid(anInfo, 0);
+    if( anInfo[0] < 7 )
+        return FALSE;
+
+    /* needs the OS to save the registers too */
+    __cpuid(anInfo, 1);
+    if( !(anInfo[2] & (1 << 27)) || !(anInfo[2] & (1 << 28)) )
+        return FALSE;
+    if( (_xgetbv(0) & 6) != 6 )
+        return FALSE;
+
+    __cpuidex(anInfo, 7, 0);
+    return (anInfo[1] & (1 << 5)) != 0;
+}
+#elif defined(HAVE_AVX2_KERNEL)
+static int cpu_has_avx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+/* Pick the kernel once at startup before any threads are going. */
+/* bAllowSIMD is FALSE to force the scalar code. Returns its name */
+const char *select_stretch_kernel(int bAllowSIMD)
+{
+    pfnStretchFloat = stretch_float_scalar;
+    if( !bAllowSIMD )
+        return "scalar";
+#ifdef HAVE_AVX2_KERNEL
+    if( cpu_has_avx2() )
+    {
+        pfnStretchFloat = stretch_float_avx2;
+        return "avx2";
+    }
+#endif
+#ifdef HAVE_SSE2_KERNEL
+    pfnStretchFloat = stretch_float_sse2;
+    return "sse2";
+#elif defined(HAVE_NEON_KERNEL)
+    pfnStretchFloat = stretch_float_neon;
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+/* Adds the valid values of the raw data being stretched to the samples */
+/* of pStats, so the provisional statistics can be replaced by ones for */
+/* what the first frame showed */
+void stats_sample(const void *pData, GDALDataType eType, int size, struct statisticsForBand *pStats)
+{
+    double dValue, dMin = 0, dMax = 0, dSum = 0, dSumSq = 0;
+    int n, nCount = 0;
+
+    for( n = 0; n < size; n++ )
+    {
+        if( eType == GDT_Byte )
+            dValue = ((const GByte*)pData)[n];
+        else if( eType == GDT_UInt16 )
+            dValue = ((const GUInt16*)pData)[n];
+        else if( eType == GDT_Int16 )
+            dValue = ((const GInt16*)pData)[n];
+        else
+            dValue = ((const float*)pData)[n];
+
+        /* NaN or nodata */
+        if( (dValue != dValue) || (pStats->bHasNoData && ((float)dValue == (float)pStats->dNoData)) )
+            continue;
+        if( nCount == 0 )
+        {
+            dMin = dValue;
+            dMax = dValue;
+        }
+        dMin = MIN(dMin, dValue);
+        dMax = MAX(dMax, dValue);
+        dSum += dValue;
+        dSumSq += dValue * dValue;
+        nCount++;
+    }
+    if( nCount == 0 )
+        return;
+
+    CPLCreateOrAcquireMutex(&hStatsSampleMutex, 1000.0);
+    if( pStats->nSamples == 0 )
+    {
+        pStats->dSampleMin = dMin;
+        pStats->dSampleMax = dMax;
+    }
+    pStats->dSampleMin = MIN(pStats->dSampleMin, dMin);
+    pStats->dSampleMax = MAX(pStats->dSampleMax, dMax);
+    pStats->dSampleSum += dSum;
+    pStats->dSampleSumSq += dSumSq;
+    pStats->nSamples += nCount;
+    CPLReleaseMutex(hStatsSampleMutex);
+}
+
+/* stretches data of type eType to range 0-255 based on the current stretch. */
+/* Output goes to every nOutSpace bytes of pOut so it can be interleaved */
+int do_stretch(const void *pData, GDALDataType eType, int size, unsigned char *pOut, int nOutSpace,
+                    struct statisticsForBand *pStats, struct stretch *stretch)
+{
+    struct stretchParams params;
+
+    if( (stretch->stretchmode != VIEWER_STRETCHMODE_STDDEV) &&
+        (stretch->stretchmode != VIEWER_STRETCHMODE_LINEAR) &&
+        (stretch->stretchmode != VIEWER_STRETCHMODE_HIST) &&
+        (stretch->stretchmode != VIEWER_STRETCHMODE_NONE) )
+    {
+        set_read_error("stretch not currently supported");
+        return -1;
+    }
+
+    if( pStats->bProvisional )
+        stats_sample(pData, eType, size, pStats);
+
+    if( (pStats->pLUT != NULL) && (eType == GDT_Byte) )
+        stretch_lut_byte(pData, size, pOut, nOutSpace, pStats->pLUT);
+    else if( (pStats->pLUT != NULL) && (eType == GDT_UInt16) )
+        stretch_lut_uint16(pData, size, pOut, nOutSpace, pStats->pLUT);
+    else if( (pStats->pLUT != NULL) && (eType == GDT_Int16) )
+        stretch_lut_int16(pData, size, pOut, nOutSpace, pStats->pLUT);
+    else if( eType == GDT_Float32 )
+    {
+        get_stretch_params(pStats, stretch, &params);
+        pfnStretchFloat((const float*)pData, size, pOut, nOutSpace, &params);
+    }
+    else
+    {
+        set_read_error("No lookup table for data type");
+        return -1;
+    }
+
+    return 1;
+}
+
+/* colour table kernels. Output is IMG_DEPTH bytes per pixel. Anything */
+/* outside the table gets the black entry at the end, done as a select */
+/* rather than a branch so the compiler can vectorise it */
+#define COLOUR_LOOKUP_KERNEL(NAME, TYPE) \
+static void NAME(const void *pData, int size, unsigned char *pOut, \
+                    const struct colourTable *pColours) \
+{ \
+    const TYPE *pIn = (const TYPE*)pData; \
+    const unsigned char *pRGB = pColours->pRGB; \
+    unsigned int nEntries = (unsigned int)pColours->nEntries, nIndex; \
+    int n; \
+    for( n = 0; n < size; n++ ) \
+    { \
+        nIndex = (unsigned int)(int)pIn[n]; \
+        nIndex = (nIndex < nEntries) ? nIndex : nEntries; \
+        pOut[0] = pRGB[nIndex * IMG_DEPTH]; \
+        pOut[1] = pRGB[nIndex * IMG_DEPTH + 1]; \
+        pOut[2] = pRGB[nIndex * IMG_DEPTH + 2]; \
+        pOut += IMG_DEPTH; \
+    } \
+}
+
+COLOUR_LOOKUP_KERNEL(colour_lookup_byte, GByte)
+COLOUR_LOOKUP_KERNEL(colour_lookup_uint16, GUInt16)
+COLOUR_LOOKUP_KERNEL(colour_lookup_int16, GInt16)
+
+/* float converted to int is undefined out of range so check first */
+static void colour_lookup_float(const void *pData, int size, unsigned char *pOut,
+                    const struct colourTable *pColours)
+{
+    const float *pIn = (const float*)pData;
+    const unsigned char *pRGB = pColours->pRGB;
+    int n, nIndex;
+    for( n = 0; n < size; n++ )
+    {
+        /* NaN fails too */
+        if( (pIn[n] >= 0) && (pIn[n] < pColours->nEntries) )
+            nIndex = (int)pIn[n];
+        else
+            nIndex = pColours->nEntries;
+        pOut[0] = pRGB[nIndex * IMG_DEPTH];
+        pOut[1] = pRGB[nIndex * IMG_DEPTH + 1];
+        pOut[2] = pRGB[nIndex * IMG_DEPTH + 2];
+        pOut += IMG_DEPTH;
+    }
+}
+
+/* looks up the colour of each pixel of type eType */
+void do_colour_lookup(const void *pData, GDALDataType eType, int size, unsigned char *pOut,
+                    const struct colourTable *pColours)
+{
+    if( eType == GDT_Byte )
+        colour_lookup_byte(pData, size, pOut, pColours);
+    else if( eType == GDT_UInt16 )
+        colour_lookup_uint16(pData, size, pOut, pColours);
+    else if( eType == GDT_Int16 )
+        colour_lookup_int16(pData, size, pOut, pColours);
+    else
+        colour_lookup_float(pData, size, pOut, pColours);
+}
+
+/* Blanks the nChannels bytes of each pixel of pOut, nPixelSpace apart, */
+/* where the mask read with the data is 0. A select rather than a branch */
+/* so the compiler can vectorise it */
+void apply_mask(unsigned char *pOut, int nPixelSpace, int nChannels, const GByte *pMask, int size)
+{
+    unsigned char nKeep;
+    int n, nChannel;
+
+    for( n = 0; n < size; n++ )
+    {
+        nKeep = (unsigned char)(0 - (pMask[n] != 0));
+        for( nChannel = 0; nChannel < nChannels; nChannel++ )
+            pOut[n * nPixelSpace + nChannel] &= nKeep;
+    }
+}
+
+/* The whole pixels of a level nSize across that the floating window */
+/* dfOff to dfOff+dfSize takes in */
+void gdal_get_whole_window(double dfOff, double dfSize, int nSize, int *pnOff, int *pnSize)
+{
+    *pnOff = MAX(0, MIN(nSize, (int)floor(dfOff)));
+    *pnSize = MIN(nSize, (int)ceil(dfOff + dfSize)) - *pnOff;
+}
+
+/* Info for passing to GDALRasterIO */
+struct readInfo
+{
+    double dfXOff, dfYOff, dfXSize, dfYSize; /* of the part of the buffer on the image */
+    int nXOff, nYOff, nXSize, nYSize; /* the whole pixels that takes in */
+    int nDataX, nDataY; /* where that part is in the buffer */
+    int nBufXSize, nBufYSize; /* and its size, 0 if none of it is on the image */
+};
+
+int prepare_for_reading(int dataWidth, int dataHeight, GDALDatasetH ds, GDALRasterBandH ovh, struct extent *extent,
+                        int nCellsX, int nCellsY, struct readInfo *info)
+{
+    double adfTransform[6], adfInvertTransform[6], x1, y1, x2, y2;
+    int width, height, nStartX, nStartY, nEndX, nEndY;
+    double dTLX, dTLY, dBRX, dBRY, dXFactor, dYFactor, dXRatio, dYRatio;
+
+    width = GDALGetRasterBandXSize(ovh);
+    height = GDALGetRasterBandYSize(ovh);
+    dXFactor = GDALGetRasterXSize(ds) / (double)width;
+    dYFactor = GDALGetRasterYSize(ds) / (double)height;
+
+    /* Fiddle to make picture come out correct dimensions */
+    /* I think this undoes some of the stuff libcaca does */
+    /* Needs more investigation */
+    dTLX = extent->dCentreX - ((nCellsX / 2.0) * extent->dMetersPerCell * 0.5);
+    dBRX = extent->dCentreX + ((nCellsX / 2.0) * extent->dMetersPerCell * 0.5);
+    dTLY = extent->dCentreY + ((nCellsY / 2.0) * extent->dMetersPerCell);
+    dBRY = extent->dCentreY - ((nCellsY / 2.0) * extent->dMetersPerCell);
+
+    /* work out where we are from extent */
+    if( GDALGetGeoTransform(ds, adfTransform) != CE_None )
+    {
+        set_read_error("Image has no geotransform");
+        return 0;
+    }
+
+    /* Adjust pixel size for overview. Not necessarily a whole number */
+    /* or the same both ways if the size didn't divide evenly */
+    adfTransform[1] *= dXFactor;
+    adfTransform[5] *= dYFactor;
+
+    if( !GDALInvGeoTransform(adfTransform, adfInvertTransform) )
+    {
+        set_read_error("Unable to invert transform");
+        return 0;
+    }
+    GDALApplyGeoTransform(adfInvertTransform, dTLX, dTLY, &x1, &y1);
+    GDALApplyGeoTransform(adfInvertTransform, dBRX, dBRY, &x2, &y2);
+    dXRatio = (x2 - x1) / dataWidth;
+    dYRatio = (y2 - y1) / dataHeight;
+
+    /* Only the pixels of the buffer whose centres are on the image are */
+    /* read, through exactly the part of the window they cover, so they */
+    /* get what reading the whole window would have given them. The rest */
+    /* of the buffer is off the edge and left black */
+    nStartX = (int)MAX(0.0, MIN((double)dataWidth, ceil(-x1 / dXRatio - 0.5)));
+    nEndX = (int)MAX((double)nStartX, MIN((double)dataWidth, ceil((width - x1) / dXRatio - 0.5)));
+    nStartY = (int)MAX(0.0, MIN((double)dataHeight, ceil(-y1 / dYRatio - 0.5)));
+    nEndY = (int)MAX((double)nStartY, MIN((double)dataHeight, ceil((height - y1) / dYRatio - 0.5)));
+    if( (nStartX == nEndX) || (nStartY == nEndY) )
+    {
+        /* none of it */
+        nEndX = nStartX;
+        nEndY = nStartY;
+    }
+
+    info->dfXOff = x1 + nStartX * dXRatio;
+    info->dfYOff = y1 + nStartY * dYRatio;
+    info->dfXSize = (nEndX - nStartX) * dXRatio;
+    info->dfYSize = (nEndY - nStartY) * dYRatio;
+    gdal_get_whole_window(info->dfXOff, info->dfXSize, width, &info->nXOff, &info->nXSize);
+    gdal_get_whole_window(info->dfYOff, info->dfYSize, height, &info->nYOff, &info->nYSize);
+    info->nDataX = nStartX;
+    info->nDataY = nStartY;
+    info->nBufXSize = nEndX - nStartX;
+    info->nBufYSize = nEndY - nStartY;
+
+    return 1;
+}
+
+/* Reads the Red, Green and Blue columns of the RAT into pColours->pRGB */
+/* returns the number of rows, or -1 on failure with the message set */
+int gdal_read_rat_colours(GDALRasterBandH bandh, struct colourTable *pColours)
+{
+    int count, n, nRows;
+    GDALRasterAttributeTableH rath;
+    GDALRATFieldUsage eUsage;
+    int *pValues, nChannel, abFound[IMG_DEPTH] = {FALSE, FALSE, FALSE};
+    int bHasNoData = FALSE;
+    double dNoData;
+
+    rath = GDALGetDefaultRAT(bandh);
+    if( rath == NULL )
+    {
+        snprintf( szGDALMessages, GDAL_ERROR_SIZE, "Unable to Raster Attribute Table" );
+        return -1;
+    }
+
+    nRows = GDALRATGetRowCount(rath);
+    /* the extra one is black for values not in the table */
+    pColours->pRGB = (unsigned char*)CPLCalloc(nRows + 1, IMG_DEPTH);
+    pColours->nEntries = nRows;
+    pValues = (int*)CPLMalloc(MAX(nRows, 1) * sizeof(int));
+    for( count = 0; count < GDALRATGetColumnCount(rath); count++)
+    {
+        eUsage = GDALRATGetUsageOfCol(rath, count);
+        if( eUsage == GFU_Red )
+            nChannel = 0;
+        else if( eUsage == GFU_Green )
+            nChannel = 1;
+        else if( eUsage == GFU_Blue )
+            nChannel = 2;
+        else
+            continue;
+
+        if( GDALRATValuesIOAsInteger(rath, GF_Read, count, 0, nRows, pValues) != CE_None )
+            continue;
+        for( n = 0; n < nRows; n++ )
+        {
+            pColours->pRGB[n * IMG_DEPTH + nChannel] = (unsigned char)MAX(0, MIN(pValues[n], 255));
+        }
+        abFound[nChannel] = TRUE;
+    }
+    CPLFree(pValues);
+
+    /* Did we get all the columns? */
+    if( !abFound[0] || !abFound[1] || !abFound[2] )
+    {
+        CPLFree(pColours->pRGB);
+        pColours->pRGB = NULL;
+        pColours->nEntries = 0;
+        snprintf( szGDALMessages, GDAL_ERROR_SIZE, "Unable to find Red, Green and Blue columns" );
+        return -1;
+    }
+
+    /* nodata is black like values not in the table, without a test for each pixel */
+    dNoData = GDALGetRasterNoDataValue(bandh, &bHasNoData);
+    if( bHasNoData && (dNoData >= 0) && (dNoData < nRows) && (dNoData == floor(dNoData)) )
+    {
+        memset(pColours->pRGB + (int)dNoData * IMG_DEPTH, 0, IMG_DEPTH);
+    }
+
+    return nRows;
+}
+
+/* The dataset for overviewIndex of ds, with a band for each band of ds, so */
+/* they can be read together. Returns NULL if there isn't one or another */
+/* thread is using it, otherwise give it back with gdal_release_level_dataset */
+GDALDatasetH gdal_get_level_dataset(GDALDatasetH ds, int overviewIndex)
+{
+    GDALDatasetH hLevelDS = NULL;
+    GDALRasterBandH ovh;
+    char *apszOptions[2];
+    struct levelDataset *entry;
+
+    if( overviewIndex == 0 )
+    {
+        return ds;
+    }
+    if( overviewIndex >= MAX_LEVEL_DATASETS )
+    {
+        return NULL;
+    }
+
+    CPLCreateOrAcquireMutex(&levelDatasets.hMutex, 1000.0);
+    entry = &levelDatasets.aEntries[overviewIndex];
+    if( entry->bInUse || (entry->bOpened && (entry->hLevelDS == NULL)) )
+    {
+        CPLReleaseMutex(levelDatasets.hMutex);
+        return NULL;
+    }
+    entry->bInUse = TRUE;
+    if( entry->bOpened )
+    {
+        hLevelDS = entry->hLevelDS;
+        CPLReleaseMutex(levelDatasets.hMutex);
+        return hLevelDS;
+    }
+    CPLReleaseMutex(levelDatasets.hMutex);
+
+    /* opening may be slow so don't hold the others up */
+    apszOptions[0] = (char*)CPLSPrintf("OVERVIEW_LEVEL=%d", overviewIndex - 1);
+    apszOptions[1] = NULL;
+    CPLPushErrorHandler(CPLQuietErrorHandler);
+    hLevelDS = GDALOpenEx(GDALGetDescription(ds), GDAL_OF_RASTER | GDAL_OF_READONLY, 
+                NULL, (const char* const*)apszOptions, NULL);
+    CPLPopErrorHandler();
+
+    /* check it really is that level */
+    ovh = GDALGetOverview(GDALGetRasterBand(ds, 1), overviewIndex - 1);
+    if( (hLevelDS != NULL) && ((GDALGetRasterCount(hLevelDS) != GDALGetRasterCount(ds)) ||
+            (GDALGetRasterXSize(hLevelDS) != GDALGetRasterBandXSize(ovh)) ||
+            (GDALGetRasterYSize(hLevelDS) != GDALGetRasterBandYSize(ovh))) )
+    {
+        GDALClose(hLevelDS);
+        hLevelDS = NULL;
+    }
+
+    CPLAcquireMutex(levelDatasets.hMutex, 1000.0);
+    entry->bOpened = TRUE;
+    entry->hLevelDS = hLevelDS;
+    entry->bInUse = (hLevelDS != NULL);
+    CPLReleaseMutex(levelDatasets.hMutex);
+
+    return hLevelDS;
+}
+
+/* Lets the other threads have the dataset gdal_get_level_dataset gave */
+void gdal_release_level_dataset(int overviewIndex)
+{
+    if( (overviewIndex == 0) || (overviewIndex >= MAX_LEVEL_DATASETS) )
+        return;
+
+    CPLAcquireMutex(levelDatasets.hMutex, 1000.0);
+    levelDatasets.aEntries[overviewIndex].bInUse = FALSE;
+    CPLReleaseMutex(levelDatasets.hMutex);
+}
+
+/* Closes the level datasets of the file, before it is closed itself */
+void gdal_close_level_datasets(void)
+{
+    int n;
+
+    if( levelDatasets.hMutex == NULL )
+        return;
+
+    CPLAcquireMutex(levelDatasets.hMutex, 1000.0);
+    for( n = 0; n < MAX_LEVEL_DATASETS; n++ )
+    {
+        if( levelDatasets.aEntries[n].hLevelDS != NULL )
+            GDALClose(levelDatasets.aEntries[n].hLevelDS);
+    }
+    memset(levelDatasets.aEntries, 0, sizeof(levelDatasets.aEntries));
+    CPLReleaseMutex(levelDatasets.hMutex);
+}
+
+/* Fills in pMapping for hBand and returns TRUE if its samples can be */
+/* taken straight from memory. Only for bands of files that are stored */
+/* uncompressed in the type we read them as, in the order of this machine */
+int gdal_get_band_mapping(GDALRasterBandH hBand, struct bandMapping *pMapping)
+{
+    char *apszOptions[2];
+    int n, bFull;
+
+    if( !bMapFiles || (gdal_get_read_type(hBand) != GDALGetRasterDataType(hBand)) )
+        return FALSE;
+
+    CPLCreateOrAcquireMutex(&bandMappings.hMutex, 1000.0);
+    for( n = 0; n < bandMappings.nCount; n++ )
+    {
+        if( bandMappings.aEntries[n].hBand == hBand )
+        {
+            *pMapping = bandMappings.aEntries[n];
+            CPLReleaseMutex(bandMappings.hMutex);
+            return pMapping->pVMem != NULL;
+        }
+    }
+    bFull = (bandMappings.nCount >= MAX_BAND_MAPPINGS);
+    CPLReleaseMutex(bandMappings.hMutex);
+
+    if( bFull )
+    {
+        return FALSE;
+    }
+
+    /* without the fallback that pages it in through RasterIO */
+    memset(pMapping, 0, sizeof(struct bandMapping));
+    pMapping->hBand = hBand;
+    apszOptions[0] = (char*)"USE_DEFAULT_IMPLEMENTATION=NO";
+    apszOptions[1] = NULL;
+    CPLPushErrorHandler(CPLQuietErrorHandler);
+    pMapping->pVMem = GDALGetVirtualMemAuto(hBand, GF_Read, &pMapping->nPixelSpace, 
+                &pMapping->nLineSpace, apszOptions);
+    CPLPopErrorHandler();
+    if( pMapping->pVMem != NULL )
+    {
+        pMapping->pData = (const GByte*)CPLVirtualMemGetAddr(pMapping->pVMem);
+    }
+
+    CPLAcquireMutex(bandMappings.hMutex, 1000.0);
+    if( bandMappings.nCount < MAX_BAND_MAPPINGS )
+    {
+        bandMappings.aEntries[bandMappings.nCount++] = *pMapping;
+    }
+    else if( pMapping->pVMem != NULL )
+    {
+        /* filled up by other threads meanwhile */
+        CPLVirtualMemFree(pMapping->pVMem);
+        pMapping->pVMem = NULL;
+    }
+    CPLReleaseMutex(bandMappings.hMutex);
+
+    return pMapping->pVMem != NULL;
+}
+
+/* TRUE if hBand is one of the bands of ds or of their overviews */
+int gdal_is_band_of(GDALDatasetH ds, GDALRasterBandH hBand)
+{
+    int nBand, count;
+    GDALRasterBandH bandh;
+
+    for( nBand = 1; nBand <= GDALGetRasterCount(ds); nBand++ )
+    {
+        bandh = GDALGetRasterBand(ds, nBand);
+        if( bandh == hBand )
+            return TRUE;
+        for( count = 0; count < GDALGetOverviewCount(bandh); count++ )
+        {
+            if( GDALGetOverview(bandh, count) == hBand )
+                return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Unmaps the bands of ds, before ds itself is closed */
+void gdal_close_band_mappings(GDALDatasetH ds)
+{
+    int n;
+
+    if( bandMappings.hMutex == NULL )
+        return;
+
+    CPLAcquireMutex(bandMappings.hMutex, 1000.0);
+    n = 0;
+    while( n < bandMappings.nCount )
+    {
+        if( gdal_is_band_of(ds, bandMappings.aEntries[n].hBand) )
+        {
+            if( bandMappings.aEntries[n].pVMem != NULL )
+                CPLVirtualMemFree(bandMappings.aEntries[n].pVMem);
+            bandMappings.nCount--;
+            bandMappings.aEntries[n] = bandMappings.aEntries[bandMappings.nCount];
+        }
+        else
+        {
+            n++;
+        }
+    }
+    CPLReleaseMutex(bandMappings.hMutex);
+}
+
+/* The samples of row nSrcY of a mapped band that RasterIO would pick */
+/* for a buffer nBufXSize across from the window dfXOff to dfXOff+dfXSize, */
+/* which takes in the whole pixels nXOff to nXOff+nXSize. Points straight */
+/* into the mapping when they are all next to each other, otherwise they */
+/* are copied into pBuffer */
+const void *gdal_get_mapped_row(struct bandMapping *pMapping, int nTypeSize, int nSrcY, 
+            double dfXOff, double dfXSize, int nXOff, int nXSize, int nBufXSize, void *pBuffer)
+{
+    const GByte *pRow = pMapping->pData + nSrcY * pMapping->nLineSpace;
+    double dXRatio = dfXSize / nBufXSize;
+    int n, nSrcX;
+
+    if( (dfXSize == nBufXSize) && (dfXOff == nXOff) && (pMapping->nPixelSpace == nTypeSize) )
+        return pRow + (GIntBig)nXOff * nTypeSize;
+
+    for( n = 0; n < nBufXSize; n++ )
+    {
+        /* the centre of each buffer pixel, as GDAL does for nearest */
+        nSrcX = (int)floor(dfXOff + (n + 0.5) * dXRatio + 1e-10);
+        nSrcX = MAX(nXOff, MIN(nSrcX, nXOff + nXSize - 1));
+        memcpy((GByte*)pBuffer + n * nTypeSize, pRow + (GIntBig)nSrcX * pMapping->nPixelSpace, 
+                nTypeSize);
+    }
+    return pBuffer;
+}
+
+/* Row of the window nYOff to nYOff+nYSize that RasterIO would pick for */
+/* row nBufY of a buffer with dYRatio rows of the window to each of its own */
+int gdal_get_mapped_row_index(double dYOff, double dYRatio, int nBufY, int nYOff, int nYSize)
+{
+    int nSrcY = (int)floor(dYOff + (nBufY + 0.5) * dYRatio + 1e-10);
+    return MAX(nYOff, MIN(nSrcY, nYOff + nYSize - 1));
+}
+
+/* TRUE if the bands of the stretch are all read as the same type */
+/* so can be read together */
+int gdal_same_read_type(GDALDatasetH ds, struct stretch *stretch, int nBands)
+{
+    int count;
+    GDALDataType eType = gdal_get_read_type(GDALGetRasterBand(ds, stretch->bands[0]));
+
+    for( count = 1; count < nBands; count++ )
+    {
+        if( gdal_get_read_type(GDALGetRasterBand(ds, stretch->bands[count])) != eType )
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Stretches n samples into pOut, or looks up their colours */
+int gdal_process_samples(const void *pData, GDALDataType eType, int n, unsigned char *pOut, 
+        int nChannel, struct statisticsForBand *pStats, struct stretch *stretch, 
+        const struct colourTable *pColours)
+{
+    if( pColours != NULL )
+    {
+        do_colour_lookup(pData, eType, n, pOut, pColours);
+        return 1;
+    }
+    return do_stretch(pData, eType, n, pOut + nChannel, IMG_DEPTH, pStats, stretch);
+}
+
+/* Stretches nRows rows of nSamples one after the other in pData into the */
+/* rows of pOut nOutLine bytes apart, or looks up their colours */
+int gdal_process_rows(const void *pData, GDALDataType eType, int nSamples, int nRows, 
+        unsigned char *pOut, int nOutLine, int nChannel, struct statisticsForBand *pStats, 
+        struct stretch *stretch, const struct colourTable *pColours)
+{
+    int nTypeSize = GDALGetDataTypeSize(eType) / 8, y;
+
+    /* all in one go if the rows are the whole width of the image */
+    if( nSamples * IMG_DEPTH == nOutLine )
+        return gdal_process_samples(pData, eType, nSamples * nRows, pOut, nChannel, pStats, 
+                    stretch, pColours);
+
+    for( y = 0; y < nRows; y++ )
+    {
+        if( gdal_process_samples((const GByte*)pData + (GIntBig)y * nSamples * nTypeSize, eType, 
+                    nSamples, pOut + y * nOutLine, nChannel, pStats, stretch, pColours) < 0 )
+            return -1;
+    }
+    return 1;
+}
+
+/* Zeroes nChannels channels from nChannel of n pixels */
+void clear_pixels(unsigned char *pOut, int n, int nChannel, int nChannels)
+{
+    int count, c;
+
+    if( nChannels == IMG_DEPTH )
+    {
+        memset(pOut, 0, n * IMG_DEPTH);
+        return;
+    }
+    for( count = 0; count < n; count++ )
+    {
+        for( c = 0; c < nChannels; c++ )
+            pOut[count * IMG_DEPTH + nChannel + c] = 0;
+    }
+}
+
+/* Blacks out the channels of the nRows rows nWidth across at pOut that */
+/* are off the image, which is all but the nValidX pixels from nDataX of */
+/* the nValidRows rows from nDataY */
+void clear_off_image(unsigned char *pOut, int nWidth, int nRows, int nDataX, int nDataY, 
+        int nValidX, int nValidRows, int nChannel, int nChannels)
+{
+    int y;
+    unsigned char *pRow;
+
+    for( y = 0; y < nRows; y++ )
+    {
+        pRow = pOut + y * nWidth * IMG_DEPTH;
+        if( (y < nDataY) || (y >= nDataY + nValidRows) )
+        {
+            clear_pixels(pRow, nWidth, nChannel, nChannels);
+        }
+        else
+        {
+            clear_pixels(pRow, nDataX, nChannel, nChannels);
+            clear_pixels(pRow + (nDataX + nValidX) * IMG_DEPTH, nWidth - nDataX - nValidX, 
+                    nChannel, nChannels);
+        }
+    }
+}
+
+/* What GDAL knows has been written to the window of ovh, as DATA and */
+/* EMPTY of the GDAL_DATA_COVERAGE_STATUS_ flags. Just EMPTY means it has */
+/* nothing at all, as for the missing blocks of a sparse file */
+int gdal_get_coverage(GDALRasterBandH ovh, int nXOff, int nYOff, int nXSize, int nYSize)
+{
+    return GDALGetDataCoverageStatus(ovh, nXOff, nYOff, nXSize, nYSize, 0, NULL) & 
+            (GDAL_DATA_COVERAGE_STATUS_DATA | GDAL_DATA_COVERAGE_STATUS_EMPTY);
+}
+
+/* Fills pBuffer with what RasterIO would give for a window of ovh that */
+/* has nothing written to it: nodata, or zero if there isn't one */
+void gdal_fill_nodata(GDALRasterBandH ovh, void *pBuffer, GDALDataType eType, 
+        int nBufXSize, int nBufYSize, GIntBig nLineSpace)
+{
+    int nTypeSize = GDALGetDataTypeSize(eType) / 8, bHasNoData = FALSE, y;
+    double dNoData;
+
+    dNoData = GDALGetRasterNoDataValue(ovh, &bHasNoData);
+    if( !bHasNoData )
+        dNoData = 0;
+    for( y = 0; y < nBufYSize; y++ )
+    {
+        GDALCopyWords(&dNoData, GDT_Float64, 0, (GByte*)pBuffer + y * nLineSpace, eType, 
+                    nTypeSize, nBufXSize);
+    }
+}
+
+/* TRUE if GDAL knows the window of ovh has nothing written to it, in */
+/* which case pBuffer is filled without reading anything */
+int gdal_fill_if_empty(GDALRasterBandH ovh, int nXOff, int nYOff, int nXSize, int nYSize, 
+        void *pBuffer, GDALDataType eType, int nBufXSize, int nBufYSize, GIntBig nLineSpace)
+{
+    if( gdal_get_coverage(ovh, nXOff, nYOff, nXSize, nYSize) != GDAL_DATA_COVERAGE_STATUS_EMPTY )
+        return FALSE;
+
+    gdal_fill_nodata(ovh, pBuffer, eType, nBufXSize, nBufYSize, nLineSpace);
+    return TRUE;
+}
+
+/* Where the buffer columns from n that fall in the same column of the */
+/* blocks of the file end, and what GDAL knows of the coverage of the */
+/* nBands bands there */
+int gdal_get_block_column(GDALRasterBandH *pahOvh, int nBands, double dfXOff, double dXRatio, 
+        int nBufXSize, int nYOff, int nYSize, int n, int *pnEnd)
+{
+    int nBlockXSize, nBlockYSize, nBlock, nXOff, nXSize, count, nStatus = 0;
+
+    GDALGetBlockSize(pahOvh[0], &nBlockXSize, &nBlockYSize);
+    nBlock = (int)floor(dfXOff + (n + 0.5) * dXRatio + 1e-10) / nBlockXSize;
+    *pnEnd = (int)MAX(n + 1.0, MIN((double)nBufXSize, 
+                ceil(((nBlock + 1.0) * nBlockXSize - dfXOff) / dXRatio - 0.5)));
+
+    gdal_get_whole_window(dfXOff + n * dXRatio, (*pnEnd - n) * dXRatio, 
+            GDALGetRasterBandXSize(pahOvh[0]), &nXOff, &nXSize);
+    for( count = 0; count < nBands; count++ )
+        nStatus |= gdal_get_coverage(pahOvh[count], nXOff, nYOff, nXSize, nYSize);
+    return nStatus;
+}
+
+/* Reads the floating window dfXOff,dfYOff dfXSize by dfYSize of the */
+/* nBands bands of pahOvh into pBuffer, nBandSpace bytes between the */
+/* bands, just as one RasterIO call would, and together from hDS if it */
+/* isn't NULL. Where GDAL says some of the window has nothing written to */
+/* it, as with a sparse file or COG, it is read a run of columns of the */
+/* file's blocks at a time so the empty ones are filled in rather than */
+/* fetched. Returns the bytes read, or -1 with the message set */
+GIntBig gdal_read_window(GDALRasterBandH *pahOvh, int nBands, GDALDatasetH hDS, int *panBandMap, 
+        double dfXOff, double dfYOff, double dfXSize, double dfYSize, void *pBuffer, 
+        int nBufXSize, int nBufYSize, GDALDataType eType, GIntBig nBandSpace, 
+        GDALRasterIOExtraArg *psExtraArg)
+{
+    int nTypeSize = GDALGetDataTypeSize(eType) / 8;
+    int nXOff, nYOff, nXSize, nYSize, nStatus = 0, bSplit, count, n, nEnd, nNext;
+    double dXRatio = dfXSize / nBufXSize;
+    GIntBig nLineSpace = (GIntBig)nBufXSize * nTypeSize, nRead = 0;
+    GByte *pColumns;
+    CPLErr eErr = CE_None;
+    GDALRasterIOExtraArg sExtraArg = *psExtraArg;
+
+    gdal_get_whole_window(dfXOff, dfXSize, GDALGetRasterBandXSize(pahOvh[0]), &nXOff, &nXSize);
+    gdal_get_whole_window(dfYOff, dfYSize, GDALGetRasterBandYSize(pahOvh[0]), &nYOff, &nYSize);
+    for( count = 0; count < nBands; count++ )
+        nStatus |= gdal_get_coverage(pahOvh[count], nXOff, nYOff, nXSize, nYSize);
+    bSplit = (nStatus == (GDAL_DATA_COVERAGE_STATUS_DATA | GDAL_DATA_COVERAGE_STATUS_EMPTY));
+
+    sExtraArg.bFloatingPointWindowValidity = TRUE;
+    sExtraArg.dfYOff = dfYOff;
+    sExtraArg.dfYSize = dfYSize;
+    for( n = 0; n < nBufXSize; n = nEnd )
+    {
+        nEnd = nBufXSize;
+        if( bSplit )
+        {
+            /* as many columns of blocks as are empty, or not, in a row */
+            nStatus = gdal_get_block_column(pahOvh, nBands, dfXOff, dXRatio, nBufXSize, 
+                        nYOff, nYSize, n, &nEnd);
+            while( (nEnd < nBufXSize) && 
+                    ((gdal_get_block_column(pahOvh, nBands, dfXOff, dXRatio, nBufXSize, 
+                        nYOff, nYSize, nEnd, &nNext) == GDAL_DATA_COVERAGE_STATUS_EMPTY) == 
+                        (nStatus == GDAL_DATA_COVERAGE_STATUS_EMPTY)) )
+            {
+                nEnd = nNext;
+            }
+        }
+
+        pColumns = (GByte*)pBuffer + n * nTypeSize;
+        if( nStatus == GDAL_DATA_COVERAGE_STATUS_EMPTY )
+        {
+            for( count = 0; count < nBands; count++ )
+            {
+                gdal_fill_nodata(pahOvh[count], pColumns + count * nBandSpace, eType, 
+                        nEnd - n, nBufYSize, nLineSpace);
+            }
+            continue;
+        }
+
+        sExtraArg.dfXOff = dfXOff + n * dXRatio;
+        sExtraArg.dfXSize = (nEnd - n) * dXRatio;
+        gdal_get_whole_window(sExtraArg.dfXOff, sExtraArg.dfXSize, 
+                GDALGetRasterBandXSize(pahOvh[0]), &nXOff, &nXSize);
+        if( hDS != NULL )
+        {
+            eErr = GDALDatasetRasterIOEx( hDS, GF_Read, nXOff, nYOff, nXSize, nYSize, pColumns, 
+                        nEnd - n, nBufYSize, eType, nBands, panBandMap,
+                        nTypeSize, nLineSpace, nBandSpace, &sExtraArg );
+        }
+        for( count = 0; (hDS == NULL) && (eErr == CE_None) && (count < nBands); count++ )
+        {
+            eErr = GDALRasterIOEx( pahOvh[count], GF_Read, nXOff, nYOff, nXSize, nYSize, 
+                        pColumns + count * nBandSpace, nEnd - n, nBufYSize, 
+                        eType, nTypeSize, nLineSpace, &sExtraArg );
+        }
+        if( eErr != CE_None )
+        {
+            set_read_error("Unable to read file");
+            return -1;
+        }
+        nRead += (GIntBig)(nEnd - n) * nBufYSize * nTypeSize * nBands;
+    }
+
+    return nRead;
+}
+
+/* Does the same for rows nFirst to nLast of the image as reading the part */
+/* of them on the image with RasterIO and stretching it into pOut, rows */
+/* nOutLine bytes apart, but takes the samples straight from the mapping a */
+/* row at a time. pBuffer has room for a row of that part */
+int gdal_read_mapped_rows(struct bandMapping *pMapping, GDALDataType eType, struct readInfo *info,
+        int nFirst, int nLast, void *pBuffer, unsigned char *pOut, int nOutLine, int nChannel,
+        struct statisticsForBand *pStats, struct stretch *stretch, const struct colourTable *pColours)
+{
+    int nTypeSize = GDALGetDataTypeSize(eType) / 8;
+    int y, nSrcY;
+    double dYRatio = info->dfYSize / info->nBufYSize, dStart;
+    const void *pSamples;
+
+    /* RasterIO would have noticed */
+    if( loader_cancelled() )
+        return -1;
+
+    for( y = nFirst; y < nLast; y++ )
+    {
+        dStart = stage_start();
+        nSrcY = gdal_get_mapped_row_index(info->dfYOff, dYRatio, y - info->nDataY, 
+                    info->nYOff, info->nYSize);
+        pSamples = gdal_get_mapped_row(pMapping, nTypeSize, nSrcY, info->dfXOff, info->dfXSize, 
+                    info->nXOff, info->nXSize, info->nBufXSize, pBuffer);
+        stage_end(STAGE_RASTERIO, dStart);
+
+        dStart = stage_start();
+        if( gdal_process_samples(pSamples, eType, info->nBufXSize, pOut + (y - nFirst) * nOutLine, 
+                    nChannel, pStats, stretch, pColours) < 0 )
+            return -1;
+        stage_end(STAGE_STRETCH, dStart);
+    }
+    stage_count((GIntBig)info->nBufXSize * (nLast - nFirst) * nTypeSize, 0, 0);
+
+    return 1;
+}
+
+/* Reads rows nStartRow to nEndRow of the image a block at a time. Each block */
+/* is stretched (or has its colours looked up when pColours is given) straight */
+/* into im->pixels while it is still in cache, so only one block of raw data */
+/* is held. Each band goes into its own channel starting at nFirstChannel. */
+/* For greyscale the channel is repeated, a colour table fills all 3. */
+/* Only the part of the image on the raster is read and stretched, the */
+/* rest is cleared. If hDS is not NULL the bands are read from it together */
+/* in one call, so each block of a pixel interleaved file is only fetched */
+/* and decoded once */
+int gdal_read_blocks(GDALRasterBandH *pahOvh, int nBands, int nFirstChannel, struct image *im, 
+        struct readInfo *info, int nStartRow, int nEndRow, struct statisticsForBand *pStats, 
+        struct stretch *stretch, const struct colourTable *pColours, GDALDatasetH hDS)
+{
+    int nRows, nRow, nBlockRows, nFirst, nLast, nValidRows, nYOff, nYSize, n, y, count;
+    int nBlockXSize, nBlockYSize, nTypeSize, nRowBytes, nOutLine, nChannel, nChannels;
+    double dYRatio, dStart;
+    GIntBig nBandBytes, nRead;
+    void *pBuffer;
+    GByte *pMask = NULL;
+    unsigned char *pOut, *pValidOut, *pPixel;
+    GDALDataType eType;
+    GDALRasterIOExtraArg sExtraArg;
+    struct bandMapping asMappings[3];
+    int abMapped[3], bAllMapped = TRUE;
+
+    for( count = 0; count < nBands; count++ )
+    {
+        abMapped[count] = gdal_get_band_mapping(pahOvh[count], &asMappings[count]);
+        bAllMapped = bAllMapped && abMapped[count];
+    }
+    if( bAllMapped )
+    {
+        /* nothing to gain from reading them together */
+        hDS = NULL;
+    }
+
+    /* the channels these bands fill in, which is all of them for a */
+    /* colour table or when greyscale is repeated across them */
+    nChannel = nFirstChannel;
+    nChannels = nBands;
+    if( (pColours != NULL) || (stretch->mode == VIEWER_MODE_GREYSCALE) )
+    {
+        nChannel = 0;
+        nChannels = IMG_DEPTH;
+    }
+
+    /* whole blocks of the file where they fit, otherwise as many rows as fit */
+    dYRatio = (info->nBufYSize > 0) ? (info->dfYSize / info->nBufYSize) : 1.0;
+    nRowBytes = im->w * sizeof(float);
+    nOutLine = im->w * IMG_DEPTH;
+    GDALGetBlockSize(pahOvh[0], &nBlockXSize, &nBlockYSize);
+    nRows = MAX(1, (int)(nBlockYSize / dYRatio));
+    if( (nRows * nRowBytes) > PIPELINE_BLOCK_BYTES )
+        nRows = MAX(1, PIPELINE_BLOCK_BYTES / nRowBytes);
+    else
+        nRows *= PIPELINE_BLOCK_BYTES / (nRows * nRowBytes);
+    nRows = MIN(nRows, nEndRow - nStartRow);
+
+    /* big enough for any of the types we read, for each band if read together */
+    pBuffer = CPLMalloc(nRows * nRowBytes * ((hDS != NULL) ? nBands : 1));
+    for( count = 0; count < nBands; count++ )
+    {
+        if( (pStats[count].nMaskFlags != 0) && (pMask == NULL) )
+            pMask = (GByte*)CPLMalloc(nRows * im->w);
+    }
+
+    /* so we can give up if a newer request comes in. Each block reads */
+    /* its part of the window exactly as if it were read all in one go */
+    INIT_RASTERIO_EXTRA_ARG(sExtraArg);
+    sExtraArg.pfnProgress = loader_progress;
+    sExtraArg.bFloatingPointWindowValidity = TRUE;
+    sExtraArg.dfXOff = info->dfXOff;
+    sExtraArg.dfXSize = info->dfXSize;
+
+    for( nRow = nStartRow; nRow < nEndRow; nRow += nRows )
+    {
+        nBlockRows = MIN(nRows, nEndRow - nRow);
+        pOut = (unsigned char*)im->pixels + nRow * nOutLine;
+
+        /* rows of this block that are on the image */
+        nFirst = MAX(nRow, info->nDataY);
+        nLast = MIN(nRow + nBlockRows, info->nDataY + info->nBufYSize);
+        nValidRows = MAX(0, nLast - nFirst);
+        pValidOut = pOut + (nFirst - nRow) * nOutLine + info->nDataX * IMG_DEPTH;
+
+        /* black where it is off the image */
+        dStart = stage_start();
+        clear_off_image(pOut, im->w, nBlockRows, info->nDataX, nFirst - nRow, info->nBufXSize, 
+                nValidRows, nChannel, nChannels);
+        stage_end(STAGE_STRETCH, dStart);
+        if( (nValidRows == 0) || (info->nBufXSize == 0) )
+            continue;
+
+        sExtraArg.dfYOff = info->dfYOff + (nFirst - info->nDataY) * dYRatio;
+        sExtraArg.dfYSize = nValidRows * dYRatio;
+        gdal_get_whole_window(sExtraArg.dfYOff, sExtraArg.dfYSize, 
+                GDALGetRasterBandYSize(pahOvh[0]), &nYOff, &nYSize);
+
+        if( hDS != NULL )
+        {
+            /* each band one after the other in the buffer */
+            eType = gdal_get_read_type(pahOvh[0]);
+            nTypeSize = GDALGetDataTypeSize(eType) / 8;
+            nBandBytes = (GIntBig)nValidRows * info->nBufXSize * nTypeSize;
+
+            dStart = stage_start();
+            nRead = gdal_read_window(pahOvh, nBands, hDS, stretch->bands, info->dfXOff, 
+                        sExtraArg.dfYOff, info->dfXSize, sExtraArg.dfYSize, pBuffer, 
+                        info->nBufXSize, nValidRows, eType, nBandBytes, &sExtraArg);
+            if( nRead < 0 )
+            {
+                CPLFree(pBuffer);
+                CPLFree(pMask);
+                return -1;
+            }
+            stage_end(STAGE_RASTERIO, dStart);
+            stage_count(nRead, 0, 0);
+
+            dStart = stage_start();
+            for( count = 0; count < nBands; count++ )
+            {
+                if( gdal_process_rows((char*)pBuffer + count * nBandBytes, eType, info->nBufXSize, 
+                            nValidRows, pValidOut, nOutLine, nFirstChannel + count, &pStats[count], 
+                            stretch, NULL) < 0 )
+                {
+                    CPLFree(pBuffer);
+                    CPLFree(pMask);
+                    return -1;
+                }
+            }
+            stage_end(STAGE_STRETCH, dStart);
+        }
+
+        for( count = 0; (hDS == NULL) && (count < nBands); count++ )
+        {
+            eType = gdal_get_read_type(pahOvh[count]);
+
+            if( abMapped[count] )
+            {
+                if( gdal_read_mapped_rows(&asMappings[count], eType, info, nFirst, nLast, pBuffer, 
+                            pValidOut, nOutLine, nFirstChannel + count, &pStats[count], stretch, 
+                            pColours) < 0 )
+                {
+                    CPLFree(pBuffer);
+                    CPLFree(pMask);
+                    return -1;
+                }
+                continue;
+            }
+
+            dStart = stage_start();
+            nRead = gdal_read_window(&pahOvh[count], 1, NULL, NULL, info->dfXOff, 
+                        sExtraArg.dfYOff, info->dfXSize, sExtraArg.dfYSize, pBuffer, 
+                        info->nBufXSize, nValidRows, eType, 0, &sExtraArg);
+            if( nRead < 0 )
+            {
+                CPLFree(pBuffer);
+                CPLFree(pMask);
+                return -1;
+            }
+            stage_end(STAGE_RASTERIO, dStart);
+            stage_count(nRead, 0, 0);
+
+            dStart = stage_start();
+            if( gdal_process_rows(pBuffer, eType, info->nBufXSize, nValidRows, pValidOut, nOutLine, 
+                        nFirstChannel + count, &pStats[count], stretch, pColours) < 0 )
+            {
+                CPLFree(pBuffer);
+                CPLFree(pMask);
+                return -1;
+            }
+            stage_end(STAGE_STRETCH, dStart);
+        }
+
+        /* the masks through the same window */
+        for( count = 0; count < nBands; count++ )
+        {
+            if( pStats[count].nMaskFlags == 0 )
+                continue;
+
+            /* one for the whole dataset is the same for the next band */
+            if( (count == 0) || !(pStats[count].nMaskFlags & GMF_PER_DATASET) || 
+                    !(pStats[count - 1].nMaskFlags & GMF_PER_DATASET) )
+            {
+                dStart = stage_start();
+                if( GDALRasterIOEx( GDALGetMaskBand(pahOvh[count]), GF_Read, info->nXOff, nYOff, 
+                          info->nXSize, nYSize, pMask, info->nBufXSize, nValidRows, GDT_Byte, 
+                          1, info->nBufXSize, &sExtraArg ) != CE_None )
+                {
+                    CPLFree(pBuffer);
+                    CPLFree(pMask);
+                    set_read_error("Unable to read mask");
+                    return -1;
+                }
+                stage_end(STAGE_RASTERIO, dStart);
+            }
+
+            dStart = stage_start();
+            for( y = 0; y < nValidRows; y++ )
+            {
+                if( pColours != NULL )
+                    apply_mask(pValidOut + y * nOutLine, IMG_DEPTH, IMG_DEPTH, 
+                            pMask + y * info->nBufXSize, info->nBufXSize);
+                else
+                    apply_mask(pValidOut + y * nOutLine + nFirstChannel + count, IMG_DEPTH, 1, 
+                            pMask + y * info->nBufXSize, info->nBufXSize);
+            }
+            stage_end(STAGE_STRETCH, dStart);
+        }
+
+        if( stretch->mode == VIEWER_MODE_GREYSCALE )
+        {
+            /* greyscale - repeat the colours */
+            dStart = stage_start();
+            for( y = 0; y < nValidRows; y++ )
+            {
+                pPixel = pValidOut + y * nOutLine;
+                for( n = 0; n < info->nBufXSize * IMG_DEPTH; n += IMG_DEPTH )
+                {
+                    pPixel[n + 1] = pPixel[n];
+                    pPixel[n + 2] = pPixel[n];
+                }
+            }
+            stage_end(STAGE_INTERLEAVE, dStart);
+        }
+    }
+
+    CPLFree(pBuffer);
+    CPLFree(pMask);
+
+    return 0;
+}
+
+/* A direct read split up into a stripe of rows for each band, */
+/* or just stripes if the bands are read together */
+struct blockJobs
+{
+    struct image *im;
+    struct readInfo *info;
+    struct stretch *stretch;
+    struct statisticsForBand *pStats;
+    int overviewIndex;
+    int nBands; /* of the stretch */
+    int bTogether;
+    int nStripeRows;
+    const struct colourTable *pColours;
+    int *panStatus; /* for each job */
+};
+
+void gdal_read_block_job(GDALDatasetH ds, int nJob, void *pData)
+{
+    struct blockJobs *jobs = (struct blockJobs*)pData;
+    int band = nJob % jobs->nBands;
+    int nStartRow = (nJob / jobs->nBands) * jobs->nStripeRows;
+    GDALRasterBandH ovh, ahOvh[3];
+    GDALDatasetH hLevelDS;
+
+    if( jobs->bTogether )
+    {
+        /* band by band from this handle if its level can't be opened */
+        nStartRow = nJob * jobs->nStripeRows;
+        for( band = 0; band < jobs->nBands; band++ )
+        {
+            ahOvh[band] = GDALGetRasterBand(ds, jobs->stretch->bands[band]);
+            if( jobs->overviewIndex > 0 )
+            {
+                ahOvh[band] = GDALGetOverview(ahOvh[band], jobs->overviewIndex - 1);
+            }
+        }
+        hLevelDS = gdal_get_level_dataset(ds, jobs->overviewIndex);
+        jobs->panStatus[nJob] = gdal_read_blocks(ahOvh, jobs->nBands, 0, jobs->im, jobs->info, nStartRow, 
+                    MIN(nStartRow + jobs->nStripeRows, (int)jobs->im->h), jobs->pStats, 
+                    jobs->stretch, NULL, hLevelDS);
+        if( hLevelDS != NULL )
+            gdal_release_level_dataset(jobs->overviewIndex);
+        return;
+    }
+
+    ovh = GDALGetRasterBand(ds, jobs->stretch->bands[band]);
+    if( jobs->overviewIndex > 0 )
+    {
+        ovh = GDALGetOverview(ovh, jobs->overviewIndex - 1);
+    }
+
+    jobs->panStatus[nJob] = gdal_read_blocks(&ovh, 1, band, jobs->im, jobs->info, nStartRow, 
+                MIN(nStartRow + jobs->nStripeRows, (int)jobs->im->h), &jobs->pStats[band], 
+                jobs->stretch, jobs->pColours, NULL);
+}
+
+/* Shares the bands and stripes out between the read threads */
+int gdal_read_parallel(GDALDatasetH ds, struct image *im, struct readInfo *info, int overviewIndex,
+        int nBands, int bTogether, struct statisticsForBand *pStats, struct stretch *stretch, 
+        const struct colourTable *pColours)
+{
+    struct blockJobs jobs;
+    int n, nStripes, nJobs, nStatus = 0;
+
+    nStripes = MAX(1, MIN(readPool.nThreads, (int)im->h / MIN_STRIPE_ROWS));
+    nJobs = bTogether ? nStripes : (nStripes * nBands);
+
+    jobs.im = im;
+    jobs.info = info;
+    jobs.stretch = stretch;
+    jobs.pStats = pStats;
+    jobs.overviewIndex = overviewIndex;
+    jobs.nBands = nBands;
+    jobs.bTogether = bTogether;
+    jobs.nStripeRows = (im->h + nStripes - 1) / nStripes;
+    jobs.pColours = pColours;
+    jobs.panStatus = (int*)CPLCalloc(nJobs, sizeof(int));
+
+    read_pool_run(nJobs, gdal_read_block_job, &jobs, ds);
+
+    for( n = 0; n < nJobs; n++ )
+    {
+        if( jobs.panStatus[n] < 0 )
+            nStatus = -1;
+    }
+    CPLFree(jobs.panStatus);
+
+    return nStatus;
+}
+
+int gdal_read_multiband(GDALDatasetH ds,struct image *im,int overviewIndex, struct stretch *stretch, 
+        struct statisticsForBand *pStats, struct extent *extent)
+{
+    int count, nStatus, bTogether;
+    GDALDatasetH hLevelDS;
+    struct readInfo info;
+    GDALRasterBandH ovh, ahOvh[3];
+
+    /* fill in the width and height from the overview */
+    GDALRasterBandH bandh = GDALGetRasterBand(ds,stretch->bands[0]);
+    if( overviewIndex == 0 )
+    {
+        ovh = bandh;
+    }
+    else
+    {
+        ovh = GDALGetOverview(bandh,overviewIndex - 1);
+    }
+    im->w = im->nPixPerCell * im->nCellsX;
+    im->h = im->nPixPerCell * im->nCellsY;
+
+    if( !prepare_for_reading(im->w, im->h, ds, ovh, extent, im->nCellsX, im->nCellsY, &info) )
+    {
+        /* error should already be set */
+        return -1;
+    }
+
+    im->pixels = frame_pool_get(im->w * im->h * IMG_DEPTH);
+
+    /* read in band interleaved by pixel */
+    /* Basically we make each line 3 times as long */
+    /* the first bixel is band[0], second is band[1] and third is band[2] */
+    /* and then back to band[0] etc. Each band is read in its own type */
+    /* and the stretch fills in every third pixel */
+    for( count = 0; count < 3; count++ )
+    {
+        bandh = GDALGetRasterBand(ds,stretch->bands[count]);
+        if( overviewIndex == 0 )
+        {
+            ahOvh[count] = bandh;
+        }
+        else
+        {
+            ahOvh[count] = GDALGetOverview(bandh,overviewIndex - 1);
+        }
+    }
+
+    /* the bands can be read together from the dataset for the level */
+    /* as long as they are read as the same type */
+    bTogether = gdal_same_read_type(ds, stretch, 3);
+
+    if( readPool.nThreads > 1 )
+    {
+        nStatus = gdal_read_parallel(ds, im, &info, overviewIndex, 3, bTogether, pStats, stretch, NULL);
+    }
+    else
+    {
+        hLevelDS = bTogether ? gdal_get_level_dataset(ds, overviewIndex) : NULL;
+        nStatus = gdal_read_blocks(ahOvh, 3, 0, im, &info, 0, im->h, pStats, stretch, NULL, hLevelDS);
+        if( hLevelDS != NULL )
+            gdal_release_level_dataset(overviewIndex);
+    }
+
+    if( nStatus < 0 )
+    {
+        /* error should already be set */
+        frame_pool_release(im->pixels);
+        return -1;
+    }
+
+    return 0;
+}
+
+int gdal_read_singleband(GDALDatasetH ds,struct image *im,int overviewIndex, struct stretch *stretch, 
+    struct statisticsForBand *pStats, const struct colourTable *pColours, struct extent *extent)
+{
+    /* Read a single band image */
+    int nStatus;
+    struct readInfo info;
+    GDALRasterBandH ovh;
+
+    /* fill in the width and height from the overview */
+    GDALRasterBandH bandh = GDALGetRasterBand(ds,stretch->bands[0]);
+    if( overviewIndex == 0 )
+    {
+        ovh = bandh;
+    }
+    else
+    {
+        ovh = GDALGetOverview(bandh,overviewIndex - 1);
+    }
+
+    im->w = im->nPixPerCell * im->nCellsX;
+    im->h = im->nPixPerCell * im->nCellsY;
+
+    if( !prepare_for_reading(im->w, im->h, ds, ovh, extent, im->nCellsX, im->nCellsY, &info) )
+    {
+        /* error should already be set */
+        return -1;
+    }
+
+    if( stretch->mode != VIEWER_MODE_COLORTABLE )
+    {
+        /* stretched instead */
+        pColours = NULL;
+    }
+    if( (stretch->mode != VIEWER_MODE_COLORTABLE) && (stretch->mode != VIEWER_MODE_GREYSCALE) )
+    {
+        set_read_error("Unsupported stretch");
+        return -1;
+    }
+
+    /* stretch or look up the colours into our bil */
+    im->pixels = frame_pool_get(im->w * im->h * IMG_DEPTH);
+    if( readPool.nThreads > 1 )
+        nStatus = gdal_read_parallel(ds, im, &info, overviewIndex, 1, FALSE, pStats, stretch, pColours);
+    else
+        nStatus = gdal_read_blocks(&ovh, 1, 0, im, &info, 0, im->h, pStats, stretch, pColours, NULL);
+
+    if( nStatus < 0 )
+    {
+        /* error should already be set */
+        frame_pool_release(im->pixels);
+        return -1;
+    }
+
+    return 0;
+}
+
+unsigned int tile_cache_hash(struct tileKey *key)
+{
+    size_t h = (size_t)key->ds;
+    h = h * 31 + key->band;
+    h = h * 31 + key->level;
+    h = h * 31 + key->decimation;
+    h = h * 31 + key->tx;
+    h = h * 31 + key->ty;
+    return (unsigned int)(h % TILE_HASH_SIZE);
+}
+
+int tile_cache_key_equal(struct tileKey *a, struct tileKey *b)
+{
+    return (a->ds == b->ds) && (a->band == b->band) && (a->level == b->level) &&
+        (a->decimation == b->decimation) && (a->tx == b->tx) && (a->ty == b->ty);
+}
+
+void tile_cache_lru_unlink(struct tile *t)
+{
+    if( t->lruPrev != NULL )
+        t->lruPrev->lruNext = t->lruNext;
+    else
+        tileCache.lruHead = t->lruNext;
+    if( t->lruNext != NULL )
+        t->lruNext->lruPrev = t->lruPrev;
+    else
+        tileCache.lruTail = t->lruPrev;
+    t->lruPrev = NULL;
+    t->lruNext = NULL;
+}
+
+void tile_cache_lru_push(struct tile *t)
+{
+    t->lruPrev = NULL;
+    t->lruNext = tileCache.lruHead;
+    if( tileCache.lruHead != NULL )
+        tileCache.lruHead->lruPrev = t;
+    tileCache.lruHead = t;
+    if( tileCache.lruTail == NULL )
+        tileCache.lruTail = t;
+}
+
+/* returns the tile or NULL if not cached */
+struct tile *tile_cache_find(struct tileKey *key)
+{
+    struct tile *t;
+
+    for( t = tileCache.hash[tile_cache_hash(key)]; t != NULL; t = t->hashNext )
+    {
+        if( tile_cache_key_equal(&t->key, key) )
+            return t;
+    }
+    return NULL;
+}
+
+/* as tile_cache_find, but marks the tile as most recently used */
+struct tile *tile_cache_lookup(struct tileKey *key)
+{
+    struct tile *t = tile_cache_find(key);
+
+    if( t != NULL )
+    {
+        tile_cache_lru_unlink(t);
+        tile_cache_lru_push(t);
+    }
+    return t;
+}
+
+void tile_cache_insert(struct tile *t)
+{
+    unsigned int h = tile_cache_hash(&t->key);
+
+    t->hashNext = tileCache.hash[h];
+    tileCache.hash[h] = t;
+    tile_cache_lru_push(t);
+    tileCache.nBytes += TILE_SIZE * TILE_SIZE * t->nChannels;
+}
+
+/* removes from the cache and frees */
+void tile_cache_remove(struct tile *t)
+{
+    struct tile **ppt;
+
+    for( ppt = &tileCache.hash[tile_cache_hash(&t->key)]; *ppt != NULL; ppt = &(*ppt)->hashNext )
+    {
+        if( *ppt == t )
+        {
+            *ppt = t->hashNext;
+            break;
+        }
+    }
+    tile_cache_lru_unlink(t);
+    tileCache.nBytes -= TILE_SIZE * TILE_SIZE * t->nChannels;
+    CPLFree(t->data);
+    CPLFree(t);
+}
+
+/* Evict least recently used tiles until we are under the limit */
+void tile_cache_trim(void)
+{
+    struct tile *t = tileCache.lruTail, *prev;
+
+    while( (t != NULL) && (tileCache.nBytes > tileCache.nMaxBytes) )
+    {
+        prev = t->lruPrev;
+        if( t->nPinned == 0 )
+            tile_cache_remove(t);
+        t = prev;
+    }
+}
+
+/* removes all the tiles for the given dataset. Pass NULL for all datasets */
+void tile_cache_purge(GDALDatasetH ds)
+{
+    struct tile *t = tileCache.lruHead, *next;
+
+    while( t != NULL )
+    {
+        next = t->lruNext;
+        if( (ds == NULL) || (t->key.ds == ds) )
+            tile_cache_remove(t);
+        t = next;
+    }
+}
+
+void tile_cache_set_size(size_t nMaxBytes)
+{
+    tileCache.nMaxBytes = nMaxBytes;
+    tile_cache_trim();
+}
+
+/* Stretches the raw TILE_SIZE by TILE_SIZE pixels in pBuffer into a tile */
+/* for key, or looks up their colours for VIEWER_MODE_COLORTABLE */
+/* Returns NULL on failure with the message set */
+struct tile *gdal_make_tile(struct gdalFile *file, struct tileKey *key, const void *pBuffer, 
+            GDALDataType eType, GIntBig nLineSpace)
+{
+    struct tile *t;
+    struct stretch *stretch = file->stretch;
+    int nRow, nRows = 1, nSize = TILE_SIZE * TILE_SIZE;
+    const GByte *pRow = (const GByte*)pBuffer;
+    double dStart = stage_start();
+
+    /* a row at a time unless the rows follow on from each other */
+    if( nLineSpace != TILE_SIZE * (GDALGetDataTypeSize(eType) / 8) )
+    {
+        nRows = TILE_SIZE;
+        nSize = TILE_SIZE;
+    }
+
+    t = (struct tile*)CPLCalloc(1, sizeof(struct tile));
+    t->key = *key;
+    t->nChannels = (stretch->mode == VIEWER_MODE_COLORTABLE) ? IMG_DEPTH : 1;
+    t->data = (unsigned char*)CPLMalloc(TILE_SIZE * TILE_SIZE * t->nChannels);
+    for( nRow = 0; nRow < nRows; nRow++, pRow += nLineSpace )
+    {
+        if( stretch->mode == VIEWER_MODE_COLORTABLE )
+        {
+            do_colour_lookup(pRow, eType, nSize, t->data + nRow * nSize * IMG_DEPTH, &file->colours);
+        }
+        else if( do_stretch(pRow, eType, nSize, t->data + nRow * nSize, 1,
+                    &file->statsForStretchBands[key->band], stretch) < 0 )
+        {
+            CPLFree(t->data);
+            CPLFree(t);
+            return NULL;
+        }
+    }
+    stage_end(STAGE_STRETCH, dStart);
+
+    return t;
+}
+
+/* Blanks what the mask of each of the bands masks out of its tile, the */
+/* mask being read for the same window as the data. Returns FALSE on */
+/* failure with the message set */
+int gdal_mask_tiles(struct gdalFile *file, GDALDatasetH ds, struct tileKey *key, 
+            int nBands, const int *panBands, struct tile **papTiles)
+{
+    GByte *pMask = NULL;
+    int width, height, nXOff, nYOff, nXSize, nYSize, nBufXSize, nBufYSize, count;
+    int nFlags, nLastFlags = 0;
+    double dStart;
+    GDALRasterBandH ovh;
+
+    for( count = 0; count < nBands; count++ )
+    {
+        nFlags = file->statsForStretchBands[panBands[count]].nMaskFlags;
+        if( nFlags == 0 )
+            continue;
+
+        ovh = GDALGetRasterBand(ds, file->stretch->bands[panBands[count]]);
+        if( key->level > 0 )
+            ovh = GDALGetOverview(ovh, key->level - 1);
+        width = GDALGetRasterBandXSize(ovh);
+        height = GDALGetRasterBandYSize(ovh);
+        nXOff = key->tx * TILE_SIZE * key->decimation;
+        nYOff = key->ty * TILE_SIZE * key->decimation;
+        nXSize = MIN(TILE_SIZE * key->decimation, width - nXOff);
+        nYSize = MIN(TILE_SIZE * key->decimation, height - nYOff);
+        nBufXSize = (nXSize + key->decimation - 1) / key->decimation;
+        nBufYSize = (nYSize + key->decimation - 1) / key->decimation;
+
+        /* past the edge of the image is never shown */
+        if( pMask == NULL )
+            pMask = (GByte*)CPLCalloc(TILE_SIZE, TILE_SIZE);
+
+        /* one for the whole dataset is the same for the next band */
+        if( !(nFlags & nLastFlags & GMF_PER_DATASET) )
+        {
+            dStart = stage_start();
+            if( GDALRasterIO( GDALGetMaskBand(ovh), GF_Read, nXOff, nYOff, nXSize, nYSize, pMask, 
+                        nBufXSize, nBufYSize, GDT_Byte, 1, TILE_SIZE ) != CE_None )
+            {
+                CPLFree(pMask);
+                set_read_error("Unable to read mask");
+                return FALSE;
+            }
+            stage_end(STAGE_RASTERIO, dStart);
+        }
+        nLastFlags = nFlags;
+
+        dStart = stage_start();
+        apply_mask(papTiles[count]->data, papTiles[count]->nChannels, papTiles[count]->nChannels, 
+                    pMask, TILE_SIZE * TILE_SIZE);
+        stage_end(STAGE_STRETCH, dStart);
+    }
+
+    CPLFree(pMask);
+    return TRUE;
+}
+
+/* Reads the tiles at the position of key for the nBands bands of the */
+/* stretch in panBands with ds (the file's handle or a read thread's). */
+/* They are read together if the level can be so each block of a pixel */
+/* interleaved file is only decoded once. Returns FALSE on failure with */
+/* the message set and any tiles that were made in papTiles */
+int gdal_read_tiles(struct gdalFile *file, GDALDatasetH ds, struct tileKey *key, 
+            int nBands, const int *panBands, struct tile **papTiles)
+{
+    void *pBuffer, *pRow;
+    const void *pTileData, *pSamples;
+    int width, height, nXOff, nYOff, nXSize, nYSize, nBufXSize, nBufYSize, nTypeSize;
+    int count, anBandMap[3], nStatus, nRow, bAllMapped, bEmpty;
+    GIntBig nLineSpace;
+    struct bandMapping asMappings[3];
+    double dStart;
+    GDALDataType eType;
+    GDALDatasetH hLevelDS = NULL;
+    struct stretch *stretch = file->stretch;
+    struct tileKey bandKey = *key;
+    GDALRasterBandH ovh, bandh = GDALGetRasterBand(ds, stretch->bands[panBands[0]]);
+
+    if( key->level == 0 )
+    {
+        ovh = bandh;
+    }
+    else
+    {
+        ovh = GDALGetOverview(bandh, key->level - 1);
+    }
+    width = GDALGetRasterBandXSize(ovh);
+    height = GDALGetRasterBandYSize(ovh);
+
+    /* window in pixels of the level, clipped to the edge of the image */
+    nXOff = key->tx * TILE_SIZE * key->decimation;
+    nYOff = key->ty * TILE_SIZE * key->decimation;
+    nXSize = MIN(TILE_SIZE * key->decimation, width - nXOff);
+    nYSize = MIN(TILE_SIZE * key->decimation, height - nYOff);
+    nBufXSize = (nXSize + key->decimation - 1) / key->decimation;
+    nBufYSize = (nYSize + key->decimation - 1) / key->decimation;
+
+    eType = gdal_get_read_type(bandh);
+    nTypeSize = GDALGetDataTypeSize(eType) / 8;
+    pBuffer = CPLCalloc(TILE_SIZE * TILE_SIZE * nBands, nTypeSize);
+
+    /* straight from memory if the bands are mapped */
+    bAllMapped = TRUE;
+    for( count = 0; count < nBands; count++ )
+    {
+        bandh = GDALGetRasterBand(ds, stretch->bands[panBands[count]]);
+        ovh = (key->level == 0) ? bandh : GDALGetOverview(bandh, key->level - 1);
+        bAllMapped = bAllMapped && (GDALGetRasterDataType(ovh) == eType) && 
+                gdal_get_band_mapping(ovh, &asMappings[count]);
+    }
+    if( bAllMapped )
+    {
+        for( count = 0; count < nBands; count++ )
+        {
+            bandKey.band = panBands[count];
+            pTileData = (char*)pBuffer + count * TILE_SIZE * TILE_SIZE * nTypeSize;
+            nLineSpace = TILE_SIZE * nTypeSize;
+
+            dStart = stage_start();
+            if( (nBufXSize == TILE_SIZE) && (nBufYSize == TILE_SIZE) && (key->decimation == 1) &&
+                    (asMappings[count].nPixelSpace == nTypeSize) )
+            {
+                /* the rows of the tile are in the mapping as they are */
+                pTileData = asMappings[count].pData + nYOff * asMappings[count].nLineSpace + 
+                        (GIntBig)nXOff * nTypeSize;
+                nLineSpace = asMappings[count].nLineSpace;
+            }
+            else
+            {
+                for( nRow = 0; nRow < nBufYSize; nRow++ )
+                {
+                    pRow = (char*)pTileData + nRow * TILE_SIZE * nTypeSize;
+                    pSamples = gdal_get_mapped_row(&asMappings[count], nTypeSize, 
+                                gdal_get_mapped_row_index(nYOff, nYSize / (double)nBufYSize, nRow, 
+                                    nYOff, nYSize), 
+                                nXOff, nXSize, nXOff, nXSize, nBufXSize, pRow);
+                    if( pSamples != pRow )
+                        memcpy(pRow, pSamples, nBufXSize * nTypeSize);
+                }
+            }
+            stage_end(STAGE_RASTERIO, dStart);
+            stage_count((GIntBig)nBufXSize * nBufYSize * nTypeSize, 0, 0);
+
+            papTiles[count] = gdal_make_tile(file, &bandKey, pTileData, eType, nLineSpace);
+            if( papTiles[count] == NULL )
+            {
+                CPLFree(pBuffer);
+                return FALSE;
+            }
+        }
+
+        CPLFree(pBuffer);
+        return gdal_mask_tiles(file, ds, key, nBands, panBands, papTiles);
+    }
+
+    if( (nBands > 1) && gdal_same_read_type(ds, stretch, 3) )
+    {
+        hLevelDS = gdal_get_level_dataset(ds, key->level);
+    }
+
+    dStart = stage_start();
+    nStatus = CE_None;
+    bEmpty = TRUE;
+    for( count = 0; bEmpty && (count < nBands); count++ )
+    {
+        bandh = GDALGetRasterBand(ds, stretch->bands[panBands[count]]);
+        ovh = (key->level == 0) ? bandh : GDALGetOverview(bandh, key->level - 1);
+        bEmpty = gdal_fill_if_empty(ovh, nXOff, nYOff, nXSize, nYSize, 
+                    (char*)pBuffer + count * TILE_SIZE * TILE_SIZE * nTypeSize, eType, 
+                    nBufXSize, nBufYSize, TILE_SIZE * nTypeSize);
+    }
+    if( bEmpty )
+    {
+        /* nothing to read */
+    }
+    else if( hLevelDS != NULL )
+    {
+        /* one after the other in the buffer */
+        for( count = 0; count < nBands; count++ )
+        {
+            anBandMap[count] = stretch->bands[panBands[count]];
+        }
+        nStatus = GDALDatasetRasterIO( hLevelDS, GF_Read, nXOff, nYOff, nXSize, nYSize,
+                      pBuffer, nBufXSize, nBufYSize, eType, nBands, anBandMap, 
+                      nTypeSize, TILE_SIZE * nTypeSize, TILE_SIZE * TILE_SIZE * nTypeSize );
+    }
+    if( hLevelDS != NULL )
+        gdal_release_level_dataset(key->level);
+    else
+    {
+        for( count = 0; (nStatus == CE_None) && (count < nBands); count++ )
+        {
+            bandh = GDALGetRasterBand(ds, stretch->bands[panBands[count]]);
+            ovh = (key->level == 0) ? bandh : GDALGetOverview(bandh, key->level - 1);
+            if( gdal_fill_if_empty(ovh, nXOff, nYOff, nXSize, nYSize, 
+                        (char*)pBuffer + count * TILE_SIZE * TILE_SIZE * nTypeSize, eType, 
+                        nBufXSize, nBufYSize, TILE_SIZE * nTypeSize) )
+                continue;
+            nStatus = GDALRasterIO( ovh, GF_Read, nXOff, nYOff, nXSize, nYSize,
+                      (char*)pBuffer + count * TILE_SIZE * TILE_SIZE * nTypeSize, 
+                      nBufXSize, nBufYSize, eType, nTypeSize, TILE_SIZE * nTypeSize );
+        }
+    }
+    stage_end(STAGE_RASTERIO, dStart);
+    if( !bEmpty )
+        stage_count((GIntBig)nBufXSize * nBufYSize * nTypeSize * nBands, 0, 0);
+
+    if( nStatus != CE_None )
+    {
+        CPLFree(pBuffer);
+        set_read_error("Unable to read file");
+        return FALSE;
+    }
+
+    for( count = 0; count < nBands; count++ )
+    {
+        bandKey.band = panBands[count];
+        papTiles[count] = gdal_make_tile(file, &bandKey, 
+                    (char*)pBuffer + count * TILE_SIZE * TILE_SIZE * nTypeSize, eType,
+                    TILE_SIZE * nTypeSize);
+        if( papTiles[count] == NULL )
+        {
+            CPLFree(pBuffer);
+            return FALSE;
+        }
+    }
+
+    CPLFree(pBuffer);
+
+    return gdal_mask_tiles(file, ds, key, nBands, panBands, papTiles);
+}
+
+/* number of bands of tiles needed for the stretch, or -1 if not supported */
+int gdal_get_tile_bands(struct stretch *stretch)
+{
+    if( stretch->mode == VIEWER_MODE_RGB )
+        return 3;
+    else if( (stretch->mode == VIEWER_MODE_GREYSCALE) || (stretch->mode == VIEWER_MODE_COLORTABLE) )
+        return 1;
+
+    set_read_error("Unsupported stretch");
+    return -1;
+}
+
+/* Works out where the extent falls in pixels of the given level and */
+/* the decimation needed to read it into a buffer of nBufXSize by nBufYSize */
+int gdal_get_level_window(struct gdalFile *file, int overviewIndex, struct extent *extent,
+                int nCellsX, int nCellsY, int nBufXSize, int nBufYSize, struct levelWindow *win)
+{
+    double adfTransform[6], adfInvertTransform[6];
+    double dTLX, dTLY, dBRX, dBRY;
+    struct pyramidLevel *level = gdal_get_pyramid_level(file, 0, overviewIndex);
+
+    if( level == NULL )
+    {
+        set_read_error(CPLSPrintf("No overview %d", overviewIndex));
+        return 0;
+    }
+    win->overviewIndex = overviewIndex;
+    win->width = level->width;
+    win->height = level->height;
+
+    /* same fiddle as prepare_for_reading */
+    dTLX = extent->dCentreX - ((nCellsX / 2.0) * extent->dMetersPerCell * 0.5);
+    dBRX = extent->dCentreX + ((nCellsX / 2.0) * extent->dMetersPerCell * 0.5);
+    dTLY = extent->dCentreY + ((nCellsY / 2.0) * extent->dMetersPerCell);
+    dBRY = extent->dCentreY - ((nCellsY / 2.0) * extent->dMetersPerCell);
+
+    memcpy(adfTransform, file->adfTransform, sizeof(adfTransform));
+    adfTransform[1] *= level->dXFactor;
+    adfTransform[5] *= level->dYFactor;
+    if( !GDALInvGeoTransform(adfTransform, adfInvertTransform) )
+    {
+        set_read_error("Unable to invert transform");
+        return 0;
+    }
+    GDALApplyGeoTransform(adfInvertTransform, dTLX, dTLY, &win->x1, &win->y1);
+    GDALApplyGeoTransform(adfInvertTransform, dBRX, dBRY, &win->x2, &win->y2);
+
+    /* pixels of the level per pixel of the buffer */
+    win->dXRatio = (win->x2 - win->x1) / nBufXSize;
+    win->dYRatio = (win->y2 - win->y1) / nBufYSize;
+
+    /* no point reading more than we can display so read from a */
+    /* decimated version of the level if it is much finer than we need */
+    win->decimation = 1;
+    while( (win->decimation * 2) <= MIN(win->dXRatio, win->dYRatio) )
+        win->decimation *= 2;
+
+    return 1;
+}
+
+/* Builds the image from tiles, reading only those not already in the cache */
+/* The tiles gdal_read_tiled doesn't have yet. A job for each position */
+struct tileJobs
+{
+    struct gdalFile *file;
+    struct tileKey key; /* everything but band, tx and ty */
+    int nTileBands, txMin, tyMin, nTilesX;
+    int nMissing;
+    int *panMissing; /* index into papTiles of each */
+    int *panJobStart; /* first of panMissing for each job, and nMissing after */
+    struct tile **papTiles;
+};
+
+void gdal_read_tile_job(GDALDatasetH ds, int nJob, void *pData)
+{
+    struct tileJobs *jobs = (struct tileJobs*)pData;
+    int nFirst = jobs->panJobStart[nJob];
+    int nBands = jobs->panJobStart[nJob + 1] - nFirst;
+    int n = jobs->panMissing[nFirst];
+    int count, anBands[3];
+    struct tile *apTiles[3];
+    struct tileKey key = jobs->key;
+
+    if( loader_cancelled() )
+    {
+        /* a newer request has come in - don't bother */
+        return;
+    }
+
+    for( count = 0; count < nBands; count++ )
+    {
+        anBands[count] = jobs->panMissing[nFirst + count] % jobs->nTileBands;
+        apTiles[count] = NULL;
+    }
+    key.tx = jobs->txMin + (n / jobs->nTileBands) % jobs->nTilesX;
+    key.ty = jobs->tyMin + (n / jobs->nTileBands) / jobs->nTilesX;
+
+    if( !gdal_read_tiles(jobs->file, ds, &key, nBands, anBands, apTiles) )
+    {
+        /* if any failed they all have */
+        for( count = 0; count < nBands; count++ )
+        {
+            if( apTiles[count] != NULL )
+            {
+                CPLFree(apTiles[count]->data);
+                CPLFree(apTiles[count]);
+                apTiles[count] = NULL;
+            }
+        }
+    }
+
+    for( count = 0; count < nBands; count++ )
+    {
+        jobs->papTiles[jobs->panMissing[nFirst + count]] = apTiles[count];
+    }
+}
+
+/* Works out which pixel of the decimated level each of the nWidth */
+/* columns and nHeight rows of an image read through win comes from, */
+/* -1 being off the image, and the range of tiles they are in */
+void gdal_get_tile_lookup(struct levelWindow *win, int nWidth, int nHeight, int *panCol, int *panRow,
+        int *ptxMin, int *ptxMax, int *ptyMin, int *ptyMax)
+{
+    int bx, by;
+    double dVal;
+
+    *ptxMin = INT_MAX;
+    *ptxMax = -1;
+    for( bx = 0; bx < nWidth; bx++ )
+    {
+        dVal = win->x1 + (bx + 0.5) * win->dXRatio;
+        if( (dVal < 0) || (dVal >= win->width) )
+        {
+            panCol[bx] = -1;
+        }
+        else
+        {
+            panCol[bx] = (int)dVal / win->decimation;
+            *ptxMin = MIN(*ptxMin, panCol[bx] / TILE_SIZE);
+            *ptxMax = MAX(*ptxMax, panCol[bx] / TILE_SIZE);
+        }
+    }
+
+    *ptyMin = INT_MAX;
+    *ptyMax = -1;
+    for( by = 0; by < nHeight; by++ )
+    {
+        dVal = win->y1 + (by + 0.5) * win->dYRatio;
+        if( (dVal < 0) || (dVal >= win->height) )
+        {
+            panRow[by] = -1;
+        }
+        else
+        {
+            panRow[by] = (int)dVal / win->decimation;
+            *ptyMin = MIN(*ptyMin, panRow[by] / TILE_SIZE);
+            *ptyMax = MAX(*ptyMax, panRow[by] / TILE_SIZE);
+        }
+    }
+}
+
+/* TRUE if all the tiles of an image nCellsX by nCellsY at nPixPerCell */
+/* of the extent from overviewIndex are in the tile cache already */
+int gdal_is_cached(struct gdalFile *file, int overviewIndex, struct extent *extent, 
+        int nCellsX, int nCellsY, int nPixPerCell)
+{
+    int nTileBands, nWidth = nCellsX * nPixPerCell, nHeight = nCellsY * nPixPerCell;
+    int txMin, txMax, tyMin, tyMax, *panCol, *panRow, bCached = TRUE;
+    struct levelWindow win;
+    struct tileKey key;
+
+    nTileBands = gdal_get_tile_bands(file->stretch);
+    if( (tileCache.nMaxBytes == 0) || (nTileBands < 0) || 
+            !gdal_get_level_window(file, overviewIndex, extent, nCellsX, nCellsY, nWidth, nHeight, &win) )
+    {
+        return FALSE;
+    }
+
+    panCol = (int*)CPLMalloc(nWidth * sizeof(int));
+    panRow = (int*)CPLMalloc(nHeight * sizeof(int));
+    gdal_get_tile_lookup(&win, nWidth, nHeight, panCol, panRow, &txMin, &txMax, &tyMin, &tyMax);
+    CPLFree(panCol);
+    CPLFree(panRow);
+
+    key.ds = file->ds;
+    key.level = overviewIndex;
+    key.decimation = win.decimation;
+    for( key.ty = tyMin; bCached && (key.ty <= tyMax); key.ty++ )
+    {
+        for( key.tx = txMin; bCached && (key.tx <= txMax); key.tx++ )
+        {
+            for( key.band = 0; bCached && (key.band < nTileBands); key.band++ )
+                bCached = (tile_cache_find(&key) != NULL);
+        }
+    }
+    return bCached;
+}
+
+int gdal_read_tiled(struct gdalFile *file, struct image *im, int overviewIndex, struct extent *extent)
+{
+    struct stretch *stretch = file->stretch;
+    int nTileBands, band;
+    int bx, by, tx, ty, txMin, txMax, tyMin, tyMax, nTilesX, nTilesY, nTiles, n, nJobs;
+    int row, col, yoff, idx, bOK;
+    int *panCol, *panRow;
+    struct tileJobs jobs;
+    double dStart;
+    struct levelWindow win;
+    struct tile **papTiles, *t;
+    struct tileKey key;
+    unsigned char *pOut;
+
+    nTileBands = gdal_get_tile_bands(stretch);
+    if( nTileBands < 0 )
+    {
+        return -1;
+    }
+
+    im->w = im->nPixPerCell * im->nCellsX;
+    im->h = im->nPixPerCell * im->nCellsY;
+
+    if( !gdal_get_level_window(file, overviewIndex, extent, im->nCellsX, im->nCellsY,
+                im->w, im->h, &win) )
+    {
+        /* error should already be set */
+        return -1;
+    }
+    panCol = (int*)CPLMalloc(im->w * sizeof(int));
+    panRow = (int*)CPLMalloc(im->h * sizeof(int));
+    gdal_get_tile_lookup(&win, im->w, im->h, panCol, panRow, &txMin, &txMax, &tyMin, &tyMax);
+
+    nTilesX = MAX(txMax - txMin + 1, 0);
+    nTilesY = MAX(tyMax - tyMin + 1, 0);
+    nTiles = nTilesX * nTilesY * nTileBands;
+    papTiles = (struct tile**)CPLCalloc(MAX(nTiles, 1), sizeof(struct tile*));
+
+    /* get all the tiles we have already, pinning them so they */
+    /* can't be evicted before we have finished with them */
+    key.ds = file->ds;
+    key.level = overviewIndex;
+    key.decimation = win.decimation;
+    jobs.nMissing = 0;
+    jobs.panMissing = (int*)CPLMalloc(MAX(nTiles, 1) * sizeof(int));
+    jobs.panJobStart = (int*)CPLMalloc((nTiles + 1) * sizeof(int));
+    nJobs = 0;
+    for( n = 0; n < nTiles; n++ )
+    {
+        key.band = n % nTileBands;
+        key.tx = txMin + (n / nTileBands) % nTilesX;
+        key.ty = tyMin + (n / nTileBands) / nTilesX;
+        t = tile_cache_lookup(&key);
+        if( t == NULL )
         {
-            if(caca_get_event_type(&ev) & CACA_EVENT_KEY_PRESS)
+            /* the bands of a position are read together */
+            if( (jobs.nMissing == 0) || 
+                    ((jobs.panMissing[jobs.nMissing - 1] / nTileBands) != (n / nTileBands)) )
             {
-                int ch = caca_get_event_key_ch(&ev);
-                switch(ch)
+                jobs.panJobStart[nJobs++] = jobs.nMissing;
+            }
+            jobs.panMissing[jobs.nMissing++] = n;
+        }
+        else
+        {
+            t->nPinned++;
+            papTiles[n] = t;
+        }
+    }
+
+    stage_count(0, nTiles - jobs.nMissing, jobs.nMissing);
+
+    /* then read the rest, shared out between the read threads */
+    bOK = TRUE;
+    if( jobs.nMissing > 0 )
+    {
+        jobs.file = file;
+        jobs.key = key;
+        jobs.nTileBands = nTileBands;
+        jobs.txMin = txMin;
+        jobs.tyMin = tyMin;
+        jobs.nTilesX = nTilesX;
+        jobs.papTiles = papTiles;
+        jobs.panJobStart[nJobs] = jobs.nMissing;
+        read_pool_run(nJobs, gdal_read_tile_job, &jobs, file->ds);
+
+        for( n = 0; n < jobs.nMissing; n++ )
+        {
+            t = papTiles[jobs.panMissing[n]];
+            if( t == NULL )
+            {
+                /* error should already be set, or a newer request has come in */
+                bOK = FALSE;
+            }
+            else
+            {
+                tile_cache_insert(t);
+                t->nPinned++;
+            }
+        }
+    }
+    CPLFree(jobs.panMissing);
+    CPLFree(jobs.panJobStart);
+
+    if( bOK )
+    {
+        /* put the tiles together into our bil. Off the image is black */
+        dStart = stage_start();
+        im->pixels = frame_pool_get(im->w * im->h * IMG_DEPTH);
+        for( by = 0; by < im->h; by++ )
+        {
+            row = panRow[by];
+            pOut = (unsigned char*)&im->pixels[by * im->w * IMG_DEPTH];
+            if( row < 0 )
+            {
+                memset(pOut, 0, im->w * IMG_DEPTH);
+                continue;
+            }
+            ty = row / TILE_SIZE - tyMin;
+            yoff = (row % TILE_SIZE) * TILE_SIZE;
+            for( bx = 0; bx < im->w; bx++, pOut += IMG_DEPTH )
+            {
+                col = panCol[bx];
+                if( col < 0 )
                 {
-                case 'd':
-                    dither_algorithm++;
-                    if(algos[dither_algorithm * 2] == NULL)
-                        dither_algorithm = 0;
-                    caca_set_dither_algorithm(im->dither,
-                                              algos[dither_algorithm * 2]);
-                    new_status = STATUS_DITHERING;
-                    update = 1;
-                    break;
-                case 'D':
-                    dither_algorithm--;
-                    if(dither_algorithm < 0)
-                        while(algos[dither_algorithm * 2 + 2] != NULL)
-                            dither_algorithm++;
-                    caca_set_dither_algorithm(im->dither,
-                                              algos[dither_algorithm * 2]);
-                    new_status = STATUS_DITHERING;
-                    update = 1;
-                    break;
-                case '+':
-                    if(!rezoom)
-                    {
-                        dispExtent.dMetersPerCell *= ZOOM_IN_FACTOR;
-                        update = 1;
-                        rezoom = 1;
-                    }
-                    break;
-                case '-':
-                    if(!rezoom)
-                    {
-                        dispExtent.dMetersPerCell *= ZOOM_OUT_FACTOR;
-                        update = 1;
-                        rezoom = 1;
-                    }
-                    break;
-                case 'G':
-                    update = 1;
-                    set_gamma(g + 1);
-                    break;
-                case 'g':
-                    update = 1;
-                    set_gamma(g - 1);
-                    break;
-                case 'x':
-                case 'X':
-                    if(!rezoom)
-                    {
-                        update = 1;
-                        dispExtent.dCentreX = gdalfile.fullExtent.dCentreX;
-                        dispExtent.dCentreY = gdalfile.fullExtent.dCentreY;
-                        dispExtent.dMetersPerCell = gdalfile.fullExtent.dMetersPerCell;
-                        rezoom = 1;
-                        set_gamma(0);
-                    }
-                    break;
-                case 'k':
-                case 'K':
-                case CACA_KEY_UP:
-                    if(!rezoom)
-                    {
-                        dispExtent.dCentreY += ((wh * PAN_STEP) * dispExtent.dMetersPerCell);
-                        rezoom = 1;
-                        update = 1;
-                    }
-                    break;
-                case 'j':
-                case 'J':
-                case CACA_KEY_DOWN:
-                    if(!rezoom)
-                    {
-                        dispExtent.dCentreY -= ((wh * PAN_STEP) * dispExtent.dMetersPerCell);
-                        rezoom = 1;
-                        update = 1;
-                    }
-                    break;
-                case 'h':
-                case 'H':
-                case CACA_KEY_LEFT:
-                    if(!rezoom)
-                    {
-                        dispExtent.dCentreX -= ((ww * PAN_STEP) * dispExtent.dMetersPerCell);
-                        rezoom = 1;
-                        update = 1;
-                    }
-                    break;
-                case 'l':
-                case 'L':
-                case CACA_KEY_RIGHT:
-                    if(!rezoom)
-                    {
-                        dispExtent.dCentreX += ((ww * PAN_STEP) * dispExtent.dMetersPerCell);
-                        rezoom = 1;
-                        update = 1;
-                    }
-                    break;
-                case '?':
-                    new_help = !help;
-                    update = 1;
-                    break;
-                case 'q':
-                case 'Q':
-                case CACA_KEY_ESCAPE:
-                    quit = 1;
-                    break;
+                    pOut[0] = pOut[1] = pOut[2] = 0;
+                    continue;
+                }
+                tx = col / TILE_SIZE - txMin;
+                idx = (ty * nTilesX + tx) * nTileBands;
+                col = yoff + (col % TILE_SIZE);
+                if( stretch->mode == VIEWER_MODE_RGB )
+                {
+                    for( band = 0; band < 3; band++ )
+                        pOut[band] = papTiles[idx + band]->data[col];
+                }
+                else if( stretch->mode == VIEWER_MODE_GREYSCALE )
+                {
+                    pOut[0] = pOut[1] = pOut[2] = papTiles[idx]->data[col];
+                }
+                else
+                {
+                    memcpy(pOut, &papTiles[idx]->data[col * IMG_DEPTH], IMG_DEPTH);
                 }
             }
-            else if(caca_get_event_type(&ev) == CACA_EVENT_RESIZE)
+        }
+        stage_end(STAGE_INTERLEAVE, dStart);
+    }
+
+    for( idx = 0; idx < nTiles; idx++ )
+    {
+        if( papTiles[idx] != NULL )
+            papTiles[idx]->nPinned--;
+    }
+    tile_cache_trim();
+    CPLFree(papTiles);
+    CPLFree(panCol);
+    CPLFree(panRow);
+
+    if( !bOK )
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Reads into the cache the tiles needed for the extent that aren't there already. */
+/* Gives up and returns FALSE if the cache fills or a new request comes in */
+int gdal_prefetch_extent(struct gdalFile *file, struct extent *extent, int nCellsX, int nCellsY,
+                int nPixPerCell)
+{
+    struct stretch *stretch = file->stretch;
+    int nTileBands, overviewIndex, tx, ty, txMin, txMax, tyMin, tyMax, band;
+    int bOK = TRUE;
+    struct levelWindow win;
+    struct tileKey key;
+    struct tile *apTiles[3];
+    int nBands, anBands[3];
+
+    nTileBands = gdal_get_tile_bands(stretch);
+    overviewIndex = gdal_get_best_overview(file, extent, nCellsX, nCellsY, nPixPerCell);
+    if( (nTileBands < 0) || !gdal_get_level_window(file, overviewIndex, extent, nCellsX, nCellsY,
+                nPixPerCell * nCellsX, nPixPerCell * nCellsY, &win) )
+    {
+        return FALSE;
+    }
+
+    if( (win.x2 < 0) || (win.y2 < 0) || (win.x1 >= win.width) || (win.y1 >= win.height) )
+    {
+        /* off the image */
+        return TRUE;
+    }
+
+    txMin = (int)MAX(win.x1, 0) / win.decimation / TILE_SIZE;
+    txMax = (int)MIN(win.x2, win.width - 1) / win.decimation / TILE_SIZE;
+    tyMin = (int)MAX(win.y1, 0) / win.decimation / TILE_SIZE;
+    tyMax = (int)MIN(win.y2, win.height - 1) / win.decimation / TILE_SIZE;
+
+    key.ds = file->ds;
+    key.level = overviewIndex;
+    key.decimation = win.decimation;
+    for( ty = tyMin; bOK && (ty <= tyMax); ty++ )
+    {
+        for( tx = txMin; bOK && (tx <= txMax); tx++ )
+        {
+            key.tx = tx;
+            key.ty = ty;
+            nBands = 0;
+            for( band = 0; band < nTileBands; band++ )
             {
-                caca_refresh_display(dp);
-                ww = caca_get_event_resize_width(&ev);
-                wh = caca_get_event_resize_height(&ev);
-                update = 1;
-                rezoom = 1;
+                key.band = band;
+                if( tile_cache_find(&key) == NULL )
+                    anBands[nBands++] = band;
             }
-            else if(caca_get_event_type(&ev) & CACA_EVENT_QUIT)
-                quit = 1;
-
-            if(status || new_status)
-                status = new_status;
+            if( nBands == 0 )
+                continue;
 
-            if(help || new_help)
-                help = new_help;
+            /* don't push out what is being displayed */
+            if( loader_cancelled() || 
+                ((tileCache.nBytes + nBands * TILE_SIZE * TILE_SIZE * IMG_DEPTH) > tileCache.nMaxBytes) )
+            {
+                bOK = FALSE;
+                break;
+            }
 
-            event = caca_get_event(dp, CACA_EVENT_KEY_PRESS, &ev, 0);
+            memset(apTiles, 0, sizeof(apTiles));
+            bOK = gdal_read_tiles(file, file->ds, &key, nBands, anBands, apTiles);
+            for( band = 0; band < nBands; band++ )
+            {
+                if( apTiles[band] == NULL )
+                    continue;
+                if( bOK )
+                {
+                    tile_cache_insert(apTiles[band]);
+                }
+                else
+                {
+                    CPLFree(apTiles[band]->data);
+                    CPLFree(apTiles[band]);
+                }
+            }
         }
+    }
 
-        if(reload)
+    return bOK;
+}
+
+/* Called by the loader when it is idle. Reads the tiles that the next */
+/* pan in any direction, or the next zoom onto a different level will need */
+void gdal_prefetch(struct gdalFile *file, struct extent *extent, int nCellsX, int nCellsY,
+                int nPixPerCell)
+{
+    struct extent next;
+    struct levelWindow win, nextWin;
+    int n, nSteps, overviewIndex, nextOverviewIndex;
+    double adZoom[2] = {ZOOM_IN_FACTOR, ZOOM_OUT_FACTOR};
+
+    /* same steps as the keys in main */
+    for( n = 0; n < 4; n++ )
+    {
+        next = *extent;
+        if( n == 0 )
+            next.dCentreX -= ((nCellsX * PAN_STEP) * extent->dMetersPerCell);
+        else if( n == 1 )
+            next.dCentreX += ((nCellsX * PAN_STEP) * extent->dMetersPerCell);
+        else if( n == 2 )
+            next.dCentreY += ((nCellsY * PAN_STEP) * extent->dMetersPerCell);
+        else
+            next.dCentreY -= ((nCellsY * PAN_STEP) * extent->dMetersPerCell);
+
+        if( !gdal_prefetch_extent(file, &next, nCellsX, nCellsY, nPixPerCell) )
+            return;
+    }
+
+    /* zooming within a level mostly uses tiles we have already. */
+    /* Look for the zoom that will move onto the next level */
+    overviewIndex = gdal_get_best_overview(file, extent, nCellsX, nCellsY, nPixPerCell);
+    if( !gdal_get_level_window(file, overviewIndex, extent, nCellsX, nCellsY,
+                nPixPerCell * nCellsX, nPixPerCell * nCellsY, &win) )
+        return;
+
+    for( n = 0; n < 2; n++ )
+    {
+        next = *extent;
+        for( nSteps = 0; nSteps < PREFETCH_ZOOM_STEPS; nSteps++ )
         {
-            char *buffer;
-            int len = strlen(" Loading `%s'... ") + strlen(pszFileName);
+            next.dMetersPerCell *= adZoom[n];
+            nextOverviewIndex = gdal_get_best_overview(file, &next, nCellsX, nCellsY, nPixPerCell);
+            if( !gdal_get_level_window(file, nextOverviewIndex, &next, nCellsX, nCellsY,
+                        nPixPerCell * nCellsX, nPixPerCell * nCellsY, &nextWin) )
+                return;
+            if( (nextOverviewIndex != overviewIndex) || (nextWin.decimation != win.decimation) )
+                break;
+        }
 
-            if(len < ww + 1)
-                len = ww + 1;
+        if( (nSteps < PREFETCH_ZOOM_STEPS) && !gdal_prefetch_extent(file, &next, nCellsX, nCellsY, nPixPerCell) )
+            return;
+    }
+}
 
-            buffer = CPLMalloc(len);
+/* returns a newly malloced string describing the stretch */
+char *get_stretch_as_string(struct stretch *stretch)
+{
+    char szMode[GDAL_ERROR_SIZE], *pszStr;
+    char szStretchMode[GDAL_ERROR_SIZE];
+
+    szMode[0] = '\0';
+    if( stretch->mode == VIEWER_MODE_COLORTABLE )
+        snprintf(szMode, GDAL_ERROR_SIZE, "Color Table %d", stretch->bands[0]);
+    else if( stretch->mode == VIEWER_MODE_GREYSCALE )
+        snprintf(szMode, GDAL_ERROR_SIZE, "GreyScale %d", stretch->bands[0]);
+    else if( stretch->mode == VIEWER_MODE_RGB )
+        snprintf(szMode, GDAL_ERROR_SIZE, "RGB %d %d %d", stretch->bands[0],
+                 stretch->bands[1], stretch->bands[2]);
+    else if( stretch->mode == VIEWER_MODE_PSEUDOCOLOR )
+        snprintf(szMode, GDAL_ERROR_SIZE, "PseudoColor %d", stretch->bands[0]);
+
+    szStretchMode[0] = '\0';
+    if( stretch->stretchmode == VIEWER_STRETCHMODE_NONE )
+        snprintf(szStretchMode, GDAL_ERROR_SIZE, " No Stretch");
+    else if( stretch->stretchmode == VIEWER_STRETCHMODE_LINEAR )
+        snprintf(szStretchMode, GDAL_ERROR_SIZE, " Linear Stretch %.2f - %.2f",
+                 stretch->stretchparam[0], stretch->stretchparam[1]);
+    else if( stretch->stretchmode == VIEWER_STRETCHMODE_STDDEV )
+        snprintf(szStretchMode, GDAL_ERROR_SIZE, " Standard Deviation %.2f", stretch->stretchparam[0]);
+    else if( stretch->stretchmode == VIEWER_STRETCHMODE_HIST )
+        snprintf(szStretchMode, GDAL_ERROR_SIZE, " Histogram %.3f %.3f", 
+                 stretch->stretchparam[0], stretch->stretchparam[1]);
+
+    pszStr = CPLMalloc(strlen(szMode) + strlen(szStretchMode) + 1);
+    strcpy(pszStr, szMode);
+    strcat(pszStr, szStretchMode);
+    return pszStr;
+}
+
+/* number of bands we have statistics for */
+int gdal_get_stats_bands(struct stretch *stretch)
+{
+    if( stretch->mode == VIEWER_MODE_GREYSCALE )
+        return 1;
+    if( stretch->mode == VIEWER_MODE_RGB )
+        return 3;
+    return 0;
+}
+
+/* Key for the statistics cache - the full path, size and modification */
+/* time of the file. Returns NULL if it isn't a file we can stat */
+char *stats_cache_key(const char *pszFile)
+{
+    VSIStatBufL sStat;
+    char *pszDir = NULL, *pszKey;
+    const char *pszPath = pszFile;
+
+    if( (pszStatsCacheFile == NULL) || (VSIStatL(pszFile, &sStat) != 0) )
+        return NULL;
+
+    if( CPLIsFilenameRelative(pszFile) )
+    {
+        pszDir = CPLGetCurrentDir();
+        if( pszDir != NULL )
+            pszPath = CPLFormFilename(pszDir, pszFile, NULL);
+    }
+
+    pszKey = CPLStrdup(CPLSPrintf("%s\t%lld\t%lld", pszPath, 
+                (long long)sStat.st_size, (long long)sStat.st_mtime));
+    CPLFree(pszDir);
+    return pszKey;
+}
+
+/* Lines of the cache are key, band, min, max, mean, stddev separated by */
+/* tabs. New ones are appended so a later line wins over an earlier one. */
+/* The file is read the first time it is needed, then kept in memory */
+char **stats_cache_load(void)
+{
+    VSIStatBufL sStat;
+
+    /* CSLLoad complains if it isn't there */
+    if( !bStatsCacheLoaded && (VSIStatL(pszStatsCacheFile, &sStat) == 0) )
+        papszStatsCache = CSLLoad(pszStatsCacheFile);
+    bStatsCacheLoaded = TRUE;
+    return papszStatsCache;
+}
+
+/* TRUE if pszLine is for the same path as pszKey. If bExact the size */
+/* and modification time must match too */
+int stats_cache_match(const char *pszLine, const char *pszKey, int bExact)
+{
+    size_t nLen;
+
+    if( bExact )
+        nLen = strlen(pszKey);
+    else
+        nLen = strcspn(pszKey, "\t");
+
+    return (strncmp(pszLine, pszKey, nLen) == 0) && (pszLine[nLen] == '\t');
+}
+
+/* TRUE if pszLine, from earlier in the cache, is for the same file and */
+/* band as pszLater or for an older version of the file */
+int stats_cache_superseded(const char *pszLine, const char *pszLater)
+{
+    size_t nPathLen = strcspn(pszLater, "\t");
+    size_t nFileLen, nBandLen;
+    int n;
+
+    /* the path then its size and modification time, then the band */
+    nFileLen = nPathLen;
+    for( n = 0; n < 2; n++ )
+    {
+        if( pszLater[nFileLen] == '\t' )
+            nFileLen += 1 + strcspn(pszLater + nFileLen + 1, "\t");
+    }
+    nBandLen = nFileLen;
+    if( pszLater[nBandLen] == '\t' )
+        nBandLen += 1 + strcspn(pszLater + nBandLen + 1, "\t");
+
+    if( (strncmp(pszLine, pszLater, nPathLen) != 0) || (pszLine[nPathLen] != '\t') )
+        return FALSE;
+    if( (strncmp(pszLine, pszLater, nFileLen) != 0) || (pszLine[nFileLen] != '\t') )
+        return TRUE;
+    return (strncmp(pszLine, pszLater, nBandLen) == 0) && (pszLine[nBandLen] == '\t');
+}
+
+/* The newest line for pszKey and band split up after the key, so the */
+/* band first. NULL if there isn't one, otherwise free with CSLDestroy */
+char **stats_cache_find(const char *pszKey, int band)
+{
+    char **papszLines, **papszTokens;
+    int i;
 
-            sprintf(buffer, " Loading `%s'... ", pszFileName);
-            buffer[ww] = '\0';
-            caca_set_color_ansi(cv, CACA_WHITE, CACA_BLUE);
-            caca_put_str(cv, (ww - strlen(buffer)) / 2, wh / 2, buffer);
-            caca_refresh_display(dp);
-            ww = caca_get_canvas_width(cv);
-            wh = caca_get_canvas_height(cv);
+    if( pszKey == NULL )
+        return NULL;
 
-            if(gdalfile.ds)
-            {
-                gdal_close_file(&gdalfile);
-            }
-            if(im)
-            {
-                gdal_unload_image(im);
-                im = NULL;
-            }
+    papszLines = stats_cache_load();
+    for( i = CSLCount(papszLines) - 1; i >= 0; i-- )
+    {
+        if( !stats_cache_match(papszLines[i], pszKey, TRUE) )
+            continue;
 
-            if( gdal_open_file(pszFileName, &gdalfile, &stretchList, pCmdStretch) )
-            {
-                dispExtent.dCentreX = gdalfile.fullExtent.dCentreX;
-                dispExtent.dCentreY = gdalfile.fullExtent.dCentreY;
-                dispExtent.dMetersPerCell = gdalfile.fullExtent.dMetersPerCell;
-                im = gdal_load_image(&gdalfile, &dispExtent);
-            }
+        papszTokens = CSLTokenizeString2(papszLines[i] + strlen(pszKey), "\t", 0);
+        if( (papszTokens != NULL) && (papszTokens[0] != NULL) && (atoi(papszTokens[0]) == band) )
+            return papszTokens;
+        CSLDestroy(papszTokens);
+    }
 
-            reload = 0;
-            rezoom = 0;
+    return NULL;
+}
 
-            /* Reset image-specific runtime variables */
-            update = 1;
-            set_gamma(0);
+int stats_cache_lookup(const char *pszKey, int band, struct statisticsForBand *pStats)
+{
+    char **papszTokens = stats_cache_find(pszKey, band);
+    int bFound = FALSE;
 
-            CPLFree(buffer);
-        }
+    if( CSLCount(papszTokens) == 5 )
+    {
+        pStats->dMin = atof(papszTokens[1]);
+        pStats->dMax = atof(papszTokens[2]);
+        pStats->dMean = atof(papszTokens[3]);
+        pStats->dStdDev = atof(papszTokens[4]);
+        bFound = TRUE;
+    }
+    CSLDestroy(papszTokens);
 
-        if(rezoom)
+    return bFound;
+}
+/* Rewrites the cache without the lines later ones have replaced, and */
+/* without the oldest if there are still too many */
+void stats_cache_compact(void)
+{
+    char **papszKept = NULL;
+    char *pszTemp;
+    int i, j, nLines, nKept, bSuperseded;
+    FILE *fp;
+
+    /* newest first, so each is only kept if nothing kept replaces it */
+    nLines = CSLCount(papszStatsCache);
+    nKept = 0;
+    for( i = nLines - 1; (i >= 0) && (nKept < MAX_STATS_CACHE_LINES / 2); i-- )
+    {
+        bSuperseded = FALSE;
+        for( j = 0; (j < nKept) && !bSuperseded; j++ )
+            bSuperseded = stats_cache_superseded(papszStatsCache[i], papszKept[j]);
+        if( !bSuperseded )
         {
-            if(im)
-            {
-                gdal_unload_image(im);
-                im = NULL;
-            }
-
-            im = gdal_load_image(&gdalfile, &dispExtent);
+            papszKept = CSLAddString(papszKept, papszStatsCache[i]);
+            nKept++;
+        }
+    }
 
-            /* Write out new information to geolink file if required */
-            if( pszGeolinkFile != NULL )
-            {
-                FILE *fp = fopen(pszGeolinkFile, "w");
-                if( fp != NULL )
-                {
-                    unsigned long long pid;
+    /* written alongside and moved over it so the others never read */
+    /* a half written file */
 #if !defined(_WIN32) || defined(__CYGWIN__)
-                    pid = getpid();
+    pszTemp = CPLStrdup(CPLSPrintf("%s.%d", pszStatsCacheFile, (int)getpid()));
 #else
-                    pid = GetCurrentProcessId();
+    pszTemp = CPLStrdup(pszStatsCacheFile);
 #endif
-                    fprintf(fp, "%llu %f %f %f\n", pid, dispExtent.dCentreX,
-                            dispExtent.dCentreY, dispExtent.dMetersPerCell);
-                    fclose(fp);
-                }
-            }
+    fp = fopen(pszTemp, "w");
+    if( fp != NULL )
+    {
+        for( i = nKept - 1; i >= 0; i-- )
+            fprintf(fp, "%s\n", papszKept[i]);
+        fclose(fp);
+        if( (strcmp(pszTemp, pszStatsCacheFile) != 0) && (rename(pszTemp, pszStatsCacheFile) != 0) )
+            VSIUnlink(pszTemp);
+    }
+    CPLFree(pszTemp);
 
-            rezoom = 0;
-        }
+    CSLDestroy(papszStatsCache);
+    papszStatsCache = NULL;
+    for( i = nKept - 1; i >= 0; i-- )
+        papszStatsCache = CSLAddString(papszStatsCache, papszKept[i]);
+    CSLDestroy(papszKept);
+}
 
-        caca_set_color_ansi(cv, CACA_WHITE, CACA_BLACK);
-        caca_clear_canvas(cv);
+/* Adds pszLine, a key then a band then values, to the end of the cache */
+/* where it wins over anything older for the file. Each line goes out in */
+/* one append so other instances writing at the same time don't lose theirs */
+void stats_cache_append(const char *pszLine)
+{
+    FILE *fp;
 
-        if(!im)
+    stats_cache_load();
+    papszStatsCache = CSLAddString(papszStatsCache, pszLine);
+
+    if( !bStatsCacheAppendOnly && (CSLCount(papszStatsCache) > MAX_STATS_CACHE_LINES) )
+    {
+        stats_cache_compact();
+    }
+    else
+    {
+        fp = fopen(pszStatsCacheFile, "a");
+        if( fp != NULL )
         {
-            char *buffer;
-            char *error = " Error loading `%s'. ";
-            int len = strlen(error) + strlen(pszFileName);
+            fprintf(fp, "%s\n", pszLine);
+            fclose(fp);
+        }
+    }
+}
 
-            if( strlen( szGDALMessages ) != 0 )
-            {
-                /* if there was a message returned use it */
-                /* no extra formatting required */
-                error = szGDALMessages;
-                len = strlen(error);
-            }
+void stats_cache_store(const char *pszKey, int band, struct statisticsForBand *pStats)
+{
+    char *pszLine;
 
-            if(len < ww + 1)
-                len = ww + 1;
+    if( pszKey == NULL )
+        return;
 
-            buffer = CPLMalloc(len);
+    pszLine = CPLStrdup(CPLSPrintf("%s\t%d\t%.17g\t%.17g\t%.17g\t%.17g", pszKey, band, 
+                pStats->dMin, pStats->dMax, pStats->dMean, pStats->dStdDev));
+    stats_cache_append(pszLine);
+    CPLFree(pszLine);
+}
 
-            sprintf(buffer, error, pszFileName);
-            buffer[ww] = '\0';
-            caca_set_color_ansi(cv, CACA_WHITE, CACA_BLUE);
-            caca_put_str(cv, (ww - strlen(buffer)) / 2, wh / 2, buffer);
-            CPLFree(buffer);
-        }
-        else
+/* Reads the cache again, to pick up what others have appended, and */
+/* compacts it if it has got too big */
+void stats_cache_tidy(void)
+{
+    if( pszStatsCacheFile == NULL )
+        return;
+
+    CSLDestroy(papszStatsCache);
+    papszStatsCache = NULL;
+    bStatsCacheLoaded = FALSE;
+    if( CSLCount(stats_cache_load()) > MAX_STATS_CACHE_LINES )
+        stats_cache_compact();
+}
+
+/* Works out the statistics on a suitable overview, otherwise on the whole band */
+int computeStatistics(GDALRasterBandH bandh, struct statisticsForBand *pStats, 
+            GDALProgressFunc pfnProgress)
+{
+    int nOverviews, index, xsize, ysize;
+    GDALRasterBandH overviewh;
+
+    nOverviews = GDALGetOverviewCount(bandh);
+    for( index = 0; index < nOverviews; index++ )
+    {
+        overviewh = GDALGetOverview(bandh, index);
+        xsize = GDALGetRasterBandXSize(overviewh);
+        ysize = GDALGetRasterBandYSize(overviewh);
+        if( (xsize > MIN_OVERVIEW_STATS) && (xsize < MAX_OVERVIEW_STATS) &&
+            (ysize > MIN_OVERVIEW_STATS) && (ysize < MAX_OVERVIEW_STATS) )
         {
-            caca_dither_bitmap(cv, 0, 1, ww, wh - 3, im->dither, im->pixels);
+            if( GDALComputeRasterStatistics(overviewh, TRUE, &pStats->dMin, &pStats->dMax,
+                    &pStats->dMean, &pStats->dStdDev, pfnProgress, NULL) == CE_None)
+            {
+                return TRUE;
+            }
         }
+    }
 
-        print_status();
+    /* No valid overviews - estimate on whole band */
+    return GDALComputeRasterStatistics(bandh, TRUE, &pStats->dMin, &pStats->dMax,
+                    &pStats->dMean, &pStats->dStdDev, pfnProgress, NULL) == CE_None;
+}
 
-        caca_set_color_ansi(cv, CACA_LIGHTGRAY, CACA_BLACK);
-        switch(status)
+/* Stands in for statistics that aren't known yet so nothing has to be */
+/* read before the first frame. The range of the type, or 0 to 1 for */
+/* floating point, which the standard deviation stretch also spreads out */
+/* linearly. The samples taken while that frame is stretched replace it */
+void stats_provisional(GDALDataType eType, struct statisticsForBand *pStats)
+{
+    if( eType == GDT_Byte )
+    {
+        pStats->dMin = 0;
+        pStats->dMax = 255;
+    }
+    else if( eType == GDT_UInt16 )
+    {
+        pStats->dMin = 0;
+        pStats->dMax = 65535;
+    }
+    else if( eType == GDT_Int16 )
+    {
+        pStats->dMin = -32768;
+        pStats->dMax = 32767;
+    }
+    else
+    {
+        pStats->dMin = 0;
+        pStats->dMax = 1;
+    }
+    pStats->dMean = (pStats->dMin + pStats->dMax) / 2;
+    pStats->dStdDev = (pStats->dMax - pStats->dMin) / 4;
+    /* the histogram stretch clips nothing until it knows better */
+    pStats->dHistMin = pStats->dMin;
+    pStats->dHistMax = pStats->dMax;
+    pStats->bProvisional = TRUE;
+    pStats->nSamples = 0;
+    pStats->dSampleSum = 0;
+    pStats->dSampleSumSq = 0;
+}
+
+/* Replaces the provisional statistics with ones from the samples, which */
+/* are close enough while computeStatistics runs. FALSE if there are none */
+int stats_from_samples(struct statisticsForBand *pStats)
+{
+    if( !pStats->bProvisional || (pStats->nSamples == 0) )
+        return FALSE;
+
+    pStats->dMin = pStats->dSampleMin;
+    pStats->dMax = pStats->dSampleMax;
+    pStats->dMean = pStats->dSampleSum / pStats->nSamples;
+    pStats->dStdDev = sqrt(MAX(0.0, pStats->dSampleSumSq / pStats->nSamples - 
+                pStats->dMean * pStats->dMean));
+    /* the samples have no histogram, so the histogram stretch takes their */
+    /* range until getHistogram has been */
+    pStats->dHistMin = pStats->dSampleMin;
+    pStats->dHistMax = MAX(pStats->dSampleMax, pStats->dSampleMin + 1);
+    pStats->bProvisional = FALSE;
+    return TRUE;
+}
+
+/* Finds the values dLowFrac of the way up the histogram and dHighFrac */
+/* of the way down it. Buckets are evenly spaced from dHistMin to dHistMax */
+void hist_percentiles(const GUIntBig *panHist, int nBuckets, double dHistMin, double dHistMax,
+            double dLowFrac, double dHighFrac, struct statisticsForBand *pStats)
+{
+    GUIntBig nTotal = 0, nCount;
+    double dBucketSize = (dHistMax - dHistMin) / nBuckets;
+    int n;
+
+    for( n = 0; n < nBuckets; n++ )
+        nTotal += panHist[n];
+
+    pStats->dHistMin = dHistMin;
+    nCount = 0;
+    for( n = 0; n < nBuckets; n++ )
+    {
+        nCount += panHist[n];
+        if( nCount > dLowFrac * nTotal )
         {
-        case STATUS_DITHERING:
-            caca_printf(cv, 0, wh - 1, "Dithering: %s",
-                        caca_get_dither_algorithm(im->dither));
+            pStats->dHistMin = dHistMin + n * dBucketSize;
             break;
         }
+    }
 
-        if(help)
+    pStats->dHistMax = dHistMax;
+    nCount = 0;
+    for( n = nBuckets - 1; n >= 0; n-- )
+    {
+        nCount += panHist[n];
+        if( nCount > dHighFrac * nTotal )
         {
-            print_help(ww - 26, 2);
+            pStats->dHistMax = dHistMin + (n + 1) * dBucketSize;
+            break;
         }
-
-        caca_refresh_display(dp);
-        update = 0;
     }
 
-    /* Clean up */
-    if(im)
-        gdal_unload_image(im);
-    if(gdalfile.ds)
-        gdal_close_file(&gdalfile);
-    if(pszStretchStatusString)
-        CPLFree(pszStretchStatusString);
-    if(pCmdStretch)
-        CPLFree(pCmdStretch);
-    caca_free_display(dp);
-    caca_free_canvas(cv);
-
-    return 0;
+    /* so the scale is finite */
+    if( pStats->dHistMax <= pStats->dHistMin )
+        pStats->dHistMax = pStats->dHistMin + 1;
 }
 
-static void print_status(void)
+/* Sets dHistMin and dHistMax for the histogram stretch. Uses the default */
+/* histogram if the file has one, otherwise one from a HIST_SAMPLE_SIZE read. */
+/* If bQuick that read is put off, with provisional statistics and */
+/* pStats->bEstimated set instead */
+int getHistogram(GDALRasterBandH bandh, struct statisticsForBand *pStats, struct stretch *stretch,
+            int bQuick)
 {
-    caca_set_color_ansi(cv, CACA_WHITE, CACA_BLUE);
-    caca_draw_line(cv, 0, 0, ww - 1, 0, ' ');
-    caca_draw_line(cv, 0, wh - 2, ww - 1, wh - 2, '-');
-    caca_put_str(cv, 0, 0, "q:Quit +-x:Zoom  gG:Gamma  "
-                 "hjkl:Move  d:Dither");
-    caca_put_str(cv, ww - strlen("?:Help"), 0, "?:Help");
-    caca_printf(cv, ww - 30, wh - 2, "(gamma: %#.3g)", GAMMA(g));
-    /*    caca_printf(cv, ww - 14, wh - 2, "(zoom: %s%i)", zoom > 0 ? "+" : "", zoom);*/
+    int xsize = GDALGetRasterBandXSize(bandh);
+    int ysize = GDALGetRasterBandYSize(bandh);
+    int nBufXSize = MIN(xsize, HIST_SAMPLE_SIZE);
+    int nBufYSize = MIN(ysize, HIST_SAMPLE_SIZE);
+    int n, nBuckets, nBucket, nCount = 0, bHasNoData = FALSE;
+    double dHistMin, dHistMax, dNoData;
+    GUIntBig *panHist = NULL;
+    float *pData;
+
+    if( (GDALGetDefaultHistogramEx(bandh, &dHistMin, &dHistMax, &nBuckets, &panHist, 
+                FALSE, NULL, NULL) == CE_None) && (nBuckets > 0) )
+    {
+        hist_percentiles(panHist, nBuckets, dHistMin, dHistMax, stretch->stretchparam[0],
+                stretch->stretchparam[1], pStats);
+        VSIFree(panHist);
+        return TRUE;
+    }
+    VSIFree(panHist);
 
-    if( pszStretchStatusString != NULL )
+    if( bQuick )
     {
-        caca_put_str(cv, 10, wh - 2, pszStretchStatusString);
+        stats_provisional(gdal_get_read_type(bandh), pStats);
+        pStats->bEstimated = TRUE;
+        return TRUE;
     }
-    else
+
+    dNoData = GDALGetRasterNoDataValue(bandh, &bHasNoData);
+    pData = (float*)CPLMalloc(sizeof(float) * nBufXSize * nBufYSize);
+    if( GDALRasterIO(bandh, GF_Read, 0, 0, xsize, ysize, pData, nBufXSize, nBufYSize,
+                GDT_Float32, 0, 0) != CE_None )
     {
-        caca_put_str(cv, 10, wh - 2, "No Stretch");
+        CPLFree(pData);
+        return FALSE;
     }
 
-    caca_set_color_ansi(cv, CACA_LIGHTGRAY, CACA_BLACK);
-    caca_draw_line(cv, 0, wh - 1, ww - 1, wh - 1, ' ');
-}
+    /* only keep the valid values */
+    for( n = 0; n < nBufXSize * nBufYSize; n++ )
+    {
+        /* NaN or nodata */
+        if( (pData[n] != pData[n]) || (bHasNoData && (pData[n] == (float)dNoData)) )
+            continue;
+        pData[nCount++] = pData[n];
+    }
 
-static void print_help(int x, int y)
-{
-    static char const *help[] =
+    if( nCount == 0 )
     {
-        " +: zoom in              ",
-        " -: zoom out             ",
-        " g: decrease gamma       ",
-        " G: increase gamma       ",
-        " x: reset zoom and gamma ",
-        " ----------------------- ",
-        " hjkl: move view         ",
-        " arrows: move view       ",
-        " ----------------------- ",
-        " d: dithering method     ",
-        " ----------------------- ",
-        " ?: help                 ",
-        " q: quit                 ",
-        NULL
-    };
+        CPLFree(pData);
+        return FALSE;
+    }
 
-    int i;
+    dHistMin = dHistMax = pData[0];
+    for( n = 1; n < nCount; n++ )
+    {
+        dHistMin = MIN(dHistMin, pData[n]);
+        dHistMax = MAX(dHistMax, pData[n]);
+    }
+    /* every value falls inside the last bucket */
+    dHistMax += (dHistMax - dHistMin) / HIST_BUCKETS + 1e-6;
 
-    caca_set_color_ansi(cv, CACA_WHITE, CACA_BLUE);
+    panHist = (GUIntBig*)CPLCalloc(HIST_BUCKETS, sizeof(GUIntBig));
+    for( n = 0; n < nCount; n++ )
+    {
+        nBucket = (int)((pData[n] - dHistMin) / (dHistMax - dHistMin) * HIST_BUCKETS);
+        panHist[MIN(nBucket, HIST_BUCKETS - 1)]++;
+    }
+    CPLFree(pData);
 
-    for(i = 0; help[i]; i++)
-        caca_put_str(cv, x, y + i, help[i]);
+    hist_percentiles(panHist, HIST_BUCKETS, dHistMin, dHistMax, stretch->stretchparam[0],
+            stretch->stretchparam[1], pStats);
+    CPLFree(panHist);
+    return TRUE;
 }
 
-static void set_gamma(int new_gamma)
+/* pszCacheKey is from stats_cache_key. If bQuick then statistics that */
+/* aren't already known are provisional and pStats->bEstimated set */
+int getStatistics(GDALDatasetH ds, int band, struct statisticsForBand *pStats, 
+            const char *pszCacheKey, int bQuick)
 {
-    if(!im)
-        return;
+    const char *pszMin, *pszMax, *pszStdDev, *pszMean;
+    GDALRasterBandH bandh = GDALGetRasterBand(ds, band);
 
-    g = new_gamma;
+    pStats->bEstimated = FALSE;
+    pStats->bProvisional = FALSE;
+    pszMin = GDALGetMetadataItem(bandh, "STATISTICS_MINIMUM", NULL);
+    pszMax = GDALGetMetadataItem(bandh, "STATISTICS_MAXIMUM", NULL);
+    pszStdDev = GDALGetMetadataItem(bandh, "STATISTICS_STDDEV", NULL);
+    pszMean = GDALGetMetadataItem(bandh, "STATISTICS_MEAN", NULL);
+    if( (pszMin == NULL ) || (pszMax == NULL) || (pszStdDev == NULL) || (pszMean == NULL ) )
+    {
+        /* No Stats - see if we have worked them out before */
+        if( stats_cache_lookup(pszCacheKey, band, pStats) )
+        {
+            return TRUE;
+        }
 
-    if(g > GAMMA_MAX) g = GAMMA_MAX;
-    if(g < -GAMMA_MAX) g = -GAMMA_MAX;
+        if( bQuick )
+        {
+            stats_provisional(gdal_get_read_type(bandh), pStats);
+            pStats->bEstimated = TRUE;
+            return TRUE;
+        }
 
-    caca_set_dither_gamma(im->dither,
-                          (g < 0) ? 1.0 / gammatab[-g] : gammatab[g]);
+        if( !computeStatistics(bandh, pStats, NULL) )
+        {
+            return FALSE;
+        }
+        stats_cache_store(pszCacheKey, band, pStats);
+        return TRUE;
+    }
+    else
+    {
+        /* convert from strings */
+        pStats->dMin = atof(pszMin);
+        pStats->dMax = atof(pszMax);
+        pStats->dMean = atof(pszMean);
+        pStats->dStdDev = atof(pszStdDev);
+        return TRUE;
+    }
 }
 
-static void draw_checkers(int x, int y, int w, int h)
+/* Called by the loader when idle to put in the stretch that was put off */
+/* by gdal_open_file, then to replace estimated statistics. Returns 1 when */
+/* a step is done, 0 if cancelled by a new request and -1 on failure */
+int gdal_update_statistics(struct gdalFile *file)
 {
-    int xn, yn;
+    struct statisticsForBand aStats[3];
+    struct stretch *stretch;
+    GDALRasterBandH bandh;
+    int count, nBands, bSampled;
 
-    if(x + w > (int)caca_get_canvas_width(cv))
-        w = caca_get_canvas_width(cv) - x;
-    if(y + h > (int)caca_get_canvas_height(cv))
-        h = caca_get_canvas_height(cv) - y;
+    if( file->pPendingStretch != NULL )
+    {
+        stretch = file->pPendingStretch;
+        if( file->pStretchRules != NULL )
+        {
+            /* now the RATs can be looked at */
+            stretch = get_stretch_for_gdal(file->pStretchRules, file->hRulesDS, TRUE);
+            if( stretch == NULL )
+            {
+                set_read_error("Could not find stretch to use");
+                return -1;
+            }
+        }
+        file->pPendingStretch = NULL;
 
-    for(yn = y > 0 ? y : 0; yn < y + h; yn++)
-        for(xn = x > 0 ? x : 0; xn < x + w; xn++)
+        if( (stretch->mode == VIEWER_MODE_COLORTABLE) && 
+            (gdal_read_rat_colours(GDALGetRasterBand(file->hRulesDS, stretch->bands[0]), &file->colours) < 0) )
         {
-            if((((xn - x) / 5) ^ ((yn - y) / 3)) & 1)
-                caca_set_color_ansi(cv, CACA_LIGHTGRAY, CACA_DARKGRAY);
-            else
-                caca_set_color_ansi(cv, CACA_DARKGRAY, CACA_LIGHTGRAY);
-            caca_put_char(cv, xn, yn, ' ');
+            /* error should already be set */
+            return -1;
         }
-}
 
-int gdal_get_best_overview(GDALDatasetH ds, struct extent *extent)
-{
-    /* look for a suitable overview using band 1 */
-    /* return 0 to use full res, or overviewIndex+1 */
-    GDALRasterBandH bandh = GDALGetRasterBand(ds, 1);
-    int count, nOverviews, nFactor, nBestIndex;
-    double adfTransform[6], dBestPixelsPerCell, dPixelsPerCell;
+        /* a different rule may have matched instead */
+        file->stretch = stretch;
+        if( !gdal_get_stretch_statistics(file, TRUE) )
+        {
+            set_read_error("Could not get statistics");
+            return -1;
+        }
 
-    nOverviews = GDALGetOverviewCount(bandh);
-    if( nOverviews == 0 )
+        tile_cache_purge(file->ds);
+        return 1;
+    }
+
+    nBands = gdal_get_stats_bands(file->stretch);
+
+    /* first a stretch for what the frames so far had in them, */
+    /* which they are then read again with */
+    bSampled = FALSE;
+    for( count = 0; count < nBands; count++ )
     {
-        /* no overviews - use full resolution */
-        return 0;
+        struct statisticsForBand *pStats = &file->statsForStretchBands[count];
+        if( !stats_from_samples(pStats) )
+            continue;
+        build_stretch_lut(pStats, 
+                gdal_get_read_type(GDALGetRasterBand(file->ds, file->stretch->bands[count])),
+                file->stretch);
+        bSampled = TRUE;
+    }
+    if( bSampled )
+    {
+        tile_cache_purge(file->ds);
+        return 1;
     }
 
-    if( GDALGetGeoTransform(ds, adfTransform) != CE_None )
+    /* work them all out before changing anything so the tiles stay consistent */
+    for( count = 0; count < nBands; count++ )
     {
-        /* Should raise an error here? */
-        return 0;
+        if( !file->statsForStretchBands[count].bEstimated )
+            continue;
+        bandh = GDALGetRasterBand(file->ds, file->stretch->bands[count]);
+        if( file->stretch->stretchmode == VIEWER_STRETCHMODE_HIST )
+        {
+            if( !getHistogram(bandh, &aStats[count], file->stretch, FALSE) )
+                return -1;
+        }
+        else if( !computeStatistics(bandh, &aStats[count], loader_progress) )
+        {
+            return loader_cancelled() ? 0 : -1;
+        }
     }
 
-    /* full resolution */
-    dBestPixelsPerCell = extent->dMetersPerCell / adfTransform[1];
-    nBestIndex = 0; /* 0 is full res, otherwise overview+1 */
-
-    /* now overviews */
-    /* we want something close to PIX_PER_CELL but greater */
-    for( count = 0; count < nOverviews; count++ )
+    for( count = 0; count < nBands; count++ )
     {
-        GDALRasterBandH ovh = GDALGetOverview(bandh, count);
-        nFactor = GDALGetRasterXSize(ds) / GDALGetRasterBandXSize(ovh);
-        dPixelsPerCell = extent->dMetersPerCell / (adfTransform[1] * nFactor);
-        if( ( dPixelsPerCell > PIX_PER_CELL ) &&
-                ( ( dPixelsPerCell - PIX_PER_CELL ) < ( dBestPixelsPerCell - PIX_PER_CELL ) ) )
+        struct statisticsForBand *pStats = &file->statsForStretchBands[count];
+        if( !pStats->bEstimated )
+            continue;
+        if( file->stretch->stretchmode == VIEWER_STRETCHMODE_HIST )
+        {
+            /* only the clip points, which aren't cached */
+            pStats->dHistMin = aStats[count].dHistMin;
+            pStats->dHistMax = aStats[count].dHistMax;
+        }
+        else
         {
-            dBestPixelsPerCell = dPixelsPerCell;
-            nBestIndex = count + 1;
+            stats_cache_store(file->pszStatsKey, file->stretch->bands[count], &aStats[count]);
+            pStats->dMin = aStats[count].dMin;
+            pStats->dMax = aStats[count].dMax;
+            pStats->dMean = aStats[count].dMean;
+            pStats->dStdDev = aStats[count].dStdDev;
         }
+        pStats->bEstimated = FALSE;
+        pStats->bProvisional = FALSE;
+        build_stretch_lut(pStats, 
+                gdal_get_read_type(GDALGetRasterBand(file->ds, file->stretch->bands[count])),
+                file->stretch);
     }
+    file->bStatsEstimated = FALSE;
 
-    return nBestIndex;
+    /* they were stretched with the estimates */
+    tile_cache_purge(file->ds);
+    return 1;
 }
 
-void gdal_dump_image(const char *pszFilename,int depth, struct image *im)
+/* Nodata and mask of a band of the stretch. Nodata is done by the stretch */
+/* itself, so the mask band is only read for an explicit mask or alpha band */
+void gdal_read_masking(GDALRasterBandH bandh, struct statisticsForBand *pStats)
 {
-    /* debugging routine for dumping contents of im->pixels to text file */
-    int xcount, ycount;
-    FILE *fh = fopen(pszFilename,"w");
-    if( fh != NULL )
-    {
-        fprintf( fh, "width = %d height = %d\n", im->w, im->h );
+    int nFlags = GDALGetMaskFlags(bandh);
 
-        for( ycount = 0; ycount < im->h; ycount++ )
+    pStats->dNoData = GDALGetRasterNoDataValue(bandh, &pStats->bHasNoData);
+    pStats->nMaskFlags = (nFlags & (GMF_ALL_VALID | GMF_NODATA)) ? 0 : nFlags;
+}
+
+/* pCmdStretch non-NULL if they have passed in a stretch on the command line */
+/* Gets the statistics, or the histogram clip points, that file->stretch */
+/* needs and builds the lookup tables. If bQuick those that aren't */
+/* already known are provisional, for the loader to replace */
+int gdal_get_stretch_statistics(struct gdalFile *file, int bQuick)
+{
+    int count, nBands = gdal_get_stats_bands(file->stretch);
+
+    for( count = 0; count < nBands; count++ )
+    {
+        file->statsForStretchBands[count].bEstimated = FALSE;
+        if( file->stretch->stretchmode == VIEWER_STRETCHMODE_HIST )
         {
-            for( xcount = 0; xcount < im->w*depth; xcount++ )
+            /* just needs to know where to clip */
+            if( !getHistogram(GDALGetRasterBand(file->ds, file->stretch->bands[count]),
+                    &file->statsForStretchBands[count], file->stretch, bQuick) )
             {
-                fprintf( fh, "%d,", (int)im->pixels[ycount*im->w*depth+xcount] );
+                return FALSE;
             }
-            fprintf( fh, "\n" );
         }
-        fclose(fh);
+        else if( !getStatistics(file->ds, file->stretch->bands[count],
+                &file->statsForStretchBands[count], file->pszStatsKey, bQuick) ) 
+        {
+            return FALSE;
+        }
+    }
+    /* none needed for colour table or pseudocolour */
+
+    /* after the statistics, which may have come from the cache */
+    for( count = 0; count < gdal_get_stretch_band_count(file->stretch); count++ )
+    {
+        gdal_read_masking(GDALGetRasterBand(file->ds, file->stretch->bands[count]), 
+                &file->statsForStretchBands[count]);
     }
+
+    /* lookup tables for the integer types */
+    file->bStatsEstimated = FALSE;
+    for( count = 0; count < nBands; count++ )
+    {
+        if( file->statsForStretchBands[count].bEstimated )
+            file->bStatsEstimated = TRUE;
+        build_stretch_lut(&file->statsForStretchBands[count], 
+                gdal_get_read_type(GDALGetRasterBand(file->ds, file->stretch->bands[count])),
+                file->stretch);
+    }
+
+    return TRUE;
 }
 
-/* stretches data to range 0-255 based on the current stretch */
-int do_stretch(float *pBuffer, GDALRasterBandH bandh, struct statisticsForBand *pStats,
-                    int size, struct stretch *stretch)
+int gdal_open_file(char const *pszFile, struct gdalFile *file, struct stretchlist *stretchList,
+                   struct stretch *pCmdStretch)
 {
-    int n;
-    double dStep;
-    float dVal;
+    int xsize, ysize;
+    double dStart = stage_start();
+
+    /* reset error message buffer */
+    szGDALMessages[0] = '\0';
 
-    /* Do the right thing depedning on stretch */
-    if( stretch->stretchmode == VIEWER_STRETCHMODE_STDDEV)
+    /* attempt to open with GDAL */
+    file->ds = GDALOpen(pszFile, GA_ReadOnly);
+    if( file->ds == NULL )
+    {
+        snprintf( szGDALMessages, GDAL_ERROR_SIZE, "Could not open %s with GDAL", pszFile );
+        return 0;
+    }
+    file->pszFilename = CPLStrdup(pszFile);
+    file->hRulesDS = file->ds;
+    if( strcmp(pszFile, MOSAIC_FILENAME) == 0 )
+    {
+        /* the VRT is new each time, and doesn't have the metadata or */
+        /* RATs of the files that the stretch rules look at */
+        file->pszStatsKey = (pszMosaicStatsKey != NULL) ? CPLStrdup(pszMosaicStatsKey) : NULL;
+        if( pszMosaicRulesFile != NULL )
+            file->hRulesDS = GDALOpen(pszMosaicRulesFile, GA_ReadOnly);
+        if( file->hRulesDS == NULL )
+            file->hRulesDS = file->ds;
+    }
+    else
     {
+        file->pszStatsKey = stats_cache_key(pszFile);
+    }
+    gdal_read_pyramids(file);
+
+    stage_end(STAGE_OPEN, dStart);
+    dStart = stage_start();
 
-        /* now apply the standard deviation stretch */
-        for( n = 0; n < size; n++)
+    /* get the stretch. If lazy the RATs are looked at later */
+    if( pCmdStretch != NULL )
+    {
+        file->stretch = pCmdStretch;
+    }
+    else
+    {
+        file->stretch = get_stretch_for_gdal(stretchList, file->hRulesDS, !bLazyStats);
+        if( file->stretch == NULL )
         {
-            if((pBuffer[n] <= pStats->dMin) || (pBuffer[n] == 0))
-                pBuffer[n] = 0;
-            else if(pBuffer[n] >= pStats->dMax)
-                pBuffer[n] = 255;
-            else
-            {
-                dVal = ((pBuffer[n] - pStats->dMean + pStats->dStdDev * stretch->stretchparam[0]) * 255)/(pStats->dStdDev * 2 *stretch->stretchparam[0]);
-                if( dVal < 0 )
-                    pBuffer[n] = 0;
-                else if( dVal > 255 )
-                    pBuffer[n] = 255;
-                else
-                    pBuffer[n] = dVal;
-            }
+            gdal_close_file(file);
+            snprintf( szGDALMessages, GDAL_ERROR_SIZE, "Could not find stretch to use for %s", pszFile);
+            return 0;
         }
     }
-    else if( stretch->stretchmode == VIEWER_STRETCHMODE_LINEAR )
+
+    file->pPendingStretch = NULL;
+    file->pStretchRules = NULL;
+    if( bLazyStats && (file->stretch->mode == VIEWER_MODE_COLORTABLE) )
+    {
+        /* show it min to max until the loader has read the colours */
+        file->pPendingStretch = file->stretch;
+        file->pStretchRules = (pCmdStretch == NULL) ? stretchList : NULL;
+        file->interimStretch = *file->stretch;
+        file->interimStretch.mode = VIEWER_MODE_GREYSCALE;
+        file->interimStretch.stretchmode = VIEWER_STRETCHMODE_LINEAR;
+        file->stretch = &file->interimStretch;
+    }
+
+    if( !gdal_get_stretch_statistics(file, bLazyStats) )
     {
-        dStep = (pStats->dMax - pStats->dMin) / 255.0;
+        gdal_close_file(file);
+        snprintf( szGDALMessages, GDAL_ERROR_SIZE, "Could not get statistics for %s", pszFile );
+        return 0;
+    }
 
-        /* linear stretch */
-        for( n = 0; n < size; n++)
+    if( file->stretch->mode == VIEWER_MODE_COLORTABLE )
+    {
+        /* Grab the RAT and read the colour columns once for every frame */
+        /* can't do the caca_set_dither_palette call since that is limited to 256 classes */
+        if( gdal_read_rat_colours(GDALGetRasterBand(file->hRulesDS, file->stretch->bands[0]), 
+                &file->colours) < 0 )
         {
-            if(pBuffer[n] <= pStats->dMin)
-                pBuffer[n] = 0;
-            else if(pBuffer[n] >= pStats->dMax)
-                pBuffer[n] = 255;
-            else
-            {
-                dVal = (pBuffer[n] - pStats->dMin) * dStep;
-                if( dVal < 0 )
-                    pBuffer[n] = 0;
-                else if( dVal > 255 )
-                    pBuffer[n] = 255;
-                else
-                    pBuffer[n] = dVal;
-            }
+            /* error should already be set */
+            gdal_close_file(file);
+            return 0;
         }
     }
-    else if( stretch->stretchmode != VIEWER_STRETCHMODE_NONE)
+    stage_end(STAGE_STATISTICS, dStart);
+
+    /* status string */
+    if(pszStretchStatusString != NULL)
     {
-        snprintf( szGDALMessages, GDAL_ERROR_SIZE, "stretch not currently supported" );
-        return -1;
+        CPLFree(pszStretchStatusString);
+    }
+    pszStretchStatusString = get_stretch_as_string(file->stretch);
+
+    /* get full extent */
+    if( GDALGetGeoTransform(file->ds, file->adfTransform) != CE_None )
+    {
+        gdal_close_file(file);
+        snprintf( szGDALMessages, GDAL_ERROR_SIZE, "No Geo Transform");
+        return 0;
     }
 
+    xsize = GDALGetRasterXSize(file->ds);
+    ysize = GDALGetRasterYSize(file->ds);
+
+    file->fullExtent.dCentreX = file->adfTransform[0] + file->adfTransform[1] * (xsize / 2);
+    file->fullExtent.dCentreY = file->adfTransform[3] + file->adfTransform[5] * (ysize / 2);
+    file->fullExtent.dMetersPerCell = MAX((file->adfTransform[1] * xsize) / ww,
+                                          (-file->adfTransform[5] * ysize) / wh);
+
     return 1;
 }
 
-/* Info for passing to GDALRasterIO */
-struct readInfo
+void gdal_close_file(struct gdalFile* file)
 {
-    int nXOff, nYOff, nXSize, nYSize;
-    int nDataOffset;
-    int nBufXSize, nBufYSize;
-};
+    int count;
 
-int prepare_for_reading(int dataWidth, int dataHeight, GDALDatasetH ds, GDALRasterBandH ovh, struct extent *extent,
-                        struct readInfo *info)
-{
-    double adfTransform[6], adfInvertTransform[6], x1, y1, x2, y2;
-    int tlx, tly, brx, bry, width, height, nFactor;
-    double dTLX, dTLY, dBRX, dBRY;
-    int leftExtra, rightExtra, topExtra, bottomExtra;
-    int widthIn, heightIn, origWidthIn, origHeightIn;
+    /* the handle may be reused by GDAL so tiles can't be kept */
+    tile_cache_purge(file->ds);
+    for( count = 0; count < 3; count++ )
+    {
+        CPLFree(file->statsForStretchBands[count].pLUT);
+        file->statsForStretchBands[count].pLUT = NULL;
+    }
+    CPLFree(file->colours.pRGB);
+    file->colours.pRGB = NULL;
+    file->colours.nEntries = 0;
+    gdal_free_pyramids(file);
+    gdal_close_band_mappings(file->ds);
+    gdal_close_level_datasets();
+    if( (file->hRulesDS != NULL) && (file->hRulesDS != file->ds) )
+        GDALClose(file->hRulesDS);
+    file->hRulesDS = NULL;
+    GDALClose(file->ds);
+    file->ds = NULL;
+    CPLFree(file->pszFilename);
+    file->pszFilename = NULL;
+    CPLFree(file->pszStatsKey);
+    file->pszStatsKey = NULL;
+}
 
-    width = GDALGetRasterBandXSize(ovh);
-    height = GDALGetRasterBandYSize(ovh);
-    nFactor = GDALGetRasterXSize(ds) / width;
+/* Reads im for the extent at overviewIndex through the tile cache, or */
+/* directly if there isn't one */
+int gdal_read_image(struct gdalFile *file, struct image *im, int overviewIndex, struct extent *extent)
+{
+    if( tileCache.nMaxBytes > 0 )
+    {
+        return gdal_read_tiled(file, im, overviewIndex, extent);
+    }
+    else if( file->stretch->mode == VIEWER_MODE_RGB )
+    {
+        return gdal_read_multiband(file->ds,im,overviewIndex, file->stretch, 
+                file->statsForStretchBands, extent);
+    }
+    else
+    {
+        return gdal_read_singleband(file->ds,im,overviewIndex, file->stretch, 
+                file->statsForStretchBands, &file->colours, extent);
+    }
+}
 
-    /* Fiddle to make picture come out correct dimensions */
-    /* I think this undoes some of the stuff libcaca does */
-    /* Needs more investigation */
-    dTLX = extent->dCentreX - ((ww / 2.0) * extent->dMetersPerCell * 0.5);
-    dBRX = extent->dCentreX + ((ww / 2.0) * extent->dMetersPerCell * 0.5);
-    dTLY = extent->dCentreY + ((wh / 2.0) * extent->dMetersPerCell);
-    dBRY = extent->dCentreY - ((wh / 2.0) * extent->dMetersPerCell);
+/* Reads the nWidth by nHeight pixels of im at nX, nY as an image of */
+/* their own, one pixel to a cell, and puts them in place */
+int gdal_read_strip(struct gdalFile *file, struct image *im, int overviewIndex, 
+            int nX, int nY, int nWidth, int nHeight)
+{
+    struct image strip;
+    double dPixelX, dPixelY;
+    int row;
+
+    memset(&strip, 0, sizeof(strip));
+    strip.nPixPerCell = 1;
+    strip.nCellsX = nWidth;
+    strip.nCellsY = nHeight;
+    strip.extent.dMetersPerCell = im->extent.dMetersPerCell / im->nPixPerCell;
+
+    /* same fiddle as prepare_for_reading */
+    dPixelX = strip.extent.dMetersPerCell * 0.5;
+    dPixelY = strip.extent.dMetersPerCell;
+    strip.extent.dCentreX = im->extent.dCentreX + (nX + nWidth / 2.0 - im->w / 2.0) * dPixelX;
+    strip.extent.dCentreY = im->extent.dCentreY - (nY + nHeight / 2.0 - im->h / 2.0) * dPixelY;
+
+    if( gdal_read_image(file, &strip, overviewIndex, &strip.extent) < 0 )
+    {
+        return -1;
+    }
 
-    /* work out where we are from extent */
-    if( GDALGetGeoTransform(ds, adfTransform) != CE_None )
+    for( row = 0; row < nHeight; row++ )
     {
-        snprintf( szGDALMessages, GDAL_ERROR_SIZE, "Image has no geotransform" );
-        return 0;
+        memcpy(im->pixels + ((nY + row) * im->w + nX) * IMG_DEPTH, 
+               strip.pixels + row * nWidth * IMG_DEPTH, nWidth * IMG_DEPTH);
     }
+    frame_pool_release(strip.pixels);
+
+    return 0;
+}
 
-    /* Adjust pixel size for overview */
-    adfTransform[1] *= nFactor;
-    adfTransform[5] *= nFactor;
+/* Fast path for a pan. If im is the last image moved by whole pixels at */
+/* the same level the part they share is copied and only the strips that */
+/* have come into view are read. Returns 1 if im isn't a shift of last */
+int gdal_shift_image(struct gdalFile *file, struct image *last, struct image *im, int overviewIndex)
+{
+    double dX, dY, dStart;
+    int nShiftX, nShiftY, nFirstRow, nLastRow, nSrcX, nDstX, row;
 
-    if( !GDALInvGeoTransform(adfTransform, adfInvertTransform) )
+    if( (last == NULL) || (last->nCellsX != im->nCellsX) || (last->nCellsY != im->nCellsY) ||
+        (last->nPixPerCell != im->nPixPerCell) || 
+        (last->extent.dMetersPerCell != im->extent.dMetersPerCell) )
     {
-        snprintf( szGDALMessages, GDAL_ERROR_SIZE, "Unable to invert transform" );
-        return 0;
+        return 1;
     }
-    GDALApplyGeoTransform(adfInvertTransform, dTLX, dTLY, &x1, &y1);
-    GDALApplyGeoTransform(adfInvertTransform, dBRX, dBRY, &x2, &y2);
-    leftExtra = 0;
-    rightExtra = 0;
-    topExtra = 0;
-    bottomExtra = 0;
-    origWidthIn = round(x2 - x1);
-    origHeightIn = round(y2 - y1);
 
-    /* leftExtra etc in Units of pixels */
-    if( x1 < 0 )
+    /* how far it has moved in pixels. Same fiddle as prepare_for_reading */
+    dX = (im->extent.dCentreX - last->extent.dCentreX) / 
+            (im->extent.dMetersPerCell * 0.5 / im->nPixPerCell);
+    dY = (last->extent.dCentreY - im->extent.dCentreY) / 
+            (im->extent.dMetersPerCell / im->nPixPerCell);
+    nShiftX = (int)floor(dX + 0.5);
+    nShiftY = (int)floor(dY + 0.5);
+    if( (fabs(dX - nShiftX) > SHIFT_TOLERANCE) || (fabs(dY - nShiftY) > SHIFT_TOLERANCE) ||
+        (abs(nShiftX) >= (int)last->w) || (abs(nShiftY) >= (int)last->h) || 
+        ((nShiftX == 0) && (nShiftY == 0)) )
     {
-        leftExtra = abs(x1);
-        x1 = 0;
+        return 1;
     }
-    if( x2 >= width )
+
+    /* pixel x, y of im is x + nShiftX, y + nShiftY of last */
+    dStart = stage_start();
+    im->w = last->w;
+    im->h = last->h;
+    im->pixels = frame_pool_get(im->w * im->h * IMG_DEPTH);
+    nFirstRow = MAX(0, -nShiftY);
+    nLastRow = MIN((int)im->h, (int)im->h - nShiftY);
+    nSrcX = MAX(0, nShiftX);
+    nDstX = MAX(0, -nShiftX);
+    for( row = nFirstRow; row < nLastRow; row++ )
     {
-        rightExtra = (x2 - width - 1);
-        x2 = width - 1;
+        memcpy(im->pixels + (row * im->w + nDstX) * IMG_DEPTH,
+               last->pixels + ((row + nShiftY) * im->w + nSrcX) * IMG_DEPTH,
+               (im->w - abs(nShiftX)) * IMG_DEPTH);
     }
-    if( y1 < 0 )
+    stage_end(STAGE_INTERLEAVE, dStart);
+
+    /* rows that have come into view, all the way across */
+    if( (nShiftY != 0) && (gdal_read_strip(file, im, overviewIndex, 0, (nShiftY > 0) ? nLastRow : 0, 
+                im->w, abs(nShiftY)) < 0) )
     {
-        topExtra = abs(y1);
-        y1 = 0;
+        frame_pool_release(im->pixels);
+        return -1;
     }
-    if( y2 >= height )
+
+    /* then the columns beside the rows that were copied */
+    if( (nShiftX != 0) && (gdal_read_strip(file, im, overviewIndex, (nShiftX > 0) ? (int)im->w - nShiftX : 0, 
+                nFirstRow, abs(nShiftX), nLastRow - nFirstRow) < 0) )
     {
-        bottomExtra = (y2 - height - 1);
-        y2 = height - 1;
+        frame_pool_release(im->pixels);
+        return -1;
     }
-    widthIn = round(x2 - x1);
-    heightIn = round(y2 - y1);
-    tlx = x1;
-    tly = y1;
-    brx = tlx + widthIn;
-    bry = tly + heightIn;
-
-    /* leftExtra now in units of the data read */
-    leftExtra = (leftExtra / (double)origWidthIn) * dataWidth;
-    rightExtra = (rightExtra / (double)origWidthIn) * dataWidth;
-    topExtra = (topExtra / (double)origHeightIn) * dataHeight;
-    bottomExtra = (bottomExtra / (double)origHeightIn) * dataHeight;
-
-    info->nXOff = tlx;
-    info->nYOff = tly;
-    info->nXSize = widthIn;
-    info->nYSize = heightIn;
-    info->nDataOffset = leftExtra + (topExtra * dataWidth);
-    info->nBufXSize = dataWidth - leftExtra - rightExtra;
-    info->nBufYSize = dataHeight - topExtra - bottomExtra;
 
-    return 1;
+    return 0;
 }
 
-int gdal_read_multiband(GDALDatasetH ds,struct image *im,int overviewIndex, struct stretch *stretch, 
-        struct statisticsForBand *pStats, struct extent *extent)
+/* last is the previous image read, if any, so a pan can be done by shifting it */
+extern struct image * gdal_load_image(struct gdalFile *file, struct extent *extent, int nCellsX, int nCellsY,
+                int nPixPerCell, int overviewIndex, struct image *last)
 {
-    int count;
-    int incount, outcount;
-    float *pBuffer;
-    struct readInfo info;
-    GDALRasterBandH ovh;
+    struct image * im;
+    int nStatus;
 
-    /* fill in the width and height from the overview */
-    GDALRasterBandH bandh = GDALGetRasterBand(ds,stretch->bands[0]);
-    if( overviewIndex == 0 )
+    if( file->ds == NULL )
     {
-        ovh = bandh;
+        /* closed because of an earlier error - leave that message */
+        return NULL;
     }
-    else
+
+    /* reset error message buffer */
+    set_read_error("");
+
+    /* create our image structure */
+    im = CPLCalloc(1, sizeof(struct image));
+    im->extent = *extent;
+    im->nCellsX = nCellsX;
+    im->nCellsY = nCellsY;
+    im->nPixPerCell = nPixPerCell;
+
+    nStatus = gdal_shift_image(file, last, im, overviewIndex);
+    if( nStatus == 1 )
     {
-        ovh = GDALGetOverview(bandh,overviewIndex - 1);
+        nStatus = gdal_read_image(file, im, overviewIndex, extent);
     }
-    im->w = PIX_PER_CELL * ww;
-    im->h = PIX_PER_CELL * wh;
 
-    if( !prepare_for_reading(im->w, im->h, ds, ovh, extent, &info) )
+    if( nStatus == -1 )
     {
-        /* error should already be set */
-        return -1;
+        CPLFree(im);
+        /* trap error. Should have filled in message */
+        /* unless we were just superseded by a newer request */
+        if( !loader_cancelled() )
+        {
+            gdal_close_file(file);
+        }
+        return NULL;
     }
 
-    im->pixels = (char*)CPLCalloc(im->w * im->h, IMG_DEPTH);
-    pBuffer = (float*)CPLCalloc(im->w * im->h, sizeof(float));
+    return im;
+}
 
-    /* read in our 3 bands */
-    for( count = 0; count < 3; count++ )
+void gdal_unload_image(struct image * im)
+{
+    frame_pool_release(im->pixels);
+    /* created by the main loop once it has the image, so this is */
+    /* the main loop too. Kept for the next image of the same size */
+    if( im->dither != NULL )
     {
-        /* read in band interleaved by pixel */
-        /* Basically we make each line 3 times as long */
-        /* the first bixel is band[0], second is band[1] and third is band[2] */
-        /* and then back to band[0] etc. So we call RasterIO 3 times, one for */
-        /* each band and tell it to fill in every third pixel each time */
-        bandh = GDALGetRasterBand(ds,stretch->bands[count]);
-        if( overviewIndex == 0 )
-        {
-            ovh = bandh;
-        }
-        else
-        {
-            ovh = GDALGetOverview(bandh,overviewIndex - 1);
-        }
+        if( pSpareDither != NULL )
+            caca_free_dither(pSpareDither);
+        pSpareDither = im->dither;
+        nSpareDitherW = im->w;
+        nSpareDitherH = im->h;
+    }
+    CPLFree(im);
+}
 
-        if( GDALRasterIO( ovh, GF_Read, info.nXOff, info.nYOff, info.nXSize, info.nYSize,
-                      &pBuffer[info.nDataOffset], info.nBufXSize, info.nBufYSize,
-                      GDT_Float32, sizeof(float), im->w * sizeof(float) ) != CE_None )
-        {
-            CPLFree(im->pixels);
-            CPLFree(pBuffer);
-            snprintf( szGDALMessages, GDAL_ERROR_SIZE, "Unable to read file" );
-            return -1;
-        }
+/* A dither for an image of w by h, the spare one if it is that size. */
+/* Only called by the main loop */
+struct caca_dither *dither_get(unsigned int w, unsigned int h)
+{
+    struct caca_dither *dither;
+
+    if( (pSpareDither != NULL) && (nSpareDitherW == w) && (nSpareDitherH == h) )
+    {
+        dither = pSpareDither;
+        pSpareDither = NULL;
+        return dither;
+    }
+
+    return caca_create_dither(8 * IMG_DEPTH, w, h, IMG_DEPTH * w, RMASK, GMASK, BMASK, AMASK);
+}
+
+/* Pixels for an image of nBytes, reusing a buffer from a previous image */
+/* if one is free. Not zeroed */
+char *frame_pool_get(size_t nBytes)
+{
+    struct frameBuffer *pBuffer, *pBest = NULL;
+    char *pixels;
+    int n;
+
+    CPLCreateOrAcquireMutex(&framePool.hMutex, 1000.0);
+    for( n = 0; n < FRAME_POOL_SIZE; n++ )
+    {
+        pBuffer = &framePool.aBuffers[n];
+        if( pBuffer->bInUse )
+            continue;
 
-        if( do_stretch(pBuffer, bandh, &pStats[count], im->w * im->h, stretch) < 0 )
+        if( pBuffer->nBytes >= nBytes )
         {
-            CPLFree(im->pixels);
-            CPLFree(pBuffer);
-            return -1;
+            /* the smallest that is big enough */
+            if( (pBest == NULL) || (pBest->nBytes < nBytes) || (pBuffer->nBytes < pBest->nBytes) )
+                pBest = pBuffer;
         }
-
-        /* copy into our bil */
-        outcount = count;
-        for(incount = 0; incount < (im->w * im->h); incount++ )
+        else if( (pBest == NULL) || ((pBest->nBytes < nBytes) && (pBuffer->nBytes > pBest->nBytes)) )
         {
-            im->pixels[outcount] = pBuffer[incount];
-            outcount += IMG_DEPTH;
+            /* otherwise the biggest, to grow */
+            pBest = pBuffer;
         }
-
     }
 
-
-    /* Create the libcaca dither */
-    im->dither = caca_create_dither(8 * IMG_DEPTH, im->w, im->h, IMG_DEPTH * im->w,
-                                    RMASK, GMASK, BMASK, AMASK);
-    if(!im->dither)
+    if( pBest == NULL )
     {
-        CPLFree(im->pixels);
-        CPLFree(pBuffer);
-        snprintf( szGDALMessages, GDAL_ERROR_SIZE, "Unable to create dither" );
-        return -1;
+        /* all in use - one of its own */
+        CPLReleaseMutex(framePool.hMutex);
+        return (char*)CPLMalloc(nBytes);
     }
 
-    CPLFree(pBuffer);
+    if( pBest->nBytes < nBytes )
+    {
+        /* nothing to keep so no need to copy */
+        CPLFree(pBest->pixels);
+        pBest->pixels = (char*)CPLMalloc(nBytes);
+        pBest->nBytes = nBytes;
+    }
+    pBest->bInUse = TRUE;
+    pixels = pBest->pixels;
+    CPLReleaseMutex(framePool.hMutex);
 
-    return 0;
+    return pixels;
 }
 
-int gdal_read_singleband(GDALDatasetH ds,struct image *im,int overviewIndex, struct stretch *stretch, 
-    struct statisticsForBand *pStats, struct extent *extent)
+void frame_pool_release(char *pixels)
 {
-    /* Read a single band image */
-    int count, outcount, incount;
-    GDALRasterAttributeTableH rath;
-    float *pBuffer;
-    int *pRed = NULL, *pGreen = NULL, *pBlue = NULL;
-    GDALRATFieldUsage eUsage;
-    struct readInfo info;
-    GDALRasterBandH ovh;
+    int n;
 
-    /* fill in the width and height from the overview */
-    GDALRasterBandH bandh = GDALGetRasterBand(ds,stretch->bands[0]);
-    if( overviewIndex == 0 )
-    {
-        ovh = bandh;
-    }
-    else
+    CPLCreateOrAcquireMutex(&framePool.hMutex, 1000.0);
+    for( n = 0; n < FRAME_POOL_SIZE; n++ )
     {
-        ovh = GDALGetOverview(bandh,overviewIndex - 1);
+        if( framePool.aBuffers[n].bInUse && (framePool.aBuffers[n].pixels == pixels) )
+        {
+            framePool.aBuffers[n].bInUse = FALSE;
+            CPLReleaseMutex(framePool.hMutex);
+            return;
+        }
     }
-    im->w = GDALGetRasterBandXSize(ovh);
-    im->h = GDALGetRasterBandYSize(ovh);
+    CPLReleaseMutex(framePool.hMutex);
+
+    /* not from the pool */
+    CPLFree(pixels);
+}
 
-    im->w = PIX_PER_CELL * ww;
-    im->h = PIX_PER_CELL * wh;
+/* Frees the buffers that aren't in use, and the spare dither */
+void frame_pool_trim(void)
+{
+    int n;
 
-    if( !prepare_for_reading(im->w, im->h, ds, ovh, extent, &info) )
+    CPLCreateOrAcquireMutex(&framePool.hMutex, 1000.0);
+    for( n = 0; n < FRAME_POOL_SIZE; n++ )
     {
-        /* error should already be set */
-        return -1;
+        if( !framePool.aBuffers[n].bInUse )
+        {
+            CPLFree(framePool.aBuffers[n].pixels);
+            framePool.aBuffers[n].pixels = NULL;
+            framePool.aBuffers[n].nBytes = 0;
+        }
     }
+    CPLReleaseMutex(framePool.hMutex);
 
-    im->pixels = (char*)CPLCalloc(im->w * im->h, IMG_DEPTH);
-    pBuffer = (float*)CPLCalloc(im->w * im->h, sizeof(float));
+    if( pSpareDither != NULL )
+    {
+        caca_free_dither(pSpareDither);
+        pSpareDither = NULL;
+    }
+}
 
-    if( GDALRasterIO( ovh, GF_Read, info.nXOff, info.nYOff, info.nXSize, info.nYSize,
-                  &pBuffer[info.nDataOffset], info.nBufXSize, info.nBufYSize,
-                  GDT_Float32, sizeof(float), im->w * sizeof(float) ) != CE_None )
+/* Keeps a copy of the pixels of im (owned by the main loop once published) */
+/* for the next load to shift. NULL just forgets the last one */
+void loader_keep_image(struct image *im)
+{
+    if( loader.last != NULL )
     {
-        CPLFree(im->pixels);
-        CPLFree(pBuffer);
-        snprintf( szGDALMessages, GDAL_ERROR_SIZE, "Unable to read file" );
-        return -1;
+        gdal_unload_image(loader.last);
+        loader.last = NULL;
     }
 
-    if( do_stretch(pBuffer, bandh, &pStats[0], im->w * im->h, stretch) < 0 )
+    if( im != NULL )
     {
-        CPLFree(im->pixels);
-        CPLFree(pBuffer);
-        return -1;
+        loader.last = (struct image*)CPLMalloc(sizeof(struct image));
+        *loader.last = *im;
+        loader.last->dither = NULL;
+        loader.last->pixels = frame_pool_get(im->w * im->h * IMG_DEPTH);
+        memcpy(loader.last->pixels, im->pixels, im->w * im->h * IMG_DEPTH);
     }
+}
 
-    if( stretch->mode == VIEWER_MODE_COLORTABLE )
+/* Worker thread that does the reading. Always works on the latest request */
+/* and publishes the image for the main loop to pick up */
+void loader_thread(void *pData)
+{
+    struct extent extent;
+    int nCellsX, nCellsY, nPixPerCell, nRequest, overviewIndex, previewIndex;
+    double dStart;
+    struct image *newIm;
+
+    CPLAcquireMutex(loader.hMutex, 1000.0);
+    while( !loader.bQuit )
     {
-        /* Need to grab the RAT and read the colour columns */
-        /* can't do the caca_set_dither_palette call since that is limited to 256 classes */
-        rath = GDALGetDefaultRAT(bandh);
-        if( rath == NULL )
+        if( loader.nStarted == loader.nRequest )
         {
-            CPLFree(im->pixels);
-            CPLFree(pBuffer);
-            snprintf( szGDALMessages, GDAL_ERROR_SIZE, "Unable to Raster Attribute Table" );
-            return -1;
+            if( loader.bStatsPending )
+            {
+                /* idle - put in the stretch that was put off or */
+                /* replace the estimated statistics */
+                int nStatus;
+                double dStart;
+                CPLReleaseMutex(loader.hMutex);
+
+                dStart = stage_start();
+                nStatus = gdal_update_statistics(loader.file);
+                stage_end(STAGE_STATISTICS, dStart);
+
+                if( nStatus == 1 )
+                {
+                    /* it was stretched with the estimates */
+                    loader_keep_image(NULL);
+                }
+
+                CPLAcquireMutex(loader.hMutex, 1000.0);
+                if( nStatus == 1 )
+                {
+                    /* the new stretch may have estimates of its own */
+                    loader.bStatsPending = loader.file->bStatsEstimated || 
+                                (loader.file->pPendingStretch != NULL);
+                    loader.bStatsUpdated = 1;
+                }
+                else if( nStatus == -1 )
+                {
+                    /* on failure stay with the estimates */
+                    loader.bStatsPending = 0;
+                }
+                continue;
+            }
+
+            if( bPrefetch && (tileCache.nMaxBytes > 0) && 
+                    (loader.nPrefetched != loader.nStarted) )
+            {
+                /* idle - get what the next pan or zoom will want */
+                loader.nPrefetched = loader.nStarted;
+                extent = loader.extent;
+                nCellsX = loader.nCellsX;
+                nCellsY = loader.nCellsY;
+                nPixPerCell = loader.nPixPerCell;
+                CPLReleaseMutex(loader.hMutex);
+
+                if( loader.file->ds != NULL )
+                {
+                    gdal_prefetch(loader.file, &extent, nCellsX, nCellsY, nPixPerCell);
+                }
+
+                CPLAcquireMutex(loader.hMutex, 1000.0);
+                continue;
+            }
+
+            /* nothing to do */
+            CPLCondWait(loader.hCond, loader.hMutex);
+            continue;
+        }
+
+        extent = loader.extent;
+        nCellsX = loader.nCellsX;
+        nCellsY = loader.nCellsY;
+        nPixPerCell = loader.nPixPerCell;
+        nRequest = loader.nRequest;
+        loader.nStarted = nRequest;
+        CPLReleaseMutex(loader.hMutex);
+
+        if( loader.file->ds == NULL )
+        {
+            /* closed because of an earlier error */
+            CPLAcquireMutex(loader.hMutex, 1000.0);
+            loader.result = NULL;
+            loader.nResult = nRequest;
+            loader.bPreview = 0;
+            loader.bResultReady = 1;
+            continue;
+        }
+
+        dStart = stage_start();
+        overviewIndex = gdal_get_best_overview(loader.file, &extent, nCellsX, nCellsY, nPixPerCell);
+
+        /* nothing at this level to shift - put something coarse up first */
+        previewIndex = -1;
+        if( (loader.last == NULL) || (loader.last->nCellsX != nCellsX) || 
+                (loader.last->nCellsY != nCellsY) || (loader.last->nPixPerCell != nPixPerCell) ||
+                (loader.last->extent.dMetersPerCell != extent.dMetersPerCell) )
+        {
+            previewIndex = gdal_get_preview_overview(loader.file, &extent, overviewIndex);
+        }
+        if( (previewIndex != -1) && 
+                gdal_is_cached(loader.file, overviewIndex, &extent, nCellsX, nCellsY, nPixPerCell) )
+        {
+            /* the real thing will be along straight away */
+            previewIndex = -1;
         }
+        stage_end(STAGE_OVERVIEW, dStart);
 
-        incount = GDALRATGetRowCount(rath);
-        for( count = 0; count < GDALRATGetColumnCount(rath); count++)
+        if( previewIndex != -1 )
         {
-            eUsage = GDALRATGetUsageOfCol(rath, count);
-            if( eUsage == GFU_Red )
+            newIm = gdal_load_image(loader.file, &extent, nCellsX, nCellsY, 1, previewIndex, NULL);
+
+            CPLAcquireMutex(loader.hMutex, 1000.0);
+            if( (newIm != NULL) && (nRequest == loader.nRequest) )
             {
-                pRed = (int*)CPLMalloc(incount * sizeof(int));
-                GDALRATValuesIOAsInteger(rath, GF_Read, count, 0, incount, pRed);
+                if( loader.result != NULL )
+                {
+                    gdal_unload_image(loader.result);
+                }
+                loader.result = newIm;
+                loader.nResult = nRequest;
+                loader.bPreview = 1;
+                loader.bResultReady = 1;
             }
-            else if( eUsage == GFU_Green )
+            else if( nRequest != loader.nRequest )
             {
-                pGreen = (int*)CPLMalloc(incount * sizeof(int));
-                GDALRATValuesIOAsInteger(rath, GF_Read, count, 0, incount, pGreen);
+                /* superseded - go straight on to the new request */
+                if( newIm != NULL )
+                {
+                    gdal_unload_image(newIm);
+                }
+                continue;
             }
-            else if( eUsage == GFU_Blue )
+            else
             {
-                pBlue = (int*)CPLMalloc(incount * sizeof(int));
-                GDALRATValuesIOAsInteger(rath, GF_Read, count, 0, incount, pGreen);
+                /* failed - report it rather than trying again */
+                loader.result = NULL;
+                loader.nResult = nRequest;
+                loader.bPreview = 0;
+                loader.bResultReady = 1;
+                continue;
             }
+            CPLReleaseMutex(loader.hMutex);
         }
 
-        /* Did we get all the columns? */
-        if( (pRed == NULL) || (pGreen == NULL) || (pBlue == NULL) )
+        newIm = gdal_load_image(loader.file, &extent, nCellsX, nCellsY, nPixPerCell, 
+                    overviewIndex, loader.last);
+        if( newIm != NULL )
         {
-            CPLFree(im->pixels);
-            CPLFree(pBuffer);
-            snprintf( szGDALMessages, GDAL_ERROR_SIZE, "Unable to find Red, Green and Blue columns" );
-            return -1;
+            loader_keep_image(newIm);
         }
 
-        /* look up the colours and put into our bil */
-        outcount = 0;
-        for(incount = 0; incount < (im->w * im->h); incount++ )
+        CPLAcquireMutex(loader.hMutex, 1000.0);
+        /* a finished image is still closer to what is wanted than */
+        /* the one being displayed even if it has been superseded */
+        if( (newIm != NULL) || (nRequest == loader.nRequest) )
         {
-            im->pixels[outcount] = pRed[(int)pBuffer[incount]];
-            outcount++;
-            im->pixels[outcount] = pGreen[(int)pBuffer[incount]];
-            outcount++;
-            im->pixels[outcount] = pBlue[(int)pBuffer[incount]];
-            outcount++;
+            if( loader.result != NULL )
+            {
+                /* main loop never got to this one */
+                gdal_unload_image(loader.result);
+            }
+            loader.result = newIm;
+            loader.nResult = nRequest;
+            loader.bPreview = 0;
+            loader.bResultReady = 1;
         }
+    }
+    CPLReleaseMutex(loader.hMutex);
+}
 
-        CPLFree(pRed);
-        CPLFree(pGreen);
-        CPLFree(pBlue);
+void loader_start(struct gdalFile *file)
+{
+    loader.hMutex = CPLCreateMutex();
+    /* created locked */
+    CPLReleaseMutex(loader.hMutex);
+    loader.hCond = CPLCreateCond();
+    loader.file = file;
+    loader.bQuit = 0;
+    loader.nRequest = 0;
+    loader.nStarted = 0;
+    loader.nPrefetched = 0;
+    loader.last = NULL;
+    loader.bStatsPending = file->bStatsEstimated || (file->pPendingStretch != NULL);
+    loader.bStatsUpdated = 0;
+    loader.nResult = 0;
+    loader.bPreview = 0;
+    loader.bResultReady = 0;
+    loader.result = NULL;
+    loader.bRunning = 1;
+    read_pool_start(file->pszFilename, nReadThreads);
+    loader.hThread = CPLCreateJoinableThread(loader_thread, NULL);
+}
 
-    }
-    else if( stretch->mode == VIEWER_MODE_GREYSCALE )
-    {
-        /* copy into our bil and repeat the colours */
-        outcount = 0;
-        for(incount = 0; incount < (im->w * im->h); incount++ )
-        {
-            im->pixels[outcount] = pBuffer[incount];
-            outcount++;
-            im->pixels[outcount] = pBuffer[incount];
-            outcount++;
-            im->pixels[outcount] = pBuffer[incount];
-            outcount++;
-        }
+void loader_stop(void)
+{
+    if( !loader.bRunning )
+        return;
 
-    }
-    else
-    {
-        snprintf( szGDALMessages, GDAL_ERROR_SIZE, "Unsupported stretch");
-        CPLFree(im->pixels);
-        CPLFree(pBuffer);
-        return -1;
-    }
+    CPLAcquireMutex(loader.hMutex, 1000.0);
+    loader.bQuit = 1;
+    CPLCondSignal(loader.hCond);
+    CPLReleaseMutex(loader.hMutex);
+    CPLJoinThread(loader.hThread);
+    read_pool_stop();
+    loader_keep_image(NULL);
+
+    if( loader.result != NULL )
+        gdal_unload_image(loader.result);
+    CPLDestroyCond(loader.hCond);
+    CPLDestroyMutex(loader.hMutex);
+    loader.bRunning = 0;
+}
+
+/* ask for a new image. Supersedes any previous request */
+void loader_request(struct extent *extent, int nCellsX, int nCellsY, int nPixPerCell)
+{
+    CPLAcquireMutex(loader.hMutex, 1000.0);
+    loader.extent = *extent;
+    loader.nCellsX = nCellsX;
+    loader.nCellsY = nCellsY;
+    loader.nPixPerCell = nPixPerCell;
+    loader.nRequest++;
+    CPLCondSignal(loader.hCond);
+    CPLReleaseMutex(loader.hMutex);
+}
 
-    /* Create the libcaca dither */
-    im->dither = caca_create_dither(8 * IMG_DEPTH, im->w, im->h, IMG_DEPTH * im->w,
-                                    RMASK, GMASK, BMASK, AMASK);
-    if(!im->dither)
+/* returns TRUE and sets *ppIm if an image (or NULL on failure) is ready. */
+/* *pbPending is set to whether we are still waiting on the latest request */
+int loader_get_result(struct image **ppIm, int *pbPending)
+{
+    int bReady;
+
+    CPLAcquireMutex(loader.hMutex, 1000.0);
+    bReady = loader.bResultReady;
+    if( bReady )
     {
-        CPLFree(im->pixels);
-        CPLFree(pBuffer);
-        snprintf( szGDALMessages, GDAL_ERROR_SIZE, "Unable to create dither" );
-        return -1;
+        *ppIm = loader.result;
+        loader.result = NULL;
+        loader.bResultReady = 0;
     }
+    *pbPending = (loader.nResult != loader.nRequest) || loader.bPreview;
+    CPLReleaseMutex(loader.hMutex);
 
+    return bReady;
+}
 
-    CPLFree(pBuffer);
+/* returns TRUE once after the loader has replaced estimated statistics. */
+/* *pbPending is set to whether it still has to */
+int loader_stats_updated(int *pbPending)
+{
+    int bUpdated;
 
-    return 0;
+    CPLAcquireMutex(loader.hMutex, 1000.0);
+    bUpdated = loader.bStatsUpdated;
+    loader.bStatsUpdated = 0;
+    *pbPending = loader.bStatsPending;
+    CPLReleaseMutex(loader.hMutex);
+
+    return bUpdated;
 }
 
-/* returns a newly malloced string describing the stretch */
-char *get_stretch_as_string(struct stretch *stretch)
+/* called by the reading code to see if it should give up */
+/* because a newer request has arrived */
+int loader_cancelled(void)
 {
-    char szMode[GDAL_ERROR_SIZE], *pszStr;
-    char szStretchMode[GDAL_ERROR_SIZE];
+    int bCancelled = FALSE;
 
-    szMode[0] = '\0';
-    if( stretch->mode == VIEWER_MODE_COLORTABLE )
-        snprintf(szMode, GDAL_ERROR_SIZE, "Color Table %d", stretch->bands[0]);
-    else if( stretch->mode == VIEWER_MODE_GREYSCALE )
-        snprintf(szMode, GDAL_ERROR_SIZE, "GreyScale %d", stretch->bands[0]);
-    else if( stretch->mode == VIEWER_MODE_RGB )
-        snprintf(szMode, GDAL_ERROR_SIZE, "RGB %d %d %d", stretch->bands[0],
-                 stretch->bands[1], stretch->bands[2]);
-    else if( stretch->mode == VIEWER_MODE_PSEUDOCOLOR )
-        snprintf(szMode, GDAL_ERROR_SIZE, "PseudoColor %d", stretch->bands[0]);
+    if( loader.bRunning )
+    {
+        CPLAcquireMutex(loader.hMutex, 1000.0);
+        bCancelled = loader.bQuit || (loader.nStarted != loader.nRequest);
+        CPLReleaseMutex(loader.hMutex);
+    }
 
-    szStretchMode[0] = '\0';
-    if( stretch->stretchmode == VIEWER_STRETCHMODE_NONE )
-        snprintf(szStretchMode, GDAL_ERROR_SIZE, " No Stretch");
-    else if( stretch->stretchmode == VIEWER_STRETCHMODE_LINEAR )
-        snprintf(szStretchMode, GDAL_ERROR_SIZE, " Linear Stretch %.2f - %.2f",
-                 stretch->stretchparam[0], stretch->stretchparam[1]);
-    else if( stretch->stretchmode == VIEWER_STRETCHMODE_STDDEV )
-        snprintf(szStretchMode, GDAL_ERROR_SIZE, " Standard Deviation %.2f", stretch->stretchparam[0]);
+    return bCancelled;
+}
 
-    pszStr = CPLMalloc(strlen(szMode) + strlen(szStretchMode) + 1);
-    strcpy(pszStr, szMode);
-    strcat(pszStr, szStretchMode);
-    return pszStr;
+/* progress function for GDALRasterIOEx so a read can be stopped */
+int loader_progress(double dfComplete, const char *pszMessage, void *pData)
+{
+    return !loader_cancelled();
 }
 
-int getStatistics(GDALDatasetH ds, int band, struct statisticsForBand *pStats)
+/* Worker for the read pool. Takes jobs from the current batch, */
+/* or leaves them all to the others if it can't open the file */
+void read_pool_thread(void *pData)
 {
-    const char *pszMin, *pszMax, *pszStdDev, *pszMean;
-    int nOverviews, index, xsize, ysize;
-    GDALRasterBandH overviewh;
-    GDALRasterBandH bandh = GDALGetRasterBand(ds, band);
+    GDALDatasetH ds;
+    int nJob;
 
-    pszMin = GDALGetMetadataItem(bandh, "STATISTICS_MINIMUM", NULL);
-    pszMax = GDALGetMetadataItem(bandh, "STATISTICS_MAXIMUM", NULL);
-    pszStdDev = GDALGetMetadataItem(bandh, "STATISTICS_STDDEV", NULL);
-    pszMean = GDALGetMetadataItem(bandh, "STATISTICS_MEAN", NULL);
-    if( (pszMin == NULL ) || (pszMax == NULL) || (pszStdDev == NULL) || (pszMean == NULL ) )
+    (void)pData;
+    ds = GDALOpen(readPool.pszFilename, GA_ReadOnly);
+    if( ds == NULL )
+        return;
+
+    CPLAcquireMutex(readPool.hMutex, 1000.0);
+    while( !readPool.bQuit )
     {
-        /* No Stats - get overview and use that */
-        nOverviews = GDALGetOverviewCount(bandh);
-        for( index = 0; index < nOverviews; index++ )
+        if( readPool.nNextJob >= readPool.nJobs )
         {
-            overviewh = GDALGetOverview(bandh, index);
-            xsize = GDALGetRasterBandXSize(overviewh);
-            ysize = GDALGetRasterBandYSize(overviewh);
-            if( (xsize > MIN_OVERVIEW_STATS) && (xsize < MAX_OVERVIEW_STATS) &&
-                (ysize > MIN_OVERVIEW_STATS) && (ysize < MAX_OVERVIEW_STATS) )
-            {
-                if( GDALComputeRasterStatistics(overviewh, TRUE, &pStats->dMin, &pStats->dMax,
-                        &pStats->dMean, &pStats->dStdDev, NULL, NULL) == CE_None)
-                {
-                    return TRUE;
-                }
-            }
+            CPLCondWait(readPool.hWorkCond, readPool.hMutex);
+            continue;
         }
 
-        /* No valid overviews - estimate on whole band */
-        if( GDALComputeRasterStatistics(bandh, TRUE, &pStats->dMin, &pStats->dMax,
-                        &pStats->dMean, &pStats->dStdDev, NULL, NULL) == CE_None)
-        {
-            return TRUE;
-        }
-        else 
-        {
-            return FALSE;
-        }
+        nJob = readPool.nNextJob++;
+        CPLReleaseMutex(readPool.hMutex);
+
+        readPool.pfnJob(ds, nJob, readPool.pJobData);
+
+        CPLAcquireMutex(readPool.hMutex, 1000.0);
+        readPool.nJobsDone++;
+        if( readPool.nJobsDone == readPool.nJobs )
+            CPLCondSignal(readPool.hDoneCond);
     }
-    else
+    CPLReleaseMutex(readPool.hMutex);
+
+    gdal_close_band_mappings(ds);
+    GDALClose(ds);
+}
+
+/* nThreads includes the loader thread. 0 is one per CPU */
+void read_pool_start(const char *pszFilename, int nThreads)
+{
+    int n;
+
+    if( nThreads <= 0 )
+        nThreads = CPLGetNumCPUs();
+    nThreads = MAX(1, MIN(nThreads, MAX_READ_THREADS));
+
+    readPool.hMutex = CPLCreateMutex();
+    /* created locked */
+    CPLReleaseMutex(readPool.hMutex);
+    readPool.hWorkCond = CPLCreateCond();
+    readPool.hDoneCond = CPLCreateCond();
+    readPool.bQuit = 0;
+    readPool.nJobs = 0;
+    readPool.nNextJob = 0;
+    readPool.nJobsDone = 0;
+    readPool.pszFilename = CPLStrdup(pszFilename);
+
+    /* the loader thread itself is the first */
+    readPool.nThreads = 1;
+    for( n = 1; n < nThreads; n++ )
     {
-        /* convert from strings */
-        pStats->dMin = atof(pszMin);
-        pStats->dMax = atof(pszMax);
-        pStats->dMean = atof(pszMean);
-        pStats->dStdDev = atof(pszStdDev);
-        return TRUE;
+        readPool.ahThread[n] = CPLCreateJoinableThread(read_pool_thread, NULL);
+        if( readPool.ahThread[n] == NULL )
+            break;
+        readPool.nThreads++;
     }
 }
 
-/* pCmdStretch non-NULL if they have passed in a stretch on the command line */
-int gdal_open_file(char const *pszFile, struct gdalFile *file, struct stretchlist *stretchList,
-                   struct stretch *pCmdStretch)
+void read_pool_stop(void)
 {
-    int xsize, ysize, count;
+    int n;
 
-    /* reset error message buffer */
-    szGDALMessages[0] = '\0';
+    if( readPool.hMutex == NULL )
+        return;
 
-    /* attempt to open with GDAL */
-    file->ds = GDALOpen(pszFile, GA_ReadOnly);
-    if( file->ds == NULL )
-    {
-        CPLFree(im);
-        snprintf( szGDALMessages, GDAL_ERROR_SIZE, "Could not open %s with GDAL", pszFile );
-        return 0;
-    }
+    CPLAcquireMutex(readPool.hMutex, 1000.0);
+    readPool.bQuit = 1;
+    CPLCondBroadcast(readPool.hWorkCond);
+    CPLReleaseMutex(readPool.hMutex);
 
-    /* get the stretch */
-    if( pCmdStretch != NULL )
-    {
-        file->stretch = pCmdStretch;
-    }
-    else
+    for( n = 1; n < readPool.nThreads; n++ )
     {
-        file->stretch = get_stretch_for_gdal(stretchList, file->ds);
-        if( file->stretch == NULL )
-        {
-            gdal_close_file(file);
-            snprintf( szGDALMessages, GDAL_ERROR_SIZE, "Could not find stretch to use for %s", pszFile);
-            return 0;
-        }
+        CPLJoinThread(readPool.ahThread[n]);
     }
+    CPLFree(readPool.pszFilename);
+    readPool.pszFilename = NULL;
+
+    CPLDestroyCond(readPool.hWorkCond);
+    CPLDestroyCond(readPool.hDoneCond);
+    CPLDestroyMutex(readPool.hMutex);
+    readPool.hMutex = NULL;
+    readPool.nThreads = 0;
+}
 
-    /* Get statistics */
-    if( file->stretch->mode == VIEWER_MODE_GREYSCALE )
-    {
-        if( !getStatistics(file->ds, file->stretch->bands[0], 
-                &file->statsForStretchBands[0]) )
-        {
-            gdal_close_file(file);
-            snprintf( szGDALMessages, GDAL_ERROR_SIZE, "Could not get statistics for %s", pszFile );
-            return 0;
-        }
-    }
-    else if( file->stretch->mode == VIEWER_MODE_RGB )
-    {
-        for( count = 0; count < 3; count++ ) 
-        {
-            if( !getStatistics(file->ds, file->stretch->bands[count],
-                &file->statsForStretchBands[count]) ) 
-            {
-                gdal_close_file(file);
-                snprintf( szGDALMessages, GDAL_ERROR_SIZE, "Could not get statistics for %s", pszFile );
-                return 0;
-            }
-        }
-    }
-    /* else not needed for colour table or pseudocolour */
+/* Runs pfnJob for jobs 0 to nJobs-1 across the pool and waits for them all. */
+/* The calling thread joins in using ds */
+void read_pool_run(int nJobs, void (*pfnJob)(GDALDatasetH, int, void *), void *pData, GDALDatasetH ds)
+{
+    int nJob;
 
-    /* status string */
-    if(pszStretchStatusString != NULL)
+    if( readPool.nThreads <= 1 )
     {
-        CPLFree(pszStretchStatusString);
+        for( nJob = 0; nJob < nJobs; nJob++ )
+            pfnJob(ds, nJob, pData);
+        return;
     }
-    pszStretchStatusString = get_stretch_as_string(file->stretch);
 
-    /* get full extent */
-    if( GDALGetGeoTransform(file->ds, file->adfTransform) != CE_None )
+    CPLAcquireMutex(readPool.hMutex, 1000.0);
+    readPool.pfnJob = pfnJob;
+    readPool.pJobData = pData;
+    readPool.nJobs = nJobs;
+    readPool.nNextJob = 0;
+    readPool.nJobsDone = 0;
+    CPLCondBroadcast(readPool.hWorkCond);
+
+    while( readPool.nNextJob < readPool.nJobs )
     {
-        gdal_close_file(file);
-        snprintf( szGDALMessages, GDAL_ERROR_SIZE, "No Geo Transform");
-        return 0;
+        nJob = readPool.nNextJob++;
+        CPLReleaseMutex(readPool.hMutex);
+
+        pfnJob(ds, nJob, pData);
+
+        CPLAcquireMutex(readPool.hMutex, 1000.0);
+        readPool.nJobsDone++;
     }
 
-    xsize = GDALGetRasterXSize(file->ds);
-    ysize = GDALGetRasterYSize(file->ds);
+    while( readPool.nJobsDone < readPool.nJobs )
+        CPLCondWait(readPool.hDoneCond, readPool.hMutex);
 
-    file->fullExtent.dCentreX = file->adfTransform[0] + file->adfTransform[1] * (xsize / 2);
-    file->fullExtent.dCentreY = file->adfTransform[3] + file->adfTransform[5] * (ysize / 2);
-    file->fullExtent.dMetersPerCell = MAX((file->adfTransform[1] * xsize) / ww,
-                                          (-file->adfTransform[5] * ysize) / wh);
+    /* so the workers go back to waiting */
+    readPool.nJobs = 0;
+    readPool.nNextJob = 0;
+    CPLReleaseMutex(readPool.hMutex);
+}
 
-    return 1;
+/* progress function for GDALBuildOverviews so the status line can show */
+/* how far it has got, and so it can be stopped */
+int overview_build_progress(double dfComplete, const char *pszMessage, void *pProgressArg)
+{
+    int bCancel;
+
+    (void)pszMessage;
+    (void)pProgressArg;
+    CPLAcquireMutex(overviewBuild.hMutex, 1000.0);
+    overviewBuild.dProgress = dfComplete;
+    bCancel = overviewBuild.bCancel;
+    CPLReleaseMutex(overviewBuild.hMutex);
+
+    return !bCancel;
 }
 
-void gdal_close_file(struct gdalFile* file)
+/* The overview file GDAL uses for hDS opened from pszFilename: the .ovr */
+/* next to it, or the one it has been given in GDAL_PAM_PROXY_DIR if that */
+/* couldn't be written. To be freed */
+char *overview_get_file(GDALDatasetH hDS, const char *pszFilename)
 {
-    GDALClose(file->ds);
-    file->ds = NULL;
+    const char *pszFile = GDALGetMetadataItem(hDS, "OVERVIEW_FILE", "OVERVIEWS");
+
+    if( pszFile == NULL )
+        return CPLStrdup(CPLSPrintf("%s.ovr", pszFilename));
+    if( EQUALN(pszFile, ":::BASE:::", 10) )
+        return CPLStrdup(CPLFormFilename(CPLGetPath(pszFilename), pszFile + 10, NULL));
+    return CPLStrdup(pszFile);
 }
 
-extern struct image * gdal_load_image(struct gdalFile *file, struct extent *extent)
+/* Builds the overviews of pszFilename on a handle of its own. Any */
+/* that were partly written before a failure are removed, wherever */
+/* GDAL put them */
+int overview_build_file(const char *pszFilename)
 {
-    struct image * im;
-    int overviewIndex;
+    GDALDatasetH hDS;
+    VSIStatBufL sStat;
+    int anLevels[MAX_OVERVIEW_LEVELS];
+    int nLevels = 0, nFactor, nSize, bExisted;
+    CPLErr eErr;
+    char *pszOverviewFile, *pszWritten;
+
+    hDS = GDALOpen(pszFilename, GA_ReadOnly);
+    if( hDS == NULL )
+        return FALSE;
+    pszOverviewFile = overview_get_file(hDS, pszFilename);
+    bExisted = (VSIStatL(pszOverviewFile, &sStat) == 0);
+
+    /* halving until the next would be smaller than OVERVIEW_MIN_SIZE */
+    nSize = MAX(GDALGetRasterXSize(hDS), GDALGetRasterYSize(hDS));
+    for( nFactor = 2; ((nSize / nFactor) >= OVERVIEW_MIN_SIZE) && (nLevels < MAX_OVERVIEW_LEVELS); 
+            nFactor *= 2 )
+    {
+        anLevels[nLevels++] = nFactor;
+    }
 
-    /* reset error message buffer */
-    szGDALMessages[0] = '\0';
+    /* opened read only GDAL puts them in a .ovr file */
+    eErr = GDALBuildOverviews(hDS, OVERVIEW_RESAMPLING, nLevels, anLevels, 0, NULL, 
+                overview_build_progress, NULL);
+    /* it only knows it is going in the proxy directory once it has started */
+    pszWritten = overview_get_file(hDS, pszFilename);
+    GDALClose(hDS);
+
+    if( (eErr != CE_None) && (!bExisted || (strcmp(pszWritten, pszOverviewFile) != 0)) )
+        VSIUnlink(pszWritten);
+    CPLFree(pszOverviewFile);
+    CPLFree(pszWritten);
+    return eErr == CE_None;
+}
 
-    /* create our image structure */
-    im = CPLMalloc(sizeof(struct image));
+void overview_build_thread(void *pData)
+{
+    int bOK;
+
+    (void)pData;
+    CPLPushErrorHandler(CPLQuietErrorHandler);
+    bOK = overview_build_file(overviewBuild.pszFilename);
+    CPLPopErrorHandler();
 
-    /* Find the best overview level to use */
-    overviewIndex = gdal_get_best_overview(file->ds, extent);
+    CPLAcquireMutex(overviewBuild.hMutex, 1000.0);
+    overviewBuild.nState = bOK ? OVERVIEW_BUILD_DONE : OVERVIEW_BUILD_FAILED;
+    CPLReleaseMutex(overviewBuild.hMutex);
+}
 
-    if( file->stretch->mode == VIEWER_MODE_RGB )
+/* Starts building overviews for the file if --buildovr was given, it */
+/* doesn't have any and is big enough to need them */
+int overview_build_start(struct gdalFile *file)
+{
+    if( !bBuildOverviews || (overviewBuild.nState != OVERVIEW_BUILD_NONE) || 
+            EQUALN(file->pszFilename, "/vsi", 4) || (file->nPyramidBands == 0) ||
+            (file->pasPyramids[0].nLevels > 1) ||
+            ((MAX(GDALGetRasterXSize(file->ds), GDALGetRasterYSize(file->ds)) / 2) < OVERVIEW_MIN_SIZE) )
     {
-        if( gdal_read_multiband(file->ds,im,overviewIndex, file->stretch, 
-                file->statsForStretchBands, extent) == -1 )
-        {
-            /* trap error. Should have filled in message */
-            CPLFree(im);
-            gdal_close_file(file);
-            return NULL;
-        }
+        return FALSE;
     }
-    else
+
+    overviewBuild.hMutex = CPLCreateMutex();
+    /* created locked */
+    CPLReleaseMutex(overviewBuild.hMutex);
+    overviewBuild.pszFilename = CPLStrdup(file->pszFilename);
+    overviewBuild.dProgress = 0;
+    overviewBuild.bCancel = FALSE;
+    overviewBuild.nState = OVERVIEW_BUILD_RUNNING;
+    overviewBuild.hThread = CPLCreateJoinableThread(overview_build_thread, NULL);
+    return TRUE;
+}
+
+/* Returns one of OVERVIEW_BUILD_* and how far it has got if it is running. */
+/* Once it is done or has failed, it has finished with the file. */
+int overview_build_poll(double *pdProgress)
+{
+    int nState;
+
+    if( overviewBuild.hMutex == NULL )
+        return overviewBuild.nState;
+
+    CPLAcquireMutex(overviewBuild.hMutex, 1000.0);
+    nState = overviewBuild.nState;
+    *pdProgress = overviewBuild.dProgress;
+    CPLReleaseMutex(overviewBuild.hMutex);
+
+    if( nState != OVERVIEW_BUILD_RUNNING )
     {
-        if( gdal_read_singleband(file->ds,im,overviewIndex, file->stretch, 
-                file->statsForStretchBands, extent) == -1 )
-        {
-            /* trap error. Should have filled in message */
-            CPLFree(im);
-            gdal_close_file(file);
-            return NULL;
-        }
+        /* the thread is on its way out */
+        overview_build_stop();
+        overviewBuild.nState = nState;
     }
-
-    return im;
+    return nState;
 }
 
-void gdal_unload_image(struct image * im)
+/* Gives up on any build still going */
+void overview_build_stop(void)
 {
-    CPLFree(im->pixels);
-    caca_free_dither(im->dither);
-    CPLFree(im);
-    /* reset error message buffer */
-    szGDALMessages[0] = '\0';
+    if( overviewBuild.hMutex == NULL )
+        return;
+
+    CPLAcquireMutex(overviewBuild.hMutex, 1000.0);
+    overviewBuild.bCancel = TRUE;
+    CPLReleaseMutex(overviewBuild.hMutex);
+    CPLJoinThread(overviewBuild.hThread);
 
+    CPLDestroyMutex(overviewBuild.hMutex);
+    overviewBuild.hMutex = NULL;
+    CPLFree(overviewBuild.pszFilename);
+    overviewBuild.pszFilename = NULL;
 }